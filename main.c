@@ -60,16 +60,35 @@ main (void)
     }
   printf ("[status] screen VCOM: -%.2f [V]\n\r", (float) usec_vcom / 1000);
 
+  /* send and refresh only changed parts of the screen */
+  status = usec_set_shadow (ctx, 1);
+  if (status != USEC_DEV_OK)
+    printf ("[warning] cannot enable shadow framebuffer\n\r");
+
+  /* whole panel changes at once */
+  if (usec_set_dpy_mode (ctx, DPY_MODE_SYNC) != USEC_DEV_OK)
+    printf ("[warning] cannot enable synchronized display\n\r");
+
+  /* upload next image while the previous one is being displayed */
+  if (status == USEC_DEV_OK)
+    {
+      status = usec_set_img_buffers (ctx, 2);
+      if (status != USEC_DEV_OK)
+        printf ("[warning] cannot enable double buffering\n\r");
+    }
+
   /* cleanup screen - fullscreen update with UPDATE_MODE_INIT mode */
   screen_cleanup (ctx);
 
-  /* fullscreen updates with UPDATE_MODE_GC16 mode */
+  /* fullscreen updates with UPDATE_MODE_AUTO mode; demo_image_fullscreen()
+     returns once the waveform is done, sleep() only keeps every image on
+     screen long enough to be looked at */
   demo_image_fullscreen (ctx, "images/img_1.png");
-  sleep(2); /* only for demo purposes */
+  sleep(2);
   demo_image_fullscreen (ctx, "images/img_2.png");
-  sleep(2); /* only for demo purposes */
+  sleep(2);
   demo_image_fullscreen (ctx, "images/img_3.png");
-  sleep(2); /* only for demo purposes */
+  sleep(2);
 
   /* screen cleanup */
   screen_cleanup (ctx);
@@ -126,9 +145,9 @@ demo_image_fullscreen (usec_ctx    *ctx,
       return DEMO_ERR;
     }
 
-  /* fullscreen update with UPDATE_MODE_GC16 */
+  /* fullscreen update - waveform picked from the image content */
   printf ("[demo] displaying '%s' image\n\r", img_path);
-  status = usec_img_update (ctx, UPDATE_MODE_GC16, 0);
+  status = usec_img_update (ctx, UPDATE_MODE_AUTO, 0);
   if (status != USEC_DEV_OK)
     {
       printf ("[error] cannot display '%s' image\n\r", img_path);
@@ -136,6 +155,11 @@ demo_image_fullscreen (usec_ctx    *ctx,
       return DEMO_ERR;
     }
 
+  /* wait for the waveform - panel is free for the next image */
+  status = usec_wait_ready (ctx, 5000);
+  if (status != USEC_DEV_OK)
+    printf ("[warning] display engine still busy\n\r");
+
   /* cleanup */
   stbi_image_free (img_data);
   return DEMO_OK;
@@ -0,0 +1,137 @@
+/*
+ * bench_kern - pixel kernels throughput on a 5760x640 (whole panel) frame,
+ * GB/s of 8bpp pixels for every kernel set the CPU can run
+ */
+
+#include "test_common.h"
+
+#define BENCH_WIDTH   (5760)
+#define BENCH_HEIGHT  (640)
+#define BENCH_PIXELS  (BENCH_WIDTH * BENCH_HEIGHT)
+#define BENCH_MIN_NS  (200000000ULL)
+
+static uint8_t *bench_a, *bench_b, *bench_out;
+
+enum
+{
+  BENCH_PACK,
+  BENCH_UNPACK,
+  BENCH_DIFF,
+  BENCH_HIST
+};
+
+/*
+ * bench_once() - one pass of kernel 'what' over the whole frame
+ */
+static void
+bench_once (const struct usec_kernels  *set,
+            uint8_t                     what,
+            uint8_t                     fmt)
+{
+  static uint8_t dirty[BENCH_WIDTH / USEC_DEV_TILE];
+  struct usec_hist hist;
+
+  switch (what)
+    {
+      case BENCH_PACK:
+        set->pack[fmt] (bench_out, bench_a, BENCH_PIXELS);
+      break;
+
+      case BENCH_UNPACK:
+        set->unpack[fmt] (bench_out, bench_a, BENCH_PIXELS);
+      break;
+
+      case BENCH_DIFF:
+        memset (dirty, 0, sizeof(dirty));
+        for (uint32_t row = 0; row < BENCH_HEIGHT; row++)
+          set->diff (bench_a + row * BENCH_WIDTH, bench_b + row * BENCH_WIDTH,
+                     BENCH_WIDTH, dirty);
+      break;
+
+      default:
+        memset (&hist, 0, sizeof(hist));
+        for (uint32_t row = 0; row < BENCH_HEIGHT; row++)
+          set->hist (bench_a + row * BENCH_WIDTH, bench_b + row * BENCH_WIDTH,
+                     BENCH_WIDTH, &hist);
+        bench_out[0] = (uint8_t) hist.changed;
+    }
+}
+
+/*
+ * bench_gbs() - repeat kernel for at least BENCH_MIN_NS, returns GB/s
+ */
+static double
+bench_gbs (const struct usec_kernels  *set,
+           uint8_t                     what,
+           uint8_t                     fmt)
+{
+  uint64_t start, ns;
+  uint32_t runs = 0;
+
+  bench_once (set, what, fmt);
+
+  start = now_ns ();
+  do
+    {
+      bench_once (set, what, fmt);
+      runs++;
+      ns = now_ns () - start;
+    }
+  while (ns < BENCH_MIN_NS);
+
+  return (double) BENCH_PIXELS * runs / (double) ns;
+}
+
+int
+main (void)
+{
+  static const char *fmt_names[] = { "1bpp", "2bpp", "4bpp" };
+  struct usec_kernels sets[USEC_ISA_NUM];
+  uint8_t count = 0;
+
+  bench_a   = malloc (BENCH_PIXELS);
+  bench_b   = malloc (BENCH_PIXELS);
+  bench_out = malloc (BENCH_PIXELS);
+  if (bench_a == NULL || bench_b == NULL || bench_out == NULL)
+    return 1;
+
+  for (uint32_t i = 0; i < BENCH_PIXELS; i++)
+    bench_a[i] = (uint8_t) (i * 2654435761u >> 24);
+
+  /* next frame differs in one 400x200 window, as shadow diffs usually do */
+  memcpy (bench_b, bench_a, BENCH_PIXELS);
+  for (uint32_t row = 220; row < 420; row++)
+    for (uint32_t x = 2000; x < 2400; x++)
+      bench_b[row * BENCH_WIDTH + x] ^= 0x80;
+
+  for (uint8_t isa = USEC_ISA_SCALAR; isa < USEC_ISA_NUM; isa++)
+    if (usec_kernels_get (isa, &sets[count]) == USEC_DEV_OK)
+      count++;
+
+  printf ("%-12s", "GB/s");
+  for (uint8_t s = 0; s < count; s++)
+    printf (" %8s", sets[s].name);
+  printf ("\n");
+
+  for (uint8_t what = BENCH_PACK; what <= BENCH_HIST; what++)
+    for (uint8_t fmt = IMG_1BPP; fmt < IMG_8BPP; fmt++)
+      {
+        static const char *names[] = { "pack", "unpack", "diff", "hist" };
+        char label[16];
+
+        if (what >= BENCH_DIFF && fmt != IMG_1BPP)
+          break;
+
+        snprintf (label, sizeof(label), "%s %s", names[what],
+                  (what >= BENCH_DIFF) ? "" : fmt_names[fmt]);
+        printf ("%-12s", label);
+        for (uint8_t s = 0; s < count; s++)
+          printf (" %8.2f", bench_gbs (&sets[s], what, fmt));
+        printf ("\n");
+      }
+
+  free (bench_a);
+  free (bench_b);
+  free (bench_out);
+  return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * bench_merge - dirty rectangle merging on recorded damage patterns: every
+ * workload renders a frame sequence on one controller, tile damage of each
+ * frame is recorded the way usec_shadow_upload() does it and sent to the
+ * simulator once as raw rectangles and once merged
+ */
+
+#include "test_common.h"
+
+#define BENCH_ID      (0)
+#define BENCH_FRAMES  (40)
+#define BENCH_REPEAT  (3)
+
+struct bench_load
+{
+  const char  *name;
+  void       (*step) (uint8_t *img, uint32_t width, uint32_t height,
+                      uint32_t frame);
+};
+
+static void
+bench_box (uint8_t   *img,
+           uint32_t   width,
+           uint32_t   height,
+           uint32_t   x,
+           uint32_t   y,
+           uint32_t   w,
+           uint32_t   h)
+{
+  for (uint32_t row = y; row < y + h && row < height; row++)
+    for (uint32_t col = x; col < x + w && col < width; col++)
+      img[row * width + col] = (uint8_t) test_rand ();
+}
+
+/* text typed line by line with blinking cursor */
+static void
+bench_typing (uint8_t *img, uint32_t width, uint32_t height, uint32_t frame)
+{
+  uint32_t col = (frame * 3) % 80, line = (frame * 3) / 80;
+
+  for (uint32_t k = 0; k < 3; k++)
+    bench_box (img, width, height, 40 + (col + k) * 16, 40 + line * 28, 16,
+               24);
+  bench_box (img, width, height, 40 + (col + 3) * 16, 40 + line * 28, 2, 24);
+}
+
+/* clock digits in a corner, ticker line scrolling at the bottom */
+static void
+bench_clock (uint8_t *img, uint32_t width, uint32_t height, uint32_t frame)
+{
+  bench_box (img, width, height, width - 260, 20, 80, 60);
+  if (frame % 10 == 0)
+    bench_box (img, width, height, width - 360, 20, 80, 60);
+
+  memmove (img + (height - 48) * width, img + (height - 48) * width + 4,
+           48 * width - 4);
+}
+
+/* dashboard of status widgets, a few change every frame */
+static void
+bench_widgets (uint8_t *img, uint32_t width, uint32_t height, uint32_t frame)
+{
+  for (uint32_t n = 0; n < 5; n++)
+    {
+      uint32_t w = test_rand () % 48;
+
+      bench_box (img, width, height, 40 + (w % 12) * 112, 60 + (w / 12) * 160,
+                 64, 64);
+    }
+}
+
+/* list view scrolled by a few rows */
+static void
+bench_scroll (uint8_t *img, uint32_t width, uint32_t height, uint32_t frame)
+{
+  for (uint32_t row = 80; row < 560; row++)
+    memcpy (img + row * width + 200, img + (row + 16) * width + 200, 900);
+  bench_box (img, width, height, 200, 560, 900, 16);
+}
+
+/* single pixels all over the screen */
+static void
+bench_sparkle (uint8_t *img, uint32_t width, uint32_t height, uint32_t frame)
+{
+  for (uint32_t n = 0; n < 150; n++)
+    img[(test_rand () % height) * width + test_rand () % width] ^= 0x80;
+}
+
+/* dialog opening and closing, mouse pointer moving */
+static void
+bench_dialog (uint8_t *img, uint32_t width, uint32_t height, uint32_t frame)
+{
+  if (frame % 10 == 0)
+    bench_box (img, width, height, 420, 170, 600, 300);
+  bench_box (img, width, height, (frame * 37) % (width - 16),
+             (frame * 23) % (height - 16), 16, 16);
+}
+
+/*
+ * bench_send() - upload rectangles of 'img' one command sequence each, best
+ * of BENCH_REPEAT runs so that scheduler hiccups of simulated bus time do
+ * not count
+ */
+static uint64_t
+bench_send (usec_ctx                *ctx,
+            const struct usec_rect  *rects,
+            uint32_t                 count,
+            uint8_t                 *img)
+{
+  uint32_t width = ctx->dev_width[BENCH_ID];
+  uint64_t best = UINT64_MAX;
+
+  for (uint8_t run = 0; run < BENCH_REPEAT; run++)
+    {
+      uint64_t start = now_ns (), ns;
+
+      for (uint32_t i = 0; i < count; i++)
+        it8951_cmd_load_img (ctx, BENCH_ID,
+                             img + rects[i].y * width + rects[i].x,
+                             rects[i].x, rects[i].y, rects[i].w, rects[i].h,
+                             width);
+
+      ns = now_ns () - start;
+      if (ns < best)
+        best = ns;
+    }
+
+  return best;
+}
+
+int
+main (void)
+{
+  static const struct bench_load loads[] = {
+    { "typing",  bench_typing  },
+    { "clock",   bench_clock   },
+    { "widgets", bench_widgets },
+    { "scroll",  bench_scroll  },
+    { "sparkle", bench_sparkle },
+    { "dialog",  bench_dialog  },
+  };
+  usec_sim_cfg cfg = { .cmd_latency_us = 125, .byte_latency_ns = 25 };
+  struct usec_arena *arena;
+  struct usec_rect *raw;
+  uint32_t width, height, tiles;
+  uint8_t *img, *prev;
+  usec_ctx *ctx;
+
+  ctx = usec_init_sim (&cfg);
+  if (ctx == NULL || usec_set_shadow (ctx, 1) != USEC_DEV_OK)
+    return 1;
+
+  arena  = ctx->dev_arena[BENCH_ID];
+  width  = ctx->dev_width[BENCH_ID];
+  height = ctx->dev_height[BENCH_ID];
+  tiles  = arena->tiles_x * arena->tiles_y;
+
+  img  = malloc (width * height);
+  prev = malloc (width * height);
+  raw  = malloc (tiles * sizeof(*raw));
+  if (img == NULL || prev == NULL || raw == NULL)
+    return 1;
+
+  printf ("%-8s %10s %10s %10s %10s %10s\n", "load", "raw rects",
+          "merged", "raw ms", "merged ms", "merge us");
+
+  for (uint8_t l = 0; l < sizeof(loads) / sizeof(loads[0]); l++)
+    {
+      uint64_t raw_rects = 0, rects = 0, raw_ns = 0, ns = 0, merge_ns = 0;
+
+      for (uint32_t i = 0; i < width * height; i++)
+        img[i] = (uint8_t) test_rand ();
+
+      for (uint32_t frame = 0; frame < BENCH_FRAMES; frame++)
+        {
+          uint32_t count;
+          uint64_t start;
+
+          memcpy (prev, img, width * height);
+          loads[l].step (img, width, height, frame);
+
+          /* record damage as usec_shadow_upload() sees it */
+          memset (arena->tile_dirty, 0, tiles);
+          for (uint32_t row = 0; row < height; row++)
+            usec_kern.diff (prev + row * width, img + row * width, width,
+                            arena->tile_dirty +
+                            (row / USEC_DEV_TILE) * arena->tiles_x);
+
+          count = usec_shadow_rects (ctx, BENCH_ID, arena->tile_dirty);
+          memcpy (raw, arena->rects, count * sizeof(*raw));
+          raw_rects += count;
+          raw_ns    += bench_send (ctx, raw, count, img);
+
+          start = now_ns ();
+          count = usec_rect_merge (ctx, BENCH_ID, arena->rects, count, NULL,
+                                   0);
+          merge_ns += now_ns () - start;
+          rects    += count;
+          ns       += bench_send (ctx, arena->rects, count, img);
+        }
+
+      printf ("%-8s %10.1f %10.1f %10.2f %10.2f %10.1f\n", loads[l].name,
+              (double) raw_rects / BENCH_FRAMES,
+              (double) rects / BENCH_FRAMES,
+              (double) raw_ns / 1e6 / BENCH_FRAMES,
+              (double) ns / 1e6 / BENCH_FRAMES,
+              (double) merge_ns / 1e3 / BENCH_FRAMES);
+    }
+
+  free (img);
+  free (prev);
+  free (raw);
+  usec_deinit (ctx);
+  return 0;
+}
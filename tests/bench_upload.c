@@ -0,0 +1,143 @@
+/*
+ * bench_upload - frame upload through usec_img_upload() (renderer fills
+ * user buffer, library copies it to the kernel) against usec_img_render()
+ * (renderer fills mapped sg reserved buffer), simulated controllers
+ */
+
+#include "test_common.h"
+
+#define BENCH_FRAMES  (20)
+#define BENCH_WIDTH   (1440)
+#define BENCH_HEIGHT  (640)
+#define BENCH_SIZE    (4 * BENCH_WIDTH * BENCH_HEIGHT)
+
+/*
+ * bench_pixels() - synthetic renderer, every frame differs; rows are filled
+ * with memset() so that both paths pay the same for pixels whether the
+ * compiler sees the renderer directly or through usec_render_fn
+ */
+static void
+bench_pixels (uint8_t   *dst,
+              uint32_t   first_row,
+              uint32_t   rows,
+              uint32_t   frame)
+{
+  for (uint32_t y = 0; y < rows; y++)
+    memset (dst + y * BENCH_WIDTH, (uint8_t) ((first_row + y) * 3 + frame),
+            BENCH_WIDTH);
+}
+
+/*
+ * bench_render() - usec_render_fn, 'user_data' points to frame number
+ */
+static void
+bench_render (void      *user_data,
+              uint8_t    id,
+              uint32_t   row,
+              uint32_t   rows,
+              uint8_t   *dst)
+{
+  bench_pixels (dst, id * BENCH_HEIGHT + row, rows, *(uint32_t *) user_data);
+}
+
+/*
+ * bench_check() - panel must show the last frame
+ */
+static uint8_t
+bench_check (usec_ctx  *ctx,
+             uint8_t   *img,
+             uint32_t   frame)
+{
+  bench_pixels (img, 0, 4 * BENCH_HEIGHT, frame);
+
+  if (usec_img_update (ctx, UPDATE_MODE_GC16, 0) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    if (memcmp (usec_sim_get_panel (ctx, cnt),
+                img + cnt * BENCH_WIDTH * BENCH_HEIGHT,
+                BENCH_WIDTH * BENCH_HEIGHT))
+      return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * bench_run() - average frame time [ms] of one path, negative on failure
+ */
+static double
+bench_run (const usec_sim_cfg  *cfg,
+           uint8_t              render)
+{
+  usec_ctx *ctx;
+  uint8_t *img;
+  uint64_t start;
+  uint32_t frame;
+  double ms = -1.0;
+
+  ctx = usec_init_sim (cfg);
+  if (ctx == NULL)
+    return ms;
+
+  img = malloc (BENCH_SIZE);
+  if (img == NULL ||
+      (render && usec_set_mmap_mode (ctx, 1) != USEC_DEV_OK))
+    goto out;
+
+  start = now_ns ();
+  for (frame = 0; frame < BENCH_FRAMES; frame++)
+    {
+      uint8_t status;
+
+      if (render)
+        {
+          status = usec_img_render (ctx, bench_render, &frame);
+        }
+      else
+        {
+          bench_pixels (img, 0, 4 * BENCH_HEIGHT, frame);
+          status = usec_img_upload (ctx, img, BENCH_SIZE);
+        }
+
+      if (status != USEC_DEV_OK)
+        goto out;
+    }
+  ms = (double) (now_ns () - start) / 1e6 / BENCH_FRAMES;
+
+  if (bench_check (ctx, img, frame - 1) != USEC_DEV_OK)
+    ms = -1.0;
+
+out:
+  free (img);
+  usec_deinit (ctx);
+  return ms;
+}
+
+int
+main (void)
+{
+  static const usec_sim_cfg cfgs[] = {
+    { .cmd_latency_us = 0,   .byte_latency_ns = 0  },
+    { .cmd_latency_us = 125, .byte_latency_ns = 25 },
+  };
+  static const char *names[] = { "cpu only", "usb2 link" };
+
+  printf ("%-10s %14s %14s\n", "link", "upload [ms]", "render [ms]");
+  for (uint8_t i = 0; i < sizeof(cfgs) / sizeof(cfgs[0]); i++)
+    {
+      double upload = bench_run (&cfgs[i], 0);
+      double render = bench_run (&cfgs[i], 1);
+
+      if (upload < 0.0 || render < 0.0)
+        {
+          printf ("%s: FAILED\n", names[i]);
+          return 1;
+        }
+
+      printf ("%-10s %14.2f %14.2f  (%.0f / %.0f MB/s)\n", names[i],
+              upload, render, BENCH_SIZE / upload / 1e3,
+              BENCH_SIZE / render / 1e3);
+    }
+
+  return 0;
+}
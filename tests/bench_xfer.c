@@ -0,0 +1,94 @@
+/*
+ * bench_xfer - fullscreen upload throughput against transfer chunk size,
+ * chunk size is capped through simulated adapter limit (max_xfer_len)
+ */
+
+#include "test_common.h"
+
+#define BENCH_FRAMES  (10)
+#define BENCH_SIZE    (4 * 1440 * 640)
+
+/*
+ * bench_run() - upload throughput [MB/s], negative on failure
+ */
+static double
+bench_run (uint32_t   max_xfer_len,
+           uint32_t  *xfer_len,
+           uint64_t  *cmds)
+{
+  usec_sim_cfg cfg = {
+    .cmd_latency_us  = 125,
+    .byte_latency_ns = 25,
+    .max_xfer_len    = max_xfer_len,
+  };
+  usec_stats before, after;
+  usec_ctx *ctx;
+  uint8_t *img;
+  uint64_t start, ns;
+
+  ctx = usec_init_sim (&cfg);
+  if (ctx == NULL)
+    return -1.0;
+
+  img = malloc (BENCH_SIZE);
+  if (img == NULL)
+    {
+      usec_deinit (ctx);
+      return -1.0;
+    }
+
+  usec_get_stats (ctx, &before);
+  start = now_ns ();
+  for (uint32_t frame = 0; frame < BENCH_FRAMES; frame++)
+    {
+      memset (img, frame, BENCH_SIZE);
+      if (usec_img_upload (ctx, img, BENCH_SIZE) != USEC_DEV_OK)
+        {
+          start = 0;
+          break;
+        }
+    }
+  ns = now_ns () - start;
+  usec_get_stats (ctx, &after);
+
+  *xfer_len = ctx->dev_xfer_len[0];
+  *cmds = (after.cmd_count - before.cmd_count) / BENCH_FRAMES;
+
+  free (img);
+  usec_deinit (ctx);
+
+  if (start == 0)
+    return -1.0;
+
+  return (double) BENCH_SIZE * BENCH_FRAMES / ((double) ns / 1e3);
+}
+
+int
+main (void)
+{
+  static const uint32_t limits[] = {
+    USEC_DEV_SPT_LEN, 96 * 1024, 128 * 1024, 192 * 1024,
+    USEC_DEV_MAX_XFER_LEN
+  };
+
+  printf ("%10s %10s %12s %10s\n", "limit [B]", "chunk [B]", "cmds/frame",
+          "MB/s");
+  for (uint8_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++)
+    {
+      uint32_t xfer_len;
+      uint64_t cmds;
+      double mbs;
+
+      mbs = bench_run (limits[i], &xfer_len, &cmds);
+      if (mbs < 0.0)
+        {
+          printf ("%10u: FAILED\n", limits[i]);
+          return 1;
+        }
+
+      printf ("%10u %10u %12" PRIu64 " %10.1f\n", limits[i], xfer_len, cmds,
+              mbs);
+    }
+
+  return 0;
+}
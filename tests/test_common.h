@@ -0,0 +1,25 @@
+/*
+ * test_common.h - shared by programs in tests/: library internals and the
+ * simulated controllers through usec_dev.c, pseudo-random input
+ */
+
+#ifndef __USEC_TEST_COMMON_H_
+#define __USEC_TEST_COMMON_H_
+
+#include "usec_dev.c"
+
+/*
+ * test_rand() - xorshift, same sequence on every run
+ */
+static uint32_t
+test_rand (void)
+{
+  static uint32_t state = 2463534242u;
+
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+#endif /* __USEC_TEST_COMMON_H_ */
@@ -0,0 +1,176 @@
+/*
+ * test_format - display commands must use the format of the image buffer
+ * they show, not of the last upload: 1bpp and 8bpp frames mixed with double
+ * buffering, idle cleaning and cached frames on simulated controllers
+ */
+
+#include "test_common.h"
+
+#define TEST_SIZE  (4 * USEC_SIM_WIDTH * USEC_SIM_HEIGHT)
+
+static uint8_t *test_img;
+static uint8_t *test_bits;
+static uint8_t *test_expect;
+static uint32_t test_fails;
+
+/*
+ * test_gray() - 8bpp frame with all gray levels, 'seed' shifts the pattern
+ */
+static void
+test_gray (uint8_t seed)
+{
+  for (size_t i = 0; i < TEST_SIZE; i++)
+    test_img[i] = (uint8_t) (i / USEC_SIM_WIDTH + i % USEC_SIM_WIDTH + seed);
+}
+
+/*
+ * test_mono() - 1bpp frame in test_bits, its 8bpp look in test_expect
+ */
+static void
+test_mono (uint8_t seed)
+{
+  for (size_t i = 0; i < TEST_SIZE / 8; i++)
+    test_bits[i] = (uint8_t) ((i / 180) * 37 + seed);
+
+  usec_img_unpack (test_expect, test_bits, TEST_SIZE, IMG_1BPP);
+}
+
+/*
+ * test_panel() - panels must show 'expect'
+ */
+static void
+test_panel (usec_ctx       *ctx,
+            const char     *name,
+            const uint8_t  *expect)
+{
+  for (uint8_t id = 0; id < 4; id++)
+    if (memcmp (usec_sim_get_panel (ctx, id),
+                expect + (size_t) id * USEC_SIM_WIDTH * USEC_SIM_HEIGHT,
+                USEC_SIM_WIDTH * USEC_SIM_HEIGHT))
+      {
+        printf ("FAIL %s: controller %u shows wrong image\n", name, id);
+        test_fails++;
+        return;
+      }
+}
+
+static void
+test_status (const char  *name,
+             uint8_t      status)
+{
+  if (status != USEC_DEV_OK)
+    {
+      printf ("FAIL %s\n", name);
+      test_fails++;
+    }
+}
+
+/*
+ * test_buffers() - 1bpp upload to the back buffer must not change how
+ * idle cleaning shows the 8bpp front buffer, and the other way round
+ */
+static void
+test_buffers (usec_ctx *ctx)
+{
+  test_status ("shadow", usec_set_shadow (ctx, 1));
+  test_status ("budget", usec_set_ghost_budget (ctx, 1));
+
+  /* buffer 0 keeps the image uploaded before, fast update uses up the
+     budget of every tile */
+  test_gray (0);
+  test_status ("gray upload", usec_img_upload (ctx, test_img, TEST_SIZE));
+  test_status ("buffers", usec_set_img_buffers (ctx, 2));
+  test_status ("gray update", usec_img_update (ctx, UPDATE_MODE_DU, 1));
+  test_panel (ctx, "gray frame", test_img);
+
+  test_mono (0);
+  test_status ("mono upload", usec_img_upload_fmt (ctx, test_bits,
+                                                   TEST_SIZE / 8, IMG_1BPP));
+  test_status ("idle", usec_idle (ctx));
+  test_panel (ctx, "gray front, mono back", test_img);
+
+  test_status ("mono update", usec_img_update (ctx, UPDATE_MODE_DU, 1));
+  test_panel (ctx, "mono frame", test_expect);
+
+  test_gray (1);
+  test_status ("gray upload", usec_img_upload (ctx, test_img, TEST_SIZE));
+  test_status ("gray update", usec_img_update (ctx, UPDATE_MODE_GC16, 1));
+  test_panel (ctx, "gray after mono", test_img);
+}
+
+/*
+ * test_frames() - cached frames are 8bpp whatever the live buffer holds,
+ * and showing them must not change the format of the live buffer
+ */
+static void
+test_frames (usec_ctx  *ctx,
+             uint8_t    shadow,
+             uint8_t    img_buffers)
+{
+  test_status ("shadow", usec_set_shadow (ctx, shadow));
+  test_status ("buffers", usec_set_img_buffers (ctx, img_buffers));
+  test_status ("cache", usec_set_frame_cache (ctx, 1));
+
+  /* cache hit while live buffer holds 1bpp image */
+  test_gray (2);
+  test_status ("frame", usec_frame_show (ctx, test_img, TEST_SIZE,
+                                         UPDATE_MODE_GC16, 1));
+  test_panel (ctx, "cached frame", test_img);
+
+  test_mono (1);
+  test_status ("mono upload", usec_img_upload_fmt (ctx, test_bits,
+                                                   TEST_SIZE / 8, IMG_1BPP));
+  test_status ("mono update", usec_img_update (ctx, UPDATE_MODE_DU, 1));
+  test_panel (ctx, "mono live", test_expect);
+
+  test_status ("frame hit", usec_frame_show (ctx, test_img, TEST_SIZE,
+                                             UPDATE_MODE_GC16, 1));
+  test_panel (ctx, "frame hit over mono", test_img);
+
+  /* cache miss must leave the 1bpp live buffer alone */
+  test_mono (2);
+  test_status ("mono upload", usec_img_upload_fmt (ctx, test_bits,
+                                                   TEST_SIZE / 8, IMG_1BPP));
+  test_gray (3);
+  test_status ("frame miss", usec_frame_show (ctx, test_img, TEST_SIZE,
+                                              UPDATE_MODE_GC16, 1));
+  test_panel (ctx, "frame miss over mono", test_img);
+
+  test_status ("mono update", usec_img_update (ctx, UPDATE_MODE_GC16, 1));
+  test_panel (ctx, "mono after frame", test_expect);
+}
+
+int
+main (void)
+{
+  usec_sim_cfg cfg = { 0 };
+  usec_ctx *ctx;
+
+  test_img    = malloc (TEST_SIZE);
+  test_bits   = malloc (TEST_SIZE / 8);
+  test_expect = malloc (TEST_SIZE);
+  if (test_img == NULL || test_bits == NULL || test_expect == NULL)
+    return 1;
+
+  ctx = usec_init_sim (&cfg);
+  if (ctx == NULL)
+    return 1;
+  test_buffers (ctx);
+  usec_deinit (ctx);
+
+  for (uint8_t run = 0; run < 3; run++)
+    {
+      ctx = usec_init_sim (&cfg);
+      if (ctx == NULL)
+        return 1;
+      test_frames (ctx, run > 0, 1 + (run > 1));
+      usec_deinit (ctx);
+    }
+
+  printf ("test_format: %s\n", test_fails ? "FAILED" : "ok");
+
+  free (test_img);
+  free (test_bits);
+  free (test_expect);
+  return test_fails != 0;
+}
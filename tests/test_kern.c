@@ -0,0 +1,211 @@
+/*
+ * test_kern - every SIMD kernel the CPU can run must match the scalar
+ * reference bit for bit: random input, unaligned buffers, odd lengths and
+ * tails, histogram counters at their 255-iteration limit
+ */
+
+#include "test_common.h"
+
+#define TEST_MAX_PIXELS  (5760 * 4)
+#define TEST_GUARD       (64)
+
+static const uint8_t test_bpp[] = { 1, 2, 4 };
+
+static struct usec_kernels test_sets[USEC_ISA_NUM];
+static uint8_t test_count;
+static uint32_t test_fails;
+
+static void
+test_fill (uint8_t  *buf,
+           size_t    len)
+{
+  for (size_t i = 0; i < len; i++)
+    buf[i] = (uint8_t) test_rand ();
+}
+
+/*
+ * test_sets_init() - scalar reference first, then what CPU supports
+ */
+static void
+test_sets_init (void)
+{
+  for (uint8_t isa = USEC_ISA_SCALAR; isa < USEC_ISA_NUM; isa++)
+    if (usec_kernels_get (isa, &test_sets[test_count]) == USEC_DEV_OK)
+      test_count++;
+}
+
+static void
+test_fail (const char  *set,
+           const char  *kernel,
+           uint8_t      fmt,
+           size_t       len,
+           uint32_t     off)
+{
+  printf ("FAIL %s %s fmt %u len %zu offset %u\n", set, kernel, fmt, len,
+          off);
+  test_fails++;
+}
+
+/*
+ * test_pack() - pixel counts are multiples of 8 (see usec_kernel_fn), every
+ * count up to a few vectors plus long rows, misaligned source and
+ * destination; bytes past the output must stay untouched
+ */
+static void
+test_pack (void)
+{
+  static uint8_t src[TEST_MAX_PIXELS + TEST_GUARD];
+  static uint8_t ref[TEST_MAX_PIXELS + TEST_GUARD];
+  static uint8_t out[TEST_MAX_PIXELS + TEST_GUARD];
+
+  for (uint8_t fmt = IMG_1BPP; fmt < IMG_8BPP; fmt++)
+    for (size_t pixels = 8; pixels <= TEST_MAX_PIXELS;
+         pixels += (pixels < 1024) ? 8 : 1432)
+      {
+        uint32_t off = test_rand () % 32;
+        size_t bytes = pixels * test_bpp[fmt] / 8;
+
+        test_fill (src, sizeof(src));
+
+        memset (ref, 0xA5, sizeof(ref));
+        test_sets[0].pack[fmt] (ref + off, src + off, pixels);
+
+        for (uint8_t s = 1; s < test_count; s++)
+          {
+            memset (out, 0xA5, sizeof(out));
+            test_sets[s].pack[fmt] (out + off, src + off, pixels);
+            if (memcmp (out, ref, off + bytes + TEST_GUARD / 2))
+              test_fail (test_sets[s].name, "pack", fmt, pixels, off);
+          }
+
+        memset (ref, 0xA5, sizeof(ref));
+        test_sets[0].unpack[fmt] (ref + off, src + off, pixels);
+
+        for (uint8_t s = 1; s < test_count; s++)
+          {
+            memset (out, 0xA5, sizeof(out));
+            test_sets[s].unpack[fmt] (out + off, src + off, pixels);
+            if (memcmp (out, ref, off + pixels + TEST_GUARD / 2))
+              test_fail (test_sets[s].name, "unpack", fmt, pixels, off);
+          }
+      }
+}
+
+/*
+ * test_diff() - any row width, sparse single-pixel changes so that tail
+ * tiles are hit as well, dirty map starts partly set
+ */
+static void
+test_diff (void)
+{
+  static uint8_t a[TEST_MAX_PIXELS + TEST_GUARD];
+  static uint8_t b[TEST_MAX_PIXELS + TEST_GUARD];
+  uint8_t ref[TEST_MAX_PIXELS / USEC_DEV_TILE + 2];
+  uint8_t out[TEST_MAX_PIXELS / USEC_DEV_TILE + 2];
+
+  for (uint32_t width = 1; width <= 6000; width += (width < 300) ? 1 : 293)
+    {
+      uint32_t off = test_rand () % 32;
+      uint32_t tiles = (width + USEC_DEV_TILE - 1) / USEC_DEV_TILE;
+
+      test_fill (a, sizeof(a));
+      memcpy (b, a, sizeof(b));
+      for (uint32_t n = test_rand () % 4; n > 0; n--)
+        b[off + test_rand () % width] ^= 1 << (test_rand () % 8);
+
+      for (uint32_t t = 0; t < sizeof(ref); t++)
+        ref[t] = (t < tiles) && (test_rand () % 8) == 0;
+      memcpy (out, ref, sizeof(out));
+
+      test_sets[0].diff (a + off, b + off, width, ref);
+      for (uint8_t s = 1; s < test_count; s++)
+        {
+          uint8_t dirty[sizeof(out)];
+
+          memcpy (dirty, out, sizeof(dirty));
+          test_sets[s].diff (a + off, b + off, width, dirty);
+          if (memcmp (dirty, ref, sizeof(dirty)))
+            test_fail (test_sets[s].name, "diff", 0, width, off);
+        }
+    }
+}
+
+static void
+test_hist_one (const uint8_t  *src,
+               const uint8_t  *dst,
+               uint32_t        width,
+               uint32_t        off)
+{
+  struct usec_hist ref, out;
+
+  memset (&ref, 0, sizeof(ref));
+  test_sets[0].hist (src, dst, width, &ref);
+
+  for (uint8_t s = 1; s < test_count; s++)
+    {
+      memset (&out, 0, sizeof(out));
+      test_sets[s].hist (src, dst, width, &out);
+      if (memcmp (&out, &ref, sizeof(out)))
+        test_fail (test_sets[s].name, "hist", 0, width, off);
+    }
+}
+
+/*
+ * test_hist() - random rows of every width around vector and 255-iteration
+ * block boundaries, then rows where every pixel hits the same classes so
+ * 8-bit lane counters reach 255
+ */
+static void
+test_hist (void)
+{
+  static uint8_t src[2 * 255 * 32 + 256];
+  static uint8_t dst[2 * 255 * 32 + 256];
+  static const uint32_t edges[] = { 255 * 16, 255 * 32, 2 * 255 * 32 };
+  static const uint8_t fill[][2] = {
+    { 0x10, 0xF0 },       /* changed, src_gray, dst_white */
+    { 0x00, 0x30 },       /* changed, dst_gray, dst_gray4 */
+    { 0xF0, 0xF0 },       /* dst_white only */
+  };
+
+  for (uint32_t width = 1; width <= 200; width++)
+    {
+      uint32_t off = test_rand () % 32;
+
+      test_fill (src, sizeof(src));
+      test_fill (dst, sizeof(dst));
+      test_hist_one (src + off, dst + off, width, off);
+    }
+
+  for (uint8_t e = 0; e < sizeof(edges) / sizeof(edges[0]); e++)
+    for (uint32_t width = edges[e] - 33; width <= edges[e] + 33; width++)
+      {
+        uint32_t off = test_rand () % 32;
+
+        test_fill (src, sizeof(src));
+        test_fill (dst, sizeof(dst));
+        test_hist_one (src + off, dst + off, width, off);
+
+        for (uint8_t f = 0; f < sizeof(fill) / sizeof(fill[0]); f++)
+          {
+            memset (src, fill[f][0], sizeof(src));
+            memset (dst, fill[f][1], sizeof(dst));
+            test_hist_one (src + off, dst + off, width, off);
+          }
+      }
+}
+
+int
+main (void)
+{
+  test_sets_init ();
+
+  test_pack ();
+  test_diff ();
+  test_hist ();
+
+  printf ("test_kern: %s (%u kernel sets, dispatch picks %s)\n",
+          test_fails ? "FAILED" : "ok", test_count,
+          usec_kernels_init ()->name);
+
+  return test_fails != 0;
+}
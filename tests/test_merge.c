@@ -0,0 +1,244 @@
+/*
+ * test_merge - usec_rect_merge() on damage maps of simulated controllers:
+ * merged rectangles must cover every dirty tile, stay tile-aligned within
+ * the controller, keep out of tiles planned for other modes and not cost
+ * more than the unmerged set
+ */
+
+#include "test_common.h"
+
+#define TEST_ID  (0)
+
+static uint32_t test_fails;
+static uint32_t test_maps;
+
+static double
+test_cost (usec_ctx                *ctx,
+           const struct usec_rect  *rects,
+           uint32_t                 count)
+{
+  double ns = 0.0;
+
+  for (uint32_t i = 0; i < count; i++)
+    ns += usec_rect_cost (ctx, TEST_ID, &rects[i]);
+
+  return ns;
+}
+
+/*
+ * test_check() - merge rectangles of tiles set in 'mask' and verify them;
+ * 'tile_mode' as in usec_mode_plan()
+ */
+static void
+test_check (usec_ctx       *ctx,
+            const char     *name,
+            const uint8_t  *mask,
+            const uint8_t  *tile_mode,
+            uint8_t         mode)
+{
+  struct usec_arena *arena = ctx->dev_arena[TEST_ID];
+  uint32_t width  = ctx->dev_width[TEST_ID];
+  uint32_t height = ctx->dev_height[TEST_ID];
+  uint32_t tiles  = arena->tiles_x * arena->tiles_y;
+  struct usec_rect *raw;
+  uint32_t raw_count, count, bad = 0;
+  double raw_ns, ns;
+
+  raw_count = usec_shadow_rects (ctx, TEST_ID, mask);
+  raw = malloc ((raw_count + 1) * sizeof(*raw));
+  memcpy (raw, arena->rects, raw_count * sizeof(*raw));
+  raw_ns = test_cost (ctx, raw, raw_count);
+
+  count = usec_rect_merge (ctx, TEST_ID, arena->rects, raw_count, tile_mode,
+                           mode);
+  ns = test_cost (ctx, arena->rects, count);
+  test_maps++;
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+      const struct usec_rect *r = &arena->rects[i];
+
+      /* bounds and tile alignment, last tiles may be cut by the edge */
+      if (r->w == 0 || r->h == 0 || r->x + r->w > width ||
+          r->y + r->h > height || r->x % USEC_DEV_TILE ||
+          r->y % USEC_DEV_TILE ||
+          (r->w % USEC_DEV_TILE && r->x + r->w != width) ||
+          (r->h % USEC_DEV_TILE && r->y + r->h != height))
+        {
+          printf ("FAIL %s: rect %u,%u %ux%u out of bounds\n", name, r->x,
+                  r->y, r->w, r->h);
+          bad++;
+        }
+
+      if (!usec_rect_allowed (ctx, TEST_ID, r, tile_mode, mode))
+        {
+          printf ("FAIL %s: rect %u,%u %ux%u covers other mode\n", name,
+                  r->x, r->y, r->w, r->h);
+          bad++;
+        }
+    }
+
+  /* rectangles are tile-aligned, so a tile is either in or out */
+  for (uint32_t t = 0; t < tiles && !bad; t++)
+    {
+      uint32_t x = (t % arena->tiles_x) * USEC_DEV_TILE;
+      uint32_t y = (t / arena->tiles_x) * USEC_DEV_TILE;
+      uint32_t i;
+
+      if (!mask[t])
+        continue;
+
+      for (i = 0; i < count; i++)
+        {
+          const struct usec_rect *r = &arena->rects[i];
+
+          if (x >= r->x && x < r->x + r->w && y >= r->y && y < r->y + r->h)
+            break;
+        }
+
+      if (i == count)
+        {
+          printf ("FAIL %s: dirty tile %u,%u not covered\n", name, x, y);
+          bad++;
+        }
+    }
+
+  /* every join has to pay off, long lists included */
+  if (ns > raw_ns * 1.000001)
+    {
+      printf ("FAIL %s: merged %u rects cost %.0f ns, unmerged %u %.0f ns\n",
+              name, count, ns, raw_count, raw_ns);
+      bad++;
+    }
+
+  if (count > raw_count)
+    {
+      printf ("FAIL %s: %u rects grew to %u\n", name, raw_count, count);
+      bad++;
+    }
+
+  test_fails += (bad != 0);
+  free (raw);
+}
+
+/*
+ * test_maps_run() - damage maps from sparse to full, structured and random
+ */
+static void
+test_maps_run (usec_ctx *ctx)
+{
+  struct usec_arena *arena = ctx->dev_arena[TEST_ID];
+  uint32_t tx = arena->tiles_x, ty = arena->tiles_y;
+  uint32_t tiles = tx * ty;
+  uint8_t *mask = malloc (tiles);
+  uint8_t *tile_mode = malloc (tiles);
+  static const uint32_t density[] = { 1, 2, 5, 10, 20, 50, 80, 100 };
+  static const uint8_t modes[] = { UPDATE_MODE_GC16, UPDATE_MODE_DU,
+                                   UPDATE_MODE_A2 };
+  char name[64];
+
+  memset (mask, 0, tiles);
+  test_check (ctx, "empty", mask, NULL, 0);
+
+  mask[0] = 1;
+  test_check (ctx, "corner", mask, NULL, 0);
+
+  memset (mask, 0, tiles);
+  mask[tiles - 1] = 1;
+  test_check (ctx, "last tile", mask, NULL, 0);
+
+  memset (mask, 1, tiles);
+  test_check (ctx, "full", mask, NULL, 0);
+
+  for (uint32_t t = 0; t < tiles; t++)
+    mask[t] = ((t % tx) + (t / tx)) & 1;
+  test_check (ctx, "checkerboard", mask, NULL, 0);
+
+  memset (mask, 0, tiles);
+  for (uint32_t y = 2; y < ty; y += 3)
+    for (uint32_t x = 1; x < tx - 1; x++)
+      mask[y * tx + x] = 1;
+  test_check (ctx, "text lines", mask, NULL, 0);
+
+  memset (mask, 0, tiles);
+  for (uint32_t y = 0; y < ty; y++)
+    mask[y * tx + (y * 7) % tx] = mask[y * tx + tx - 1 - y] = 1;
+  test_check (ctx, "diagonals", mask, NULL, 0);
+
+  for (uint8_t d = 0; d < sizeof(density) / sizeof(density[0]); d++)
+    for (uint8_t run = 0; run < 20; run++)
+      {
+        for (uint32_t t = 0; t < tiles; t++)
+          mask[t] = (test_rand () % 100) < density[d];
+        snprintf (name, sizeof(name), "random %u%%", density[d]);
+        test_check (ctx, name, mask, NULL, 0);
+      }
+
+  /* clustered blobs, as widgets and text updates look */
+  for (uint8_t run = 0; run < 50; run++)
+    {
+      memset (mask, 0, tiles);
+      for (uint32_t n = 1 + test_rand () % 12; n > 0; n--)
+        {
+          uint32_t x0 = test_rand () % tx, y0 = test_rand () % ty;
+          uint32_t w = 1 + test_rand () % 8, h = 1 + test_rand () % 4;
+
+          for (uint32_t y = y0; y < y0 + h && y < ty; y++)
+            for (uint32_t x = x0; x < x0 + w && x < tx; x++)
+              mask[y * tx + x] = 1;
+        }
+      test_check (ctx, "blobs", mask, NULL, 0);
+    }
+
+  /* per-mode planning, merged rectangles must not take other modes */
+  for (uint8_t run = 0; run < 30; run++)
+    {
+      for (uint32_t t = 0; t < tiles; t++)
+        {
+          uint32_t r = test_rand () % 8;
+
+          tile_mode[t] = (r < 3) ? modes[r] : USEC_TILE_IDLE;
+        }
+
+      for (uint8_t m = 0; m < sizeof(modes); m++)
+        {
+          for (uint32_t t = 0; t < tiles; t++)
+            mask[t] = (tile_mode[t] == modes[m]);
+          snprintf (name, sizeof(name), "mode plan %u", modes[m]);
+          test_check (ctx, name, mask, tile_mode, modes[m]);
+        }
+    }
+
+  free (mask);
+  free (tile_mode);
+}
+
+int
+main (void)
+{
+  /* command overhead dominated link merges a lot, byte dominated hardly */
+  static const usec_sim_cfg cfgs[] = {
+    { .cmd_latency_us = 125, .byte_latency_ns = 25  },
+    { .cmd_latency_us = 1000, .byte_latency_ns = 1 },
+    { .cmd_latency_us = 5,   .byte_latency_ns = 200 },
+  };
+
+  for (uint8_t i = 0; i < sizeof(cfgs) / sizeof(cfgs[0]); i++)
+    {
+      usec_ctx *ctx = usec_init_sim (&cfgs[i]);
+
+      if (ctx == NULL || usec_set_shadow (ctx, 1) != USEC_DEV_OK)
+        {
+          printf ("FAIL cannot initialize simulator\n");
+          return 1;
+        }
+
+      test_maps_run (ctx);
+      usec_deinit (ctx);
+    }
+
+  printf ("test_merge: %s (%u damage maps)\n", test_fails ? "FAILED" : "ok",
+          test_maps);
+
+  return test_fails != 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * test_probe - it8951_cmd_probe_xfer() on simulated controllers: adapter
+ * limit reported by the transport is taken as is, unknown limit is found
+ * by trial transfers to the last whole row
+ */
+
+#include "test_common.h"
+
+#define TEST_ID  (0)
+
+static uint32_t test_fails;
+
+/*
+ * test_no_limit() - transport limit op of an adapter which tells nothing
+ */
+static uint32_t
+test_no_limit (usec_ctx  *ctx,
+               uint8_t    id)
+{
+  return 0;
+}
+
+/*
+ * test_expect() - longest whole-row transfer within 'max_xfer_len'
+ */
+static uint32_t
+test_expect (uint32_t  max_xfer_len,
+             uint32_t  width)
+{
+  uint32_t length;
+
+  if (max_xfer_len == 0 || max_xfer_len > USEC_DEV_MAX_XFER_LEN)
+    max_xfer_len = USEC_DEV_MAX_XFER_LEN;
+
+  length = sizeof(it8951_load_arg) +
+           (max_xfer_len - sizeof(it8951_load_arg)) / width * width;
+
+  return (length > USEC_DEV_SPT_LEN) ? length : USEC_DEV_SPT_LEN;
+}
+
+static void
+test_limit (uint32_t max_xfer_len)
+{
+  usec_sim_cfg cfg = { .max_xfer_len = max_xfer_len };
+  const struct usec_transport *ops;
+  struct usec_transport test_ops;
+  usec_stats before, after;
+  uint32_t width, height, length, expect;
+  usec_ctx *ctx;
+
+  ctx = usec_init_sim (&cfg);
+  if (ctx == NULL)
+    {
+      printf ("FAIL %u: init\n", max_xfer_len);
+      test_fails++;
+      return;
+    }
+
+  width  = ctx->dev_width[TEST_ID];
+  height = ctx->dev_height[TEST_ID];
+
+  /* adapter limit reported by the transport, simulator without limit
+     reports none */
+  if (max_xfer_len == 0)
+    expect = test_expect (max_xfer_len, width);
+  else
+    expect = (max_xfer_len < USEC_DEV_MAX_XFER_LEN) ? max_xfer_len :
+             USEC_DEV_MAX_XFER_LEN;
+  if (expect < USEC_DEV_SPT_LEN)
+    expect = USEC_DEV_SPT_LEN;
+  if (ctx->dev_xfer_len[TEST_ID] != expect)
+    {
+      printf ("FAIL %u: reported limit gives %u, expected %u\n",
+              max_xfer_len, ctx->dev_xfer_len[TEST_ID], expect);
+      test_fails++;
+    }
+
+  /* unknown adapter limit */
+  ops = ctx->dev_ops;
+  test_ops = *ops;
+  test_ops.limit = test_no_limit;
+  ctx->dev_ops = &test_ops;
+
+  usec_get_stats (ctx, &before);
+  length = it8951_cmd_probe_xfer (ctx, TEST_ID, width, height);
+  usec_get_stats (ctx, &after);
+
+  expect = test_expect (max_xfer_len, width);
+  if (length != expect)
+    {
+      printf ("FAIL %u: probe found %u, expected %u\n", max_xfer_len,
+              length, expect);
+      test_fails++;
+    }
+
+  /* halving plus bisection over at most 256 KiB worth of rows */
+  if (after.cmd_count - before.cmd_count > 16)
+    {
+      printf ("FAIL %u: probe took %" PRIu64 " trials\n", max_xfer_len,
+              after.cmd_count - before.cmd_count);
+      test_fails++;
+    }
+
+  ctx->dev_ops = ops;
+  usec_deinit (ctx);
+}
+
+int
+main (void)
+{
+  static const uint32_t limits[] = {
+    0, USEC_DEV_SPT_LEN, 64 * 1024, 96 * 1024, 100000, 128 * 1024,
+    192 * 1024, 200000, USEC_DEV_MAX_XFER_LEN - 1, USEC_DEV_MAX_XFER_LEN,
+  };
+
+  for (uint8_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++)
+    test_limit (limits[i]);
+
+  printf ("test_probe: %s\n", test_fails ? "FAILED" : "ok");
+
+  return test_fails != 0;
+}
@@ -0,0 +1,293 @@
+/*
+ * test_stress - concurrent callers of one usec_ctx, built with
+ * ThreadSanitizer: area uploads on every controller from its own thread,
+ * temperature/VCOM/busy readers and setters, then latest-frame-wins
+ * submissions; panel contents must match what was sent last. A frame whose
+ * upload fails must stay queued and be shown on the next wake-up.
+ */
+
+#include "test_common.h"
+
+#define TEST_UPLOADS  (10)
+#define TEST_SUBMITS  (20)
+
+static usec_ctx *test_ctx;
+static uint8_t *test_img;
+static uint32_t test_width, test_height;
+static int test_stop;
+static int test_errors;
+static int test_fail;
+static const struct usec_transport *test_ops;
+
+/*
+ * test_error() - calls from helper threads only count, main reports them
+ */
+static void
+test_error (const char  *what,
+            uint8_t      status)
+{
+  if (status != USEC_DEV_OK)
+    {
+      printf ("FAIL %s\n", what);
+      __atomic_add_fetch (&test_errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int
+test_running (void)
+{
+  return !__atomic_load_n (&test_stop, __ATOMIC_RELAXED);
+}
+
+/*
+ * test_area() - strips of one controller uploaded and refreshed; every
+ * thread writes only its own quarter of test_img
+ */
+static void *
+test_area (void *arg)
+{
+  uint8_t id = (uint8_t) (uintptr_t) arg;
+  uint32_t top = id * test_height;
+
+  for (uint32_t n = 0; n < TEST_UPLOADS; n++)
+    {
+      uint32_t y = top + (n * 97) % (test_height - 120);
+      uint32_t x = (n * 131) % (test_width - 400);
+      uint8_t *dst = test_img + (size_t) y * test_width + x;
+
+      for (uint32_t row = 0; row < 120; row++)
+        memset (dst + (size_t) row * test_width, (id * 64 + n * 16) & 0xF0,
+                400);
+
+      test_error ("area upload", usec_img_upload_area (test_ctx, x, y, 400,
+                                                       120, dst,
+                                                       test_width));
+      test_error ("area update", usec_img_update_area (test_ctx, x, y, 400,
+                                                       120, UPDATE_MODE_GC16,
+                                                       0));
+    }
+
+  return NULL;
+}
+
+static void *
+test_reader (void *arg)
+{
+  while (test_running ())
+    {
+      uint16_t vcom;
+      uint8_t temp, busy;
+
+      test_error ("temp", usec_get_temp (test_ctx, &temp));
+      test_error ("vcom", usec_get_vcom (test_ctx, &vcom));
+      test_error ("busy", usec_is_busy (test_ctx, &busy));
+    }
+
+  return NULL;
+}
+
+static void *
+test_setter (void *arg)
+{
+  for (uint32_t n = 0; test_running (); n++)
+    {
+      test_error ("upload mode", usec_set_upload_mode (test_ctx, n & 1));
+      test_error ("dpy mode", usec_set_dpy_mode (test_ctx, (n >> 1) & 1));
+      test_error ("queue depth", usec_set_queue_depth (test_ctx,
+                                                       1 + n % 4));
+      test_error ("ghost budget", usec_set_ghost_budget (test_ctx, n % 4));
+      test_error ("power policy", usec_set_power_policy (test_ctx,
+                                                         n % 3, 1));
+      sleep_ns (200000);
+    }
+
+  return NULL;
+}
+
+/*
+ * test_panel() - refresh everything and compare with test_img
+ */
+static uint32_t
+test_panel (const char *name)
+{
+  uint32_t bad = 0;
+
+  test_error ("final update", usec_img_update (test_ctx, UPDATE_MODE_GC16,
+                                               1));
+  test_error ("final wait", usec_wait_ready (test_ctx, 5000));
+
+  for (uint8_t id = 0; id < 4; id++)
+    if (memcmp (usec_sim_get_panel (test_ctx, id),
+                test_img + (size_t) id * test_width * test_height,
+                (size_t) test_width * test_height))
+      {
+        printf ("FAIL %s: controller %u shows wrong image\n", name, id);
+        bad++;
+      }
+
+  return bad;
+}
+
+/*
+ * test_xfer(), test_submit() - simulator transfers that fail while test_fail
+ * is set
+ */
+static uint8_t
+test_xfer (usec_ctx          *ctx,
+           uint8_t            id,
+           it8951_sg_io_hdr  *hdr)
+{
+  if (__atomic_load_n (&test_fail, __ATOMIC_SEQ_CST))
+    return USEC_DEV_ERR;
+
+  return test_ops->xfer (ctx, id, hdr);
+}
+
+static uint8_t
+test_submit (usec_ctx          *ctx,
+             uint8_t            id,
+             it8951_sg_io_hdr  *hdr)
+{
+  if (__atomic_load_n (&test_fail, __ATOMIC_SEQ_CST))
+    return USEC_DEV_ERR;
+
+  return test_ops->submit (ctx, id, hdr);
+}
+
+/*
+ * test_retry() - failed frame is counted and shown once transfers work again
+ */
+static uint32_t
+test_retry (void)
+{
+  usec_sim_cfg cfg = { .cmd_latency_us = 20 };
+  struct usec_transport fail_ops;
+  usec_stats stats;
+  size_t size;
+  uint32_t bad = 0;
+
+  test_ctx = usec_init_sim (&cfg);
+  if (test_ctx == NULL)
+    return 1;
+
+  test_width  = test_ctx->dev_width[0];
+  test_height = test_ctx->dev_height[0];
+  size        = (size_t) test_width * test_height * 4;
+
+  test_ops = test_ctx->dev_ops;
+  fail_ops = *test_ops;
+  fail_ops.xfer   = test_xfer;
+  fail_ops.submit = test_submit;
+  test_ctx->dev_ops = &fail_ops;
+
+  test_error ("submit queue", usec_set_submit_queue (test_ctx, 1));
+
+  __atomic_store_n (&test_fail, 1, __ATOMIC_SEQ_CST);
+  memset (test_img, 0x70, size);
+  test_error ("submit", usec_img_submit (test_ctx, test_img, size,
+                                         UPDATE_MODE_GC16));
+  do
+    {
+      sleep_ns (1000000);
+      usec_get_stats (test_ctx, &stats);
+    }
+  while (stats.submit_errors == 0);
+  __atomic_store_n (&test_fail, 0, __ATOMIC_SEQ_CST);
+
+  /* stopping the queue wakes the thread up, it retries the frame */
+  test_error ("submit drain", usec_set_submit_queue (test_ctx, 0));
+  test_ctx->dev_ops = test_ops;
+  bad += test_panel ("retried frame");
+
+  usec_get_stats (test_ctx, &stats);
+  if (stats.submit_drops != 0)
+    {
+      printf ("FAIL retried frame: %" PRIu64 " drops\n", stats.submit_drops);
+      bad++;
+    }
+
+  usec_deinit (test_ctx);
+  return bad;
+}
+
+/*
+ * test_run() - one context configuration through both phases
+ */
+static uint32_t
+test_run (uint8_t shadow,
+          uint8_t img_buffers)
+{
+  usec_sim_cfg cfg = { .cmd_latency_us = 20, .byte_latency_ns = 1,
+                       .update_us = 500 };
+  size_t size;
+  pthread_t area[4], reader, setter;
+  uint32_t bad = 0;
+
+  test_ctx = usec_init_sim (&cfg);
+  if (test_ctx == NULL)
+    return 1;
+
+  test_width  = test_ctx->dev_width[0];
+  test_height = test_ctx->dev_height[0];
+  size        = (size_t) test_width * test_height * 4;
+
+  if (usec_set_shadow (test_ctx, shadow) != USEC_DEV_OK ||
+      usec_set_img_buffers (test_ctx, img_buffers) != USEC_DEV_OK)
+    return 1;
+
+  memset (test_img, 0xF0, size);
+  test_error ("first upload", usec_img_upload (test_ctx, test_img, size));
+  bad += test_panel ("first frame");
+
+  /* area uploads, readers and setters */
+  __atomic_store_n (&test_stop, 0, __ATOMIC_RELAXED);
+  pthread_create (&reader, NULL, test_reader, NULL);
+  pthread_create (&setter, NULL, test_setter, NULL);
+  for (uint8_t id = 0; id < 4; id++)
+    pthread_create (&area[id], NULL, test_area, (void*) (uintptr_t) id);
+  for (uint8_t id = 0; id < 4; id++)
+    pthread_join (area[id], NULL);
+  bad += test_panel ("area uploads");
+
+  /* latest-frame-wins submissions, readers and setters still running */
+  test_error ("submit queue", usec_set_submit_queue (test_ctx, 1));
+  for (uint32_t f = 0; f < TEST_SUBMITS; f++)
+    {
+      for (uint32_t row = 0; row < test_height * 4; row++)
+        memset (test_img + (size_t) row * test_width,
+                ((row / 64 + f) * 16) & 0xF0, test_width);
+      test_error ("submit", usec_img_submit (test_ctx, test_img, size,
+                                             (f & 1) ? UPDATE_MODE_GC16 :
+                                             UPDATE_MODE_DU));
+      sleep_ns (1000000);
+    }
+  test_error ("submit drain", usec_set_submit_queue (test_ctx, 0));
+
+  __atomic_store_n (&test_stop, 1, __ATOMIC_RELAXED);
+  pthread_join (reader, NULL);
+  pthread_join (setter, NULL);
+  bad += test_panel ("submitted frames");
+
+  usec_deinit (test_ctx);
+  return bad;
+}
+
+int
+main (void)
+{
+  uint32_t bad = 0;
+
+  test_img = malloc ((size_t) USEC_SIM_WIDTH * USEC_SIM_HEIGHT * 4);
+  if (test_img == NULL)
+    return 1;
+
+  bad += test_run (0, 1);
+  bad += test_run (1, 1);
+  bad += test_run (1, 2);
+  bad += test_retry ();
+
+  printf ("test_stress: %s\n", (bad || test_errors) ? "FAILED" : "ok");
+
+  free (test_img);
+  return bad || test_errors;
+}
@@ -1,12 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <glob.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <scsi/sg.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "usec_dev.h"
 
 /******************************************************************************/
@@ -24,6 +37,52 @@
 #define IT8951_USB_OP_FAST_WRITE_MEM  (0xA5)
 #define IT8951_USB_OP_AUTO_RESET      (0xA7)
 
+/* controller registers */
+#define IT8951_REG_BASE               (0x18000000)
+#define IT8951_REG_UP1SR              (IT8951_REG_BASE + 0x1138)
+#define IT8951_REG_BGVR               (IT8951_REG_BASE + 0x1250)
+#define IT8951_REG_LUTAFSR            (IT8951_REG_BASE + 0x1224)
+
+#define IT8951_UP1SR_1BPP             (1 << 18)
+
+/* gray values of set/cleared bits in 1bpp mode */
+#define IT8951_1BPP_FRONT_GRAY        (0xFF)
+#define IT8951_1BPP_BACK_GRAY         (0x00)
+
+/* not exported by every libc copy of <scsi/sg.h> */
+#ifndef SG_FLAG_MMAP_IO
+#define SG_FLAG_MMAP_IO               (4)
+#endif
+
+/* tile without planned update (usec_mode_plan()) */
+#define USEC_TILE_IDLE                (0xFF)
+
+/* usec_lock() mask of all controllers */
+#define USEC_LOCK_ALL                 (0x0F)
+
+/* transfer cost model - opcodes, priors (USB 2.0 bulk round trip, ~33 MB/s),
+   prior weights and sample decay */
+#define USEC_COST_OP_LD_IMG           (0)
+#define USEC_COST_OP_MEM              (1)
+#define USEC_COST_OP_FAST_MEM         (2)
+#define USEC_COST_OPS                 (3)
+#define USEC_COST_PRIOR_CMD_NS        (250000.0)
+#define USEC_COST_PRIOR_BYTE_NS       (30.0)
+#define USEC_COST_LAMBDA_CMD          (1.0)
+#define USEC_COST_LAMBDA_BYTE         (1.0e8)
+#define USEC_COST_DECAY               (0.9)
+
+/* simulated controller memory layout */
+#define USEC_SIM_WIDTH                (1440)
+#define USEC_SIM_HEIGHT               (640)
+#define USEC_SIM_WBF_ADDR             (0x00080000)
+#define USEC_SIM_UPDATE_BUF_BASE      (0x00100000)
+#define USEC_SIM_IMAGE_BUF_BASE       (0x00200000)
+#define USEC_SIM_NUM_IMG_BUF          (8)
+#define USEC_SIM_NUM_REGS             (16)
+#define USEC_SIM_TEMP                 (23)
+#define USEC_SIM_VCOM                 (1530)
+
 /******************************************************************************/
 
 typedef struct
@@ -78,35 +137,307 @@ enum {
   IT8951_TEMP_SET
 };
 
+typedef uint8_t (*usec_job_fn) (usec_ctx *ctx, uint8_t id, void *arg);
+
+/*
+ * Transport backend - everything below it8951_cmd_*() layer goes through
+ * these callbacks, so the same command code can drive real controllers (sg)
+ * or the in-process simulator.
+ */
+struct usec_transport
+{
+  uint8_t  (*open)   (usec_ctx *ctx, uint8_t id, const void *cfg);
+  void     (*close)  (usec_ctx *ctx, uint8_t id);
+  uint8_t  (*xfer)   (usec_ctx *ctx, uint8_t id, it8951_sg_io_hdr *hdr);
+  uint8_t  (*submit) (usec_ctx *ctx, uint8_t id, it8951_sg_io_hdr *hdr);
+  uint8_t  (*reap)   (usec_ctx *ctx, uint8_t id, it8951_sg_io_hdr *hdr,
+                      int timeout);
+  void    *(*map)    (usec_ctx *ctx, uint8_t id, uint32_t length);
+  void     (*unmap)  (usec_ctx *ctx, uint8_t id, void *buf, uint32_t length);
+  uint32_t (*limit)  (usec_ctx *ctx, uint8_t id);
+};
+
+/*
+ * Command slot - header, CDB, sense and staging buffer of a single command
+ * that may be in flight while the next one is being prepared.
+ */
+struct usec_slot
+{
+  it8951_sg_io_hdr   hdr;
+  uint8_t            cdb[16];
+  uint8_t            sense[USEC_DEV_SENSE_LEN];
+  sg_iovec_t         iov[2];
+  uint8_t           *buf;
+  uint8_t            busy;
+};
+
+/*
+ * Transfer cost of a single opcode, t = cmds * cmd_ns + bytes * byte_ns;
+ * fitted with ridge regression (pulled towards the prior) over decayed
+ * sums of (cmds, bytes, time) samples.
+ */
+struct usec_cost
+{
+  double             snn, snb, sbb;
+  double             snt, sbt;
+  double             cmd_ns;
+  double             byte_ns;
+};
+
+/*
+ * Rectangle in controller coordinates [px]
+ */
+struct usec_rect
+{
+  uint32_t           x, y, w, h;
+};
+
+/*
+ * Frame cache entry - whole controller image kept in its own image buffer.
+ */
+struct usec_frame
+{
+  uint64_t           hash;
+  uint64_t           used;
+  uint8_t            valid;
+};
+
+/*
+ * Per-controller command arena - preallocated at usec_init(), so steady
+ * state upload/update path does not touch the heap.
+ */
+struct usec_arena
+{
+  struct usec_slot   cmd;
+  uint8_t           *mmap_buf;
+  uint32_t           mmap_len;
+  uint32_t           inflight;
+  uint8_t           *stage;
+  uint8_t            mode_1bpp;
+  uint8_t           *shadow;
+  uint8_t           *tile_dirty;
+  uint8_t           *tile_pending;
+  struct usec_rect  *rects;
+  double            *rect_ns;
+  double            *rect_gain;
+  uint32_t           tiles_x;
+  uint32_t           tiles_y;
+  uint8_t            shadow_valid;
+  uint8_t           *panel;
+  uint8_t            panel_valid;
+  uint8_t           *tile_mode;
+  uint8_t           *tile_mask;
+  uint16_t          *tile_ghost;
+  uint32_t           ghost;
+  uint8_t            busy;
+  uint8_t            busy_mode;
+  uint64_t           dpy_ns;
+  uint64_t           poll_ns;
+  uint64_t           ready_ns[UPDATE_MODE_AUTO];
+  uint32_t           buf_base;
+  uint32_t           front_addr;
+  uint8_t            buf_front;
+  uint8_t            buf_back;
+  uint8_t            buf_fresh;
+  uint8_t            buf_inuse;
+  uint8_t            buf_format[USEC_DEV_MAX_IMG_BUF];
+  uint8_t           *tile_stale[USEC_DEV_MAX_IMG_BUF];
+  struct usec_frame  frames[USEC_DEV_MAX_FRAMES];
+  uint64_t           frame_clock;
+  uint16_t           frame_inuse;
+  uint8_t            frame_count;
+  uint8_t            frame_slot;
+  uint8_t            frame_shown;
+  pthread_barrier_t *dpy_sync;
+  uint64_t           dpy_start_ns;
+  pthread_mutex_t    lock;
+  struct usec_cost   cost[USEC_COST_OPS];
+  struct usec_slot   slot[USEC_DEV_MAX_QUEUE];
+};
+
+struct usec_upload_arg
+{
+  uint8_t           *img_data;
+  uint8_t            img_format;
+};
+
+struct usec_area_arg
+{
+  uint8_t           *img_data;
+  uint32_t           pos_x;
+  uint32_t           pos_y;
+  uint32_t           width;
+  uint32_t           height;
+  uint32_t           stride;
+};
+
+/*
+ * Display job argument - one controller part of a display sequence.
+ */
+struct usec_dpy_arg
+{
+  usec_job_fn         job;
+  pthread_barrier_t  *sync;
+  struct usec_area_arg area;
+  const uint8_t      *img_data;
+  uint32_t            count;
+  uint8_t             update_mode;
+  uint8_t             update_wait;
+};
+
+struct usec_dio_buf
+{
+  uint8_t           *buf;
+  size_t             len;
+  uint8_t            locked;
+};
+
+struct usec_sim_reg
+{
+  uint32_t addr;
+  uint32_t val;
+};
+
+struct usec_sim
+{
+  usec_sim_cfg          cfg;
+  uint8_t              *sdram;
+  uint32_t              sdram_size;
+  uint8_t              *panel;
+  struct usec_sim_reg   reg[USEC_SIM_NUM_REGS];
+  uint8_t              *mmap_buf;
+  it8951_sg_io_hdr     *done[USEC_DEV_MAX_QUEUE];
+  uint32_t              done_head;
+  uint32_t              done_count;
+  uint16_t              vcom;
+  uint8_t               power;
+  uint64_t              busy_until;
+};
+
+struct usec_worker
+{
+  pthread_t         thread;
+  pthread_mutex_t   lock;
+  pthread_cond_t    cond;
+  usec_ctx         *ctx;
+  usec_job_fn       job;
+  void             *arg;
+  uint8_t           id;
+  uint8_t           pending;
+  uint8_t           quit;
+  uint8_t           status;
+};
+
+/*
+ * Rails power-off timer (POWER_POLICY_IDLE) - owns its command slot, 'lock'
+ * also serializes display sequences against the power-off command
+ */
+struct usec_power
+{
+  pthread_t         thread;
+  pthread_mutex_t   lock;
+  pthread_cond_t    cond;
+  usec_ctx         *ctx;
+  struct usec_slot  cmd;
+  uint64_t          deadline;   /* power-off time [ns], 0 - none */
+  uint8_t           quit;
+};
+
+/*
+ * Frame submission queue (see usec_img_submit()) - single producer, single
+ * consumer; 'state' packs frame sequence number with USEC_SUBMIT_* so that
+ * compare-and-swap never mistakes a refilled slot for the one it has seen
+ */
+#define USEC_SUBMIT_FREE     (0)
+#define USEC_SUBMIT_FILLING  (1)
+#define USEC_SUBMIT_READY    (2)
+#define USEC_SUBMIT_BUSY     (3)
+#define USEC_SUBMIT_MASK     (3)
+
+struct usec_submit_slot
+{
+  uint8_t          *img_data;
+  uint64_t          submit_ns;
+  uint8_t           update_mode;
+  uint64_t          state;
+};
+
+struct usec_submit
+{
+  pthread_t                 thread;
+  sem_t                     wake;
+  usec_ctx                 *ctx;
+  size_t                    img_size;
+  struct usec_submit_slot   slot[USEC_DEV_SUBMIT_SLOTS];
+  uint64_t                  seq;        /* producer only */
+  uint8_t                   head;       /* producer only */
+  uint8_t                   pending;    /* wake-up posted, not seen yet */
+  uint8_t                   quit;
+};
+
 /******************************************************************************/
 
 /*
- * init_io_hdr()
+ * usec_dev_alloc() - zeroed heap allocation, counted in context statistics
  */
-static it8951_sg_io_hdr *
-init_io_hdr (void)
+static void *
+usec_dev_alloc (usec_ctx  *ctx,
+                size_t     size)
 {
-  it8951_sg_io_hdr *hdr;
+  void *ptr;
 
-  hdr = (it8951_sg_io_hdr*) malloc (sizeof(it8951_sg_io_hdr));
-  memset (hdr, 0, sizeof(it8951_sg_io_hdr));
+  ptr = calloc (1, size);
+  if (ptr != NULL && ctx != NULL)
+    __atomic_add_fetch (&ctx->stats.heap_allocs, 1, __ATOMIC_RELAXED);
+
+  return ptr;
+}
+
+/*
+ * set_sense_data()
+ */
+static void
+set_sense_data (it8951_sg_io_hdr  *hdr,
+                uint8_t           *data,
+                uint32_t           length)
+{
   if (hdr)
     {
-      hdr->interface_id = 'S';
-      hdr->flags = SG_FLAG_LUN_INHIBIT;
+      hdr->sbp = data;
+      hdr->mx_sb_len = length;
     }
+}
+
+/*
+ * init_slot_hdr()
+ */
+static it8951_sg_io_hdr *
+init_slot_hdr (struct usec_slot *slot)
+{
+  it8951_sg_io_hdr *hdr = &slot->hdr;
+
+  memset (hdr, 0, sizeof(it8951_sg_io_hdr));
+  hdr->interface_id = 'S';
+  hdr->flags = SG_FLAG_LUN_INHIBIT;
+  hdr->cmdp = slot->cdb;
 
   return hdr;
 }
 
 /*
- * destroy_io_hdr()
+ * init_io_hdr() - reuse controller's preallocated command slot
  */
-static void
-destroy_io_hdr (it8951_sg_io_hdr  *hdr)
+static it8951_sg_io_hdr *
+init_io_hdr (usec_ctx  *ctx,
+             uint8_t    id)
 {
-  if (hdr)
-    free(hdr);
+  struct usec_slot *slot = &ctx->dev_arena[id]->cmd;
+  it8951_sg_io_hdr *hdr = init_slot_hdr (slot);
+
+  /* every controller reports into its own sense buffer */
+  set_sense_data (hdr, slot->sense, USEC_DEV_SENSE_LEN);
+
+  return hdr;
 }
 
 /*
@@ -125,17 +456,21 @@ set_xfer_data (it8951_sg_io_hdr  *hdr,
 }
 
 /*
- * set_sense_data()
+ * set_xfer_iovec()
  */
 static void
-set_sense_data (it8951_sg_io_hdr  *hdr,
-                uint8_t           *data,
-                uint32_t           length)
+set_xfer_iovec (it8951_sg_io_hdr  *hdr,
+                sg_iovec_t        *iov,
+                uint16_t           count)
 {
   if (hdr)
     {
-      hdr->sbp = data;
-      hdr->mx_sb_len = length;
+      hdr->dxferp = iov;
+      hdr->iovec_count = count;
+      hdr->dxfer_len = 0;
+
+      for (uint16_t i = 0; i < count; i++)
+        hdr->dxfer_len += iov[i].iov_len;
     }
 }
 
@@ -149,1087 +484,7310 @@ data_swap_32 (uint32_t input)
           ((input >> 16 & 0xFF) << 8) | (input >> 24 & 0xFF);
 }
 
-/******************************************************************************/
-/******************************************************************************/
-/******************************************************************************/
+/*
+ * put_be32()
+ */
+static void
+put_be32 (uint8_t   *buf,
+          uint32_t   val)
+{
+  buf[0] = (uint8_t)((val >> 24) & 0xFF);
+  buf[1] = (uint8_t)((val >> 16) & 0xFF);
+  buf[2] = (uint8_t)((val >> 8) & 0xFF);
+  buf[3] = (uint8_t)(val & 0xFF);
+}
 
 /*
- * scsi_it8951_cmd_inquiry()
+ * get_be32()
  */
-static uint8_t
-scsi_it8951_cmd_inquiry (int                fd,
-                         it8951_sg_io_hdr  *hdr)
+static uint32_t
+get_be32 (const uint8_t *buf)
 {
-  uint8_t cdb[16];
+  return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | \
+          ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
 
-  hdr->cmd_len = 16;
-  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
-    {
-      switch(i)
-        {
-          case 0:
-            cdb[i] = IT8951_USB_INQUIRY;
-          break;
+/*
+ * now_ns()
+ */
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
 
-          default:
-            cdb[i] = 0x00;
-          break;
-        }
-    }
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
 
-  hdr->cmdp = cdb;
-  hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+/*
+ * sleep_ns()
+ */
+static void
+sleep_ns (uint64_t ns)
+{
+  struct timespec ts;
 
-  if (ioctl (fd, SG_IO, hdr) < 0)
-    return USEC_DEV_ERR;
+  if (ns == 0)
+    return;
 
-  return USEC_DEV_OK;
+  ts.tv_sec  = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  while (nanosleep (&ts, &ts) < 0 && errno == EINTR)
+    ;
 }
 
+/******************************************************************************/
+
 /*
- * scsi_it8951_cmd_system_info()
+ * Pixel kernels - convert between 8bpp gray values and packed 1/2/4bpp
+ * formats (leftmost pixel in the least significant bits). Packing keeps the
+ * most significant bits of every gray value, unpacking replicates them back
+ * to 8 bits. Scalar versions are the reference, SIMD versions must give the
+ * same output; 'pixels' is always a multiple of 8. Diff kernels compare rows
+ * of two images tile by tile (see usec_set_shadow()), histogram kernels
+ * classify pixel transitions for UPDATE_MODE_AUTO.
  */
-static uint8_t
-scsi_it8951_cmd_system_info (int                fd,
-                             it8951_sg_io_hdr  *hdr)
-{
-  uint8_t cdb[16];
-
-  hdr->cmd_len = 16;
-  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
-    {
-      switch(i)
-        {
-          case 0:
-            cdb[i] = 0xFE;
-          break;
 
-          case 2:
-            cdb[i] = 0x38;
-          break;
+typedef void (*usec_kernel_fn) (uint8_t        *dst,
+                                const uint8_t  *src,
+                                size_t          pixels);
 
-          case 3:
-            cdb[i] = 0x39;
-          break;
+/* marks 'dirty[t]' for every USEC_DEV_TILE px wide column 't' that differs */
+typedef void (*usec_diff_fn) (const uint8_t  *a,
+                              const uint8_t  *b,
+                              uint32_t        width,
+                              uint8_t        *dirty);
 
-          case 4:
-            cdb[i] = 0x35;
-          break;
+/*
+ * Transition classes of 'src' (panel) -> 'dst' (image buffer) pixels, only
+ * the upper 4 bits (gray level) are compared
+ */
+struct usec_hist
+{
+  uint64_t           changed;     /* gray level differs */
+  uint64_t           dst_gray;    /* changed to other than black/white */
+  uint64_t           dst_gray4;   /* changed to other than 0, 5, 10, 15 */
+  uint64_t           src_gray;    /* changed from other than black/white */
+  uint64_t           dst_white;   /* white in the new image, all pixels */
+};
 
-          case 5:
-            cdb[i] = 0x31;
-          break;
+/* adds classes of 'width' pixels to 'hist' */
+typedef void (*usec_hist_fn) (const uint8_t     *src,
+                              const uint8_t     *dst,
+                              uint32_t           width,
+                              struct usec_hist  *hist);
 
-          case 6:
-            cdb[i] = IT8951_USB_OP_GET_SYS;
-          break;
+struct usec_kernels
+{
+  const char        *name;
+  usec_kernel_fn     pack[IMG_8BPP];
+  usec_kernel_fn     unpack[IMG_8BPP];
+  usec_diff_fn       diff;
+  usec_hist_fn       hist;
+};
 
-          case 8:
-            cdb[i] = 0x01;
-          break;
+/*
+ * pack_1bpp_scalar()
+ */
+static void
+pack_1bpp_scalar (uint8_t        *dst,
+                  const uint8_t  *src,
+                  size_t          pixels)
+{
+  for (size_t i = 0; i < pixels; i += 8, src += 8)
+    {
+      uint8_t out = 0;
 
-          case 10:
-            cdb[i] = 0x02;
-          break;
+      for (uint8_t bit = 0; bit < 8; bit++)
+        out |= (uint8_t)((src[bit] >> 7) << bit);
 
-          default:
-            cdb[i] = 0x00;
-        }
+      *dst++ = out;
     }
+}
 
-  hdr->cmdp = cdb;
-  hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+/*
+ * pack_2bpp_scalar()
+ */
+static void
+pack_2bpp_scalar (uint8_t        *dst,
+                  const uint8_t  *src,
+                  size_t          pixels)
+{
+  for (size_t i = 0; i < pixels; i += 4, src += 4)
+    *dst++ = (uint8_t)((src[0] >> 6) | ((src[1] >> 6) << 2) |
+                       ((src[2] >> 6) << 4) | ((src[3] >> 6) << 6));
+}
 
-  if (ioctl (fd, SG_IO, hdr) < 0)
-    return USEC_DEV_ERR;
+/*
+ * pack_4bpp_scalar()
+ */
+static void
+pack_4bpp_scalar (uint8_t        *dst,
+                  const uint8_t  *src,
+                  size_t          pixels)
+{
+  for (size_t i = 0; i < pixels; i += 2, src += 2)
+    *dst++ = (uint8_t)((src[0] >> 4) | (src[1] & 0xF0));
+}
 
-  return USEC_DEV_OK;
+/*
+ * unpack_1bpp_scalar()
+ */
+static void
+unpack_1bpp_scalar (uint8_t        *dst,
+                    const uint8_t  *src,
+                    size_t          pixels)
+{
+  for (size_t i = 0; i < pixels; i++)
+    dst[i] = ((src[i >> 3] >> (i & 7)) & 0x01) ? 0xFF : 0x00;
 }
 
 /*
- * scsi_it8951_cmd_read_mem()
+ * unpack_2bpp_scalar()
  */
-static uint8_t
-scsi_it8951_cmd_read_mem (int                fd,
-                          it8951_sg_io_hdr  *hdr,
-                          uint32_t           addr,
-                          uint16_t           length)
+static void
+unpack_2bpp_scalar (uint8_t        *dst,
+                    const uint8_t  *src,
+                    size_t          pixels)
 {
-  uint8_t cdb[16];
+  for (size_t i = 0; i < pixels; i++)
+    dst[i] = ((src[i >> 2] >> ((i & 3) * 2)) & 0x03) * 0x55;
+}
 
-  hdr->cmd_len = 16;
-  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+/*
+ * unpack_4bpp_scalar()
+ */
+static void
+unpack_4bpp_scalar (uint8_t        *dst,
+                    const uint8_t  *src,
+                    size_t          pixels)
+{
+  for (size_t i = 0; i < pixels; i++)
+    dst[i] = ((src[i >> 1] >> ((i & 1) * 4)) & 0x0F) * 0x11;
+}
+
+/*
+ * diff_row_scalar()
+ */
+static void
+diff_row_scalar (const uint8_t  *a,
+                 const uint8_t  *b,
+                 uint32_t        width,
+                 uint8_t        *dirty)
+{
+  for (uint32_t x = 0, t = 0; x < width; x += USEC_DEV_TILE, t++)
     {
-      switch(i)
-        {
-          case 0:
-            cdb[i] = 0xFE;
-          break;
+      uint32_t len = (width - x < USEC_DEV_TILE) ? (width - x) : USEC_DEV_TILE;
 
-          case 2:
-            cdb[i] = (uint8_t)((addr >> 24) & 0xFF);
-          break;
+      if (!dirty[t] && memcmp (a + x, b + x, len) != 0)
+        dirty[t] = 1;
+    }
+}
 
-          case 3:
-            cdb[i] = (uint8_t)((addr >> 16) & 0xFF);
-          break;
+/*
+ * hist_row_scalar()
+ */
+static void
+hist_row_scalar (const uint8_t     *src,
+                 const uint8_t     *dst,
+                 uint32_t           width,
+                 struct usec_hist  *hist)
+{
+  for (uint32_t x = 0; x < width; x++)
+    {
+      uint8_t s = src[x] >> 4;
+      uint8_t d = dst[x] >> 4;
 
-          case 4:
-            cdb[i] = (uint8_t)((addr >> 8) & 0xFF);
-          break;
-
-          case 5:
-            cdb[i] = (uint8_t)(addr & 0xFF);
-          break;
+      hist->dst_white += (d == 0x0F);
+      if (s == d)
+        continue;
 
-          case 6:
-            cdb[i] = IT8951_USB_OP_READ_MEM;
-          break;
+      hist->changed++;
+      hist->dst_gray  += (d != 0x00 && d != 0x0F);
+      hist->dst_gray4 += (d % 5) != 0;
+      hist->src_gray  += (s != 0x00 && s != 0x0F);
+    }
+}
 
-          case 7:
-            cdb[i] = (uint8_t)((length >> 8) & 0xFF);
-          break;
+#if defined(__x86_64__) || defined(__i386__)
 
-          case 8:
-            cdb[i] = (uint8_t)(length & 0xFF);
-          break;
+/*
+ * hist_row_sse2() - class masks are subtracted from 8-bit counters which are
+ * summed up before they can overflow
+ */
+__attribute__((target("sse2")))
+static void
+hist_row_sse2 (const uint8_t     *src,
+               const uint8_t     *dst,
+               uint32_t           width,
+               struct usec_hist  *hist)
+{
+  const __m128i lo   = _mm_set1_epi8 (0x0F);
+  const __m128i g0   = _mm_setzero_si128 ();
+  const __m128i g5   = _mm_set1_epi8 (0x05);
+  const __m128i g10  = _mm_set1_epi8 (0x0A);
+  const __m128i ones = _mm_set1_epi8 ((char) 0xFF);
+  uint32_t x = 0;
+
+  while (x + 16 <= width)
+    {
+      __m128i n_ch = g0, n_dg = g0, n_d4 = g0, n_sg = g0, n_dw = g0;
+      __m128i sum;
 
-          default:
-            cdb[i] = 0x00;
+      for (uint32_t k = 0; k < 255 && x + 16 <= width; k++, x += 16)
+        {
+          __m128i s, d, ch, dbw, d4, sbw;
+
+          s = _mm_and_si128 (_mm_srli_epi16 (
+                _mm_loadu_si128 ((const __m128i*)(src + x)), 4), lo);
+          d = _mm_and_si128 (_mm_srli_epi16 (
+                _mm_loadu_si128 ((const __m128i*)(dst + x)), 4), lo);
+
+          ch  = _mm_xor_si128 (_mm_cmpeq_epi8 (s, d), ones);
+          dbw = _mm_or_si128 (_mm_cmpeq_epi8 (d, g0), _mm_cmpeq_epi8 (d, lo));
+          d4  = _mm_or_si128 (dbw, _mm_or_si128 (_mm_cmpeq_epi8 (d, g5),
+                                                 _mm_cmpeq_epi8 (d, g10)));
+          sbw = _mm_or_si128 (_mm_cmpeq_epi8 (s, g0), _mm_cmpeq_epi8 (s, lo));
+
+          n_ch = _mm_sub_epi8 (n_ch, ch);
+          n_dg = _mm_sub_epi8 (n_dg, _mm_andnot_si128 (dbw, ch));
+          n_d4 = _mm_sub_epi8 (n_d4, _mm_andnot_si128 (d4, ch));
+          n_sg = _mm_sub_epi8 (n_sg, _mm_andnot_si128 (sbw, ch));
+          n_dw = _mm_sub_epi8 (n_dw, _mm_cmpeq_epi8 (d, lo));
         }
-    }
-
-  hdr->cmdp = cdb;
-  hdr->dxfer_direction = SG_DXFER_FROM_DEV;
 
-  if (ioctl (fd, SG_IO, hdr) < 0)
-    return USEC_DEV_ERR;
+#define HIST_SUM_SSE2(acc, field)                                         \
+      sum = _mm_sad_epu8 (acc, g0);                                       \
+      hist->field += (uint64_t) _mm_cvtsi128_si32 (sum) +                 \
+                     (uint64_t) _mm_cvtsi128_si32 (_mm_srli_si128 (sum, 8));
+
+      HIST_SUM_SSE2 (n_ch, changed)
+      HIST_SUM_SSE2 (n_dg, dst_gray)
+      HIST_SUM_SSE2 (n_d4, dst_gray4)
+      HIST_SUM_SSE2 (n_sg, src_gray)
+      HIST_SUM_SSE2 (n_dw, dst_white)
+#undef HIST_SUM_SSE2
+    }
 
-  return USEC_DEV_OK;
+  hist_row_scalar (src + x, dst + x, width - x, hist);
 }
 
 /*
- * scsi_it8951_cmd_write_mem()
+ * diff_row_sse2()
  */
-static uint8_t
-scsi_it8951_cmd_write_mem (int                fd,
-                           it8951_sg_io_hdr  *hdr,
-                           uint32_t           addr,
-                           uint16_t           length)
+__attribute__((target("sse2")))
+static void
+diff_row_sse2 (const uint8_t  *a,
+               const uint8_t  *b,
+               uint32_t        width,
+               uint8_t        *dirty)
 {
-  uint8_t cdb[16];
+  uint32_t x, t;
 
-  hdr->cmd_len = 16;
-  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+  for (x = 0, t = 0; x + USEC_DEV_TILE <= width; x += USEC_DEV_TILE, t++)
     {
-      switch(i)
-        {
-          case 0:
-            cdb[i] = 0xFE;
-          break;
+      __m128i e0, e1;
 
-          case 2:
-            cdb[i] = (uint8_t)((addr >> 24) & 0xFF);
-          break;
+      e0 = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i*)(a + x)),
+                           _mm_loadu_si128 ((const __m128i*)(b + x)));
+      e1 = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i*)(a + x + 16)),
+                           _mm_loadu_si128 ((const __m128i*)(b + x + 16)));
 
-          case 3:
-            cdb[i] = (uint8_t)((addr >> 16) & 0xFF);
-          break;
+      if (_mm_movemask_epi8 (_mm_and_si128 (e0, e1)) != 0xFFFF)
+        dirty[t] = 1;
+    }
 
-          case 4:
-            cdb[i] = (uint8_t)((addr >> 8) & 0xFF);
-          break;
+  diff_row_scalar (a + x, b + x, width - x, dirty + t);
+}
 
-          case 5:
-            cdb[i] = (uint8_t)(addr & 0xFF);
-          break;
+/*
+ * pack_1bpp_sse2() - sign bits of 16 pixels are exactly the packed bits
+ */
+__attribute__((target("sse2")))
+static void
+pack_1bpp_sse2 (uint8_t        *dst,
+                const uint8_t  *src,
+                size_t          pixels)
+{
+  size_t i;
 
-          case 6:
-#if USEC_DEV_FAST_WRITE
-            cdb[i] = IT8951_USB_OP_FAST_WRITE_MEM;
-#else
-            cdb[i] = IT8951_USB_OP_WRITE_MEM;
-#endif
-          break;
+  for (i = 0; i + 16 <= pixels; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i*)(src + i));
+      uint16_t bits = (uint16_t) _mm_movemask_epi8 (v);
 
-          case 7:
-            cdb[i] = (uint8_t)((length >> 8) & 0xFF);
-          break;
+      memcpy (dst + i / 8, &bits, sizeof(bits));
+    }
 
-          case 8:
-            cdb[i] = (uint8_t)(length & 0xFF);
-          break;
+  pack_1bpp_scalar (dst + i / 8, src + i, pixels - i);
+}
 
-          default:
-            cdb[i] = 0x00;
+/*
+ * pack_2bpp_sse2()
+ */
+__attribute__((target("sse2")))
+static void
+pack_2bpp_sse2 (uint8_t        *dst,
+                const uint8_t  *src,
+                size_t          pixels)
+{
+  const __m128i m0 = _mm_set1_epi32 (0x03);
+  const __m128i m1 = _mm_set1_epi32 (0x0C);
+  const __m128i m2 = _mm_set1_epi32 (0x30);
+  const __m128i m3 = _mm_set1_epi32 (0xC0);
+  __m128i v[4];
+  size_t i;
+
+  for (i = 0; i + 64 <= pixels; i += 64)
+    {
+      for (uint8_t k = 0; k < 4; k++)
+        {
+          __m128i w = _mm_loadu_si128 ((const __m128i*)(src + i + k * 16));
+
+          v[k] = _mm_or_si128 (
+                   _mm_or_si128 (_mm_and_si128 (_mm_srli_epi32 (w, 6), m0),
+                                 _mm_and_si128 (_mm_srli_epi32 (w, 12), m1)),
+                   _mm_or_si128 (_mm_and_si128 (_mm_srli_epi32 (w, 18), m2),
+                                 _mm_and_si128 (_mm_srli_epi32 (w, 24), m3)));
         }
+
+      _mm_storeu_si128 ((__m128i*)(dst + i / 4),
+                        _mm_packus_epi16 (_mm_packs_epi32 (v[0], v[1]),
+                                          _mm_packs_epi32 (v[2], v[3])));
     }
 
-  hdr->cmdp = cdb;
-  hdr->dxfer_direction = SG_DXFER_TO_DEV;
+  pack_2bpp_scalar (dst + i / 4, src + i, pixels - i);
+}
 
-  if (ioctl (fd, SG_IO, hdr) < 0)
-    return USEC_DEV_ERR;
+/*
+ * pack_4bpp_sse2()
+ */
+__attribute__((target("sse2")))
+static void
+pack_4bpp_sse2 (uint8_t        *dst,
+                const uint8_t  *src,
+                size_t          pixels)
+{
+  const __m128i lo = _mm_set1_epi16 (0x000F);
+  const __m128i hi = _mm_set1_epi16 (0x00F0);
+  size_t i;
 
-  return USEC_DEV_OK;
+  for (i = 0; i + 32 <= pixels; i += 32)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i*)(src + i));
+      __m128i b = _mm_loadu_si128 ((const __m128i*)(src + i + 16));
+
+      a = _mm_or_si128 (_mm_and_si128 (_mm_srli_epi16 (a, 4), lo),
+                        _mm_and_si128 (_mm_srli_epi16 (a, 8), hi));
+      b = _mm_or_si128 (_mm_and_si128 (_mm_srli_epi16 (b, 4), lo),
+                        _mm_and_si128 (_mm_srli_epi16 (b, 8), hi));
+
+      _mm_storeu_si128 ((__m128i*)(dst + i / 2), _mm_packus_epi16 (a, b));
+    }
+
+  pack_4bpp_scalar (dst + i / 2, src + i, pixels - i);
 }
 
 /*
- * scsi_it8951_cmd_read_reg()
+ * unpack_1bpp_sse2() - every packed byte is spread over 8 lanes and tested
+ * against lane bit
  */
-static uint8_t
-scsi_it8951_cmd_read_reg (int                fd,
-                          it8951_sg_io_hdr  *hdr,
-                          uint32_t           addr)
+__attribute__((target("sse2")))
+static void
+unpack_1bpp_sse2 (uint8_t        *dst,
+                  const uint8_t  *src,
+                  size_t          pixels)
 {
-  uint8_t cdb[16];
+  const __m128i bit = _mm_set_epi8 ((char) 0x80, 0x40, 0x20, 0x10,
+                                    0x08, 0x04, 0x02, 0x01,
+                                    (char) 0x80, 0x40, 0x20, 0x10,
+                                    0x08, 0x04, 0x02, 0x01);
+  size_t i;
 
-  hdr->cmd_len = 16;
-  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+  for (i = 0; i + 16 <= pixels; i += 16)
     {
-      switch(i)
-        {
-          case 0:
-            cdb[i] = 0xFE;
-          break;
+      __m128i v = _mm_set_epi64x ((int64_t)(src[i / 8 + 1] * 0x0101010101010101ULL),
+                                  (int64_t)(src[i / 8] * 0x0101010101010101ULL));
 
-          case 2:
-            cdb[i] = (uint8_t)((addr >> 24) & 0xFF);
-          break;
+      _mm_storeu_si128 ((__m128i*)(dst + i),
+                        _mm_cmpeq_epi8 (_mm_and_si128 (v, bit), bit));
+    }
 
-          case 3:
-            cdb[i] = (uint8_t)((addr >> 16) & 0xFF);
-          break;
+  unpack_1bpp_scalar (dst + i, src + i / 8, pixels - i);
+}
 
-          case 4:
-            cdb[i] = (uint8_t)((addr >> 8) & 0xFF);
-          break;
+/*
+ * unpack_2bpp_sse2()
+ */
+__attribute__((target("sse2")))
+static void
+unpack_2bpp_sse2 (uint8_t        *dst,
+                  const uint8_t  *src,
+                  size_t          pixels)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i m0 = _mm_set1_epi32 (0x00000003);
+  const __m128i m1 = _mm_set1_epi32 (0x00000300);
+  const __m128i m2 = _mm_set1_epi32 (0x00030000);
+  const __m128i m3 = _mm_set1_epi32 (0x03000000);
+  size_t i;
+
+  for (i = 0; i + 16 <= pixels; i += 16)
+    {
+      uint32_t in;
+      __m128i v, t;
 
-          case 5:
-            cdb[i] = (uint8_t)(addr & 0xFF);
-          break;
+      memcpy (&in, src + i / 4, sizeof(in));
+      v = _mm_cvtsi32_si128 ((int) in);
+      v = _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (v, zero), zero);
 
-          case 6:
-            cdb[i] = IT8951_USB_OP_READ_REG;
-          break;
+      t = _mm_or_si128 (
+            _mm_or_si128 (_mm_and_si128 (v, m0),
+                          _mm_and_si128 (_mm_slli_epi32 (v, 6), m1)),
+            _mm_or_si128 (_mm_and_si128 (_mm_slli_epi32 (v, 12), m2),
+                          _mm_and_si128 (_mm_slli_epi32 (v, 18), m3)));
 
-          case 8:
-            cdb[i] = 0x04;
-          break;
+      /* n * 0x55 == n | n << 2 | n << 4 | n << 6 for 2-bit n */
+      t = _mm_or_si128 (_mm_or_si128 (t, _mm_slli_epi32 (t, 2)),
+                        _mm_or_si128 (_mm_slli_epi32 (t, 4),
+                                      _mm_slli_epi32 (t, 6)));
 
-          default:
-            cdb[i] = 0x00;
-        }
+      _mm_storeu_si128 ((__m128i*)(dst + i), t);
     }
 
-  hdr->cmdp = cdb;
-  hdr->dxfer_direction = SG_DXFER_FROM_DEV;
-
-  if (ioctl (fd, SG_IO, hdr) < 0)
-    return USEC_DEV_ERR;
-
-  return USEC_DEV_OK;
+  unpack_2bpp_scalar (dst + i, src + i / 4, pixels - i);
 }
 
 /*
- * scsi_it8951_cmd_write_reg()
+ * unpack_4bpp_sse2()
  */
-static uint8_t
-scsi_it8951_cmd_write_reg (int                fd,
-                           it8951_sg_io_hdr  *hdr,
-                           uint32_t           addr)
+__attribute__((target("sse2")))
+static void
+unpack_4bpp_sse2 (uint8_t        *dst,
+                  const uint8_t  *src,
+                  size_t          pixels)
 {
-  uint8_t cdb[16];
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i lo = _mm_set1_epi16 (0x000F);
+  const __m128i hi = _mm_set1_epi16 (0x0F00);
+  size_t i;
 
-  hdr->cmd_len = 16;
-  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+  for (i = 0; i + 32 <= pixels; i += 32)
     {
-      switch(i)
-        {
-          case 0:
-            cdb[i] = 0xFE;
-          break;
+      __m128i v = _mm_loadu_si128 ((const __m128i*)(src + i / 2));
+      __m128i a = _mm_unpacklo_epi8 (v, zero);
+      __m128i b = _mm_unpackhi_epi8 (v, zero);
+
+      a = _mm_or_si128 (_mm_and_si128 (a, lo),
+                        _mm_and_si128 (_mm_slli_epi16 (a, 4), hi));
+      b = _mm_or_si128 (_mm_and_si128 (b, lo),
+                        _mm_and_si128 (_mm_slli_epi16 (b, 4), hi));
+
+      /* n * 0x11 == n | n << 4 for 4-bit n */
+      _mm_storeu_si128 ((__m128i*)(dst + i),
+                        _mm_or_si128 (a, _mm_slli_epi16 (a, 4)));
+      _mm_storeu_si128 ((__m128i*)(dst + i + 16),
+                        _mm_or_si128 (b, _mm_slli_epi16 (b, 4)));
+    }
 
-          case 2:
-            cdb[i] = (uint8_t)((addr >> 24) & 0xFF);
-          break;
+  unpack_4bpp_scalar (dst + i, src + i / 2, pixels - i);
+}
 
-          case 3:
-            cdb[i] = (uint8_t)((addr >> 16) & 0xFF);
-          break;
+/*
+ * pack_1bpp_avx2()
+ */
+__attribute__((target("avx2")))
+static void
+pack_1bpp_avx2 (uint8_t        *dst,
+                const uint8_t  *src,
+                size_t          pixels)
+{
+  size_t i;
 
-          case 4:
-            cdb[i] = (uint8_t)((addr >> 8) & 0xFF);
-          break;
+  for (i = 0; i + 32 <= pixels; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i*)(src + i));
+      uint32_t bits = (uint32_t) _mm256_movemask_epi8 (v);
 
-          case 5:
-            cdb[i] = (uint8_t)(addr & 0xFF);
-          break;
+      memcpy (dst + i / 8, &bits, sizeof(bits));
+    }
 
-          case 6:
-            cdb[i] = IT8951_USB_OP_WRITE_REG;
-          break;
+  pack_1bpp_sse2 (dst + i / 8, src + i, pixels - i);
+}
 
-          case 8:
-            cdb[i] = 0x04;
-          break;
+/*
+ * pack_2bpp_avx2() - packs work within 128-bit lanes, final permute puts
+ * dwords back in pixel order
+ */
+__attribute__((target("avx2")))
+static void
+pack_2bpp_avx2 (uint8_t        *dst,
+                const uint8_t  *src,
+                size_t          pixels)
+{
+  const __m256i m0 = _mm256_set1_epi32 (0x03);
+  const __m256i m1 = _mm256_set1_epi32 (0x0C);
+  const __m256i m2 = _mm256_set1_epi32 (0x30);
+  const __m256i m3 = _mm256_set1_epi32 (0xC0);
+  const __m256i order = _mm256_setr_epi32 (0, 4, 1, 5, 2, 6, 3, 7);
+  __m256i v[4];
+  size_t i;
+
+  for (i = 0; i + 128 <= pixels; i += 128)
+    {
+      for (uint8_t k = 0; k < 4; k++)
+        {
+          __m256i w = _mm256_loadu_si256 ((const __m256i*)(src + i + k * 32));
 
-          default:
-            cdb[i] = 0x00;
+          v[k] = _mm256_or_si256 (
+               _mm256_or_si256 (_mm256_and_si256 (_mm256_srli_epi32 (w, 6), m0),
+                                _mm256_and_si256 (_mm256_srli_epi32 (w, 12), m1)),
+               _mm256_or_si256 (_mm256_and_si256 (_mm256_srli_epi32 (w, 18), m2),
+                                _mm256_and_si256 (_mm256_srli_epi32 (w, 24), m3)));
         }
-    }
-
-  hdr->cmdp = cdb;
-  hdr->dxfer_direction = SG_DXFER_TO_DEV;
 
-  if (ioctl (fd, SG_IO, hdr) < 0)
-    return USEC_DEV_ERR;
+      _mm256_storeu_si256 ((__m256i*)(dst + i / 4),
+        _mm256_permutevar8x32_epi32 (
+          _mm256_packus_epi16 (_mm256_packs_epi32 (v[0], v[1]),
+                               _mm256_packs_epi32 (v[2], v[3])), order));
+    }
 
-  return USEC_DEV_OK;
+  pack_2bpp_sse2 (dst + i / 4, src + i, pixels - i);
 }
 
 /*
- * scsi_it8951_cmd_dpy_area()
+ * pack_4bpp_avx2()
  */
-static uint8_t
-scsi_it8951_cmd_dpy_area (int                fd,
-                          it8951_sg_io_hdr  *hdr)
+__attribute__((target("avx2")))
+static void
+pack_4bpp_avx2 (uint8_t        *dst,
+                const uint8_t  *src,
+                size_t          pixels)
 {
-  uint8_t cdb[16];
+  const __m256i lo = _mm256_set1_epi16 (0x000F);
+  const __m256i hi = _mm256_set1_epi16 (0x00F0);
+  size_t i;
 
-  hdr->cmd_len = 16;
-  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+  for (i = 0; i + 64 <= pixels; i += 64)
     {
-      switch(i)
-        {
-          case 0:
-            cdb[i] = 0xFE;
-          break;
+      __m256i a = _mm256_loadu_si256 ((const __m256i*)(src + i));
+      __m256i b = _mm256_loadu_si256 ((const __m256i*)(src + i + 32));
 
-          case 6:
-            cdb[i] = IT8951_USB_OP_DPY_AREA;
-          break;
+      a = _mm256_or_si256 (_mm256_and_si256 (_mm256_srli_epi16 (a, 4), lo),
+                           _mm256_and_si256 (_mm256_srli_epi16 (a, 8), hi));
+      b = _mm256_or_si256 (_mm256_and_si256 (_mm256_srli_epi16 (b, 4), lo),
+                           _mm256_and_si256 (_mm256_srli_epi16 (b, 8), hi));
 
-          default:
-            cdb[i] = 0x00;
-        }
+      _mm256_storeu_si256 ((__m256i*)(dst + i / 2),
+                           _mm256_permute4x64_epi64 (_mm256_packus_epi16 (a, b),
+                                                     0xD8));
     }
 
-  hdr->cmdp = cdb;
-  hdr->dxfer_direction = SG_DXFER_TO_DEV;
+  pack_4bpp_sse2 (dst + i / 2, src + i, pixels - i);
+}
 
-  if (ioctl (fd, SG_IO, hdr) < 0)
-    return USEC_DEV_ERR;
+/*
+ * unpack_1bpp_avx2()
+ */
+__attribute__((target("avx2")))
+static void
+unpack_1bpp_avx2 (uint8_t        *dst,
+                  const uint8_t  *src,
+                  size_t          pixels)
+{
+  const __m256i spread = _mm256_setr_epi8 (0, 0, 0, 0, 0, 0, 0, 0,
+                                           1, 1, 1, 1, 1, 1, 1, 1,
+                                           0, 0, 0, 0, 0, 0, 0, 0,
+                                           1, 1, 1, 1, 1, 1, 1, 1);
+  const __m256i bit = _mm256_set1_epi64x ((int64_t) 0x8040201008040201ULL);
+  size_t i;
+
+  for (i = 0; i + 32 <= pixels; i += 32)
+    {
+      uint32_t in;
+      __m256i v;
 
-  return USEC_DEV_OK;
+      memcpy (&in, src + i / 8, sizeof(in));
+
+      /* shuffle stays within 128-bit lanes, bytes 2-3 go to the upper one */
+      v = _mm256_set_epi32 (0, 0, 0, (int)(in >> 16), 0, 0, 0, (int) in);
+      v = _mm256_shuffle_epi8 (v, spread);
+
+      _mm256_storeu_si256 ((__m256i*)(dst + i),
+                           _mm256_cmpeq_epi8 (_mm256_and_si256 (v, bit), bit));
+    }
+
+  unpack_1bpp_sse2 (dst + i, src + i / 8, pixels - i);
 }
 
 /*
- * scsi_it8951_cmd_load_img()
+ * unpack_2bpp_avx2()
  */
-static uint8_t
-scsi_it8951_cmd_load_img (int                fd,
-                          it8951_sg_io_hdr  *hdr)
+__attribute__((target("avx2")))
+static void
+unpack_2bpp_avx2 (uint8_t        *dst,
+                  const uint8_t  *src,
+                  size_t          pixels)
 {
-  uint8_t cdb[16];
+  const __m256i m0 = _mm256_set1_epi32 (0x00000003);
+  const __m256i m1 = _mm256_set1_epi32 (0x00000300);
+  const __m256i m2 = _mm256_set1_epi32 (0x00030000);
+  const __m256i m3 = _mm256_set1_epi32 (0x03000000);
+  size_t i;
 
-  hdr->cmd_len = 16;
-  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+  for (i = 0; i + 32 <= pixels; i += 32)
     {
-      switch(i)
-        {
-          case 0:
-            cdb[i] = 0xFE;
-          break;
+      __m256i v, t;
 
-          case 6:
-            cdb[i] = IT8951_USB_OP_LD_IMG_AREA;
-          break;
+      v = _mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i*)(src + i / 4)));
 
-          default:
-            cdb[i] = 0x00;
-        }
-    }
+      t = _mm256_or_si256 (
+            _mm256_or_si256 (_mm256_and_si256 (v, m0),
+                             _mm256_and_si256 (_mm256_slli_epi32 (v, 6), m1)),
+            _mm256_or_si256 (_mm256_and_si256 (_mm256_slli_epi32 (v, 12), m2),
+                             _mm256_and_si256 (_mm256_slli_epi32 (v, 18), m3)));
 
-  hdr->cmdp = cdb;
-  hdr->dxfer_direction = SG_DXFER_TO_DEV;
+      t = _mm256_or_si256 (_mm256_or_si256 (t, _mm256_slli_epi32 (t, 2)),
+                           _mm256_or_si256 (_mm256_slli_epi32 (t, 4),
+                                            _mm256_slli_epi32 (t, 6)));
 
-  if (ioctl (fd, SG_IO, hdr) < 0)
-    return USEC_DEV_ERR;
+      _mm256_storeu_si256 ((__m256i*)(dst + i), t);
+    }
 
-  return USEC_DEV_OK;
+  unpack_2bpp_sse2 (dst + i, src + i / 4, pixels - i);
 }
 
 /*
- * scsi_it8951_cmd_get_set_temp()
+ * unpack_4bpp_avx2()
  */
-static uint8_t
-scsi_it8951_cmd_get_set_temp (int                fd,
-                              it8951_sg_io_hdr  *hdr,
-                              uint8_t            temp_option,
-                              uint8_t            temp_value)
+__attribute__((target("avx2")))
+static void
+unpack_4bpp_avx2 (uint8_t        *dst,
+                  const uint8_t  *src,
+                  size_t          pixels)
 {
-  uint8_t cdb[16];
+  const __m256i lo = _mm256_set1_epi16 (0x000F);
+  const __m256i hi = _mm256_set1_epi16 (0x0F00);
+  size_t i;
 
-  hdr->cmd_len = 16;
-  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+  for (i = 0; i + 32 <= pixels; i += 32)
     {
-      switch(i)
-        {
-          case 0:
-            cdb[i] = 0xFE;
-          break;
+      __m256i v, t;
 
-          case 6:
-            cdb[i] = IT8951_USB_OP_FSET_TEMP;
-          break;
+      v = _mm256_cvtepu8_epi16 (_mm_loadu_si128 ((const __m128i*)(src + i / 2)));
 
-          case 7:
-            cdb[i] = temp_option;
-          break;
+      t = _mm256_or_si256 (_mm256_and_si256 (v, lo),
+                           _mm256_and_si256 (_mm256_slli_epi16 (v, 4), hi));
 
-          case 8:
-            cdb[i] = temp_value;
-          break;
+      _mm256_storeu_si256 ((__m256i*)(dst + i),
+                           _mm256_or_si256 (t, _mm256_slli_epi16 (t, 4)));
+    }
 
-          default:
-            cdb[i] = 0x00;
+  unpack_4bpp_sse2 (dst + i, src + i / 2, pixels - i);
+}
+
+/*
+ * diff_row_avx2()
+ */
+__attribute__((target("avx2")))
+static void
+diff_row_avx2 (const uint8_t  *a,
+               const uint8_t  *b,
+               uint32_t        width,
+               uint8_t        *dirty)
+{
+  uint32_t x, t;
+
+  for (x = 0, t = 0; x + USEC_DEV_TILE <= width; x += USEC_DEV_TILE, t++)
+    {
+      __m256i e;
+
+      e = _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i*)(a + x)),
+                             _mm256_loadu_si256 ((const __m256i*)(b + x)));
+
+      if ((uint32_t) _mm256_movemask_epi8 (e) != 0xFFFFFFFFu)
+        dirty[t] = 1;
+    }
+
+  diff_row_scalar (a + x, b + x, width - x, dirty + t);
+}
+
+/*
+ * hist_row_avx2()
+ */
+__attribute__((target("avx2")))
+static void
+hist_row_avx2 (const uint8_t     *src,
+               const uint8_t     *dst,
+               uint32_t           width,
+               struct usec_hist  *hist)
+{
+  const __m256i lo   = _mm256_set1_epi8 (0x0F);
+  const __m256i g0   = _mm256_setzero_si256 ();
+  const __m256i g5   = _mm256_set1_epi8 (0x05);
+  const __m256i g10  = _mm256_set1_epi8 (0x0A);
+  const __m256i ones = _mm256_set1_epi8 ((char) 0xFF);
+  uint32_t x = 0;
+
+  while (x + 32 <= width)
+    {
+      __m256i n_ch = g0, n_dg = g0, n_d4 = g0, n_sg = g0, n_dw = g0;
+      __m256i sum;
+
+      for (uint32_t k = 0; k < 255 && x + 32 <= width; k++, x += 32)
+        {
+          __m256i s, d, ch, dbw, d4, sbw;
+
+          s = _mm256_and_si256 (_mm256_srli_epi16 (
+                _mm256_loadu_si256 ((const __m256i*)(src + x)), 4), lo);
+          d = _mm256_and_si256 (_mm256_srli_epi16 (
+                _mm256_loadu_si256 ((const __m256i*)(dst + x)), 4), lo);
+
+          ch  = _mm256_xor_si256 (_mm256_cmpeq_epi8 (s, d), ones);
+          dbw = _mm256_or_si256 (_mm256_cmpeq_epi8 (d, g0),
+                                 _mm256_cmpeq_epi8 (d, lo));
+          d4  = _mm256_or_si256 (dbw,
+                                 _mm256_or_si256 (_mm256_cmpeq_epi8 (d, g5),
+                                                  _mm256_cmpeq_epi8 (d, g10)));
+          sbw = _mm256_or_si256 (_mm256_cmpeq_epi8 (s, g0),
+                                 _mm256_cmpeq_epi8 (s, lo));
+
+          n_ch = _mm256_sub_epi8 (n_ch, ch);
+          n_dg = _mm256_sub_epi8 (n_dg, _mm256_andnot_si256 (dbw, ch));
+          n_d4 = _mm256_sub_epi8 (n_d4, _mm256_andnot_si256 (d4, ch));
+          n_sg = _mm256_sub_epi8 (n_sg, _mm256_andnot_si256 (sbw, ch));
+          n_dw = _mm256_sub_epi8 (n_dw, _mm256_cmpeq_epi8 (d, lo));
         }
+
+#define HIST_SUM_AVX2(acc, field)                                         \
+      sum = _mm256_sad_epu8 (acc, g0);                                    \
+      sum = _mm256_castsi128_si256 (                                      \
+              _mm_add_epi64 (_mm256_castsi256_si128 (sum),                \
+                             _mm256_extracti128_si256 (sum, 1)));         \
+      hist->field += (uint64_t) _mm256_cvtsi256_si32 (sum) +              \
+                     (uint64_t) _mm_cvtsi128_si32 (                       \
+                       _mm_srli_si128 (_mm256_castsi256_si128 (sum), 8));
+
+      HIST_SUM_AVX2 (n_ch, changed)
+      HIST_SUM_AVX2 (n_dg, dst_gray)
+      HIST_SUM_AVX2 (n_d4, dst_gray4)
+      HIST_SUM_AVX2 (n_sg, src_gray)
+      HIST_SUM_AVX2 (n_dw, dst_white)
+#undef HIST_SUM_AVX2
     }
 
-  hdr->cmdp = cdb;
-  hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+  hist_row_sse2 (src + x, dst + x, width - x, hist);
+}
+
+#endif
+
+/*
+ * Instruction sets with own kernels, wider ones come later
+ */
+enum
+{
+  USEC_ISA_SCALAR,
+  USEC_ISA_SSE2,
+  USEC_ISA_AVX2,
+  USEC_ISA_NUM
+};
+
+static struct usec_kernels usec_kern;
+static pthread_once_t usec_kern_once = PTHREAD_ONCE_INIT;
+
+/*
+ * usec_kernels_get() - kernels of one instruction set, fails when CPU cannot
+ * run them
+ */
+static uint8_t
+usec_kernels_get (uint8_t               isa,
+                  struct usec_kernels  *kern)
+{
+  switch (isa)
+    {
+      case USEC_ISA_SCALAR:
+        kern->name = "scalar";
+        kern->pack[IMG_1BPP]   = pack_1bpp_scalar;
+        kern->pack[IMG_2BPP]   = pack_2bpp_scalar;
+        kern->pack[IMG_4BPP]   = pack_4bpp_scalar;
+        kern->unpack[IMG_1BPP] = unpack_1bpp_scalar;
+        kern->unpack[IMG_2BPP] = unpack_2bpp_scalar;
+        kern->unpack[IMG_4BPP] = unpack_4bpp_scalar;
+        kern->diff             = diff_row_scalar;
+        kern->hist             = hist_row_scalar;
+        return USEC_DEV_OK;
+
+#if defined(__x86_64__) || defined(__i386__)
+      case USEC_ISA_SSE2:
+        __builtin_cpu_init ();
+        if (!__builtin_cpu_supports ("sse2"))
+          return USEC_DEV_ERR;
+
+        kern->name = "sse2";
+        kern->pack[IMG_1BPP]   = pack_1bpp_sse2;
+        kern->pack[IMG_2BPP]   = pack_2bpp_sse2;
+        kern->pack[IMG_4BPP]   = pack_4bpp_sse2;
+        kern->unpack[IMG_1BPP] = unpack_1bpp_sse2;
+        kern->unpack[IMG_2BPP] = unpack_2bpp_sse2;
+        kern->unpack[IMG_4BPP] = unpack_4bpp_sse2;
+        kern->diff             = diff_row_sse2;
+        kern->hist             = hist_row_sse2;
+        return USEC_DEV_OK;
+
+      case USEC_ISA_AVX2:
+        __builtin_cpu_init ();
+        if (!__builtin_cpu_supports ("avx2"))
+          return USEC_DEV_ERR;
+
+        kern->name = "avx2";
+        kern->pack[IMG_1BPP]   = pack_1bpp_avx2;
+        kern->pack[IMG_2BPP]   = pack_2bpp_avx2;
+        kern->pack[IMG_4BPP]   = pack_4bpp_avx2;
+        kern->unpack[IMG_1BPP] = unpack_1bpp_avx2;
+        kern->unpack[IMG_2BPP] = unpack_2bpp_avx2;
+        kern->unpack[IMG_4BPP] = unpack_4bpp_avx2;
+        kern->diff             = diff_row_avx2;
+        kern->hist             = hist_row_avx2;
+        return USEC_DEV_OK;
+#endif
+
+      default:
+        return USEC_DEV_ERR;
+    }
+}
+
+/*
+ * usec_kernels_select() - pick the widest instruction set CPU supports
+ */
+static void
+usec_kernels_select (void)
+{
+  for (uint8_t isa = USEC_ISA_NUM; isa-- > 0;)
+    if (usec_kernels_get (isa, &usec_kern) == USEC_DEV_OK)
+      break;
+}
+
+/*
+ * usec_kernels_init()
+ */
+static const struct usec_kernels *
+usec_kernels_init (void)
+{
+  pthread_once (&usec_kern_once, usec_kernels_select);
+  return &usec_kern;
+}
 
-  if (ioctl (fd, SG_IO, hdr) < 0)
+/******************************************************************************/
+
+/*
+ * sg_transport_open()
+ */
+static uint8_t
+sg_transport_open (usec_ctx    *ctx,
+                   uint8_t      id,
+                   const void  *cfg)
+{
+  static const char *dev_path[4] = {
+    "/dev/eink_usec_312BWN0_1",
+    "/dev/eink_usec_312BWN0_2",
+    "/dev/eink_usec_312BWN0_3",
+    "/dev/eink_usec_312BWN0_4"
+  };
+
+  ctx->dev_fd[id] = open (dev_path[id], O_RDWR);
+  if (ctx->dev_fd[id] <= 0)
     return USEC_DEV_ERR;
 
   return USEC_DEV_OK;
 }
 
 /*
- * scsi_it8951_cmd_set_pmic()
+ * sg_transport_close()
+ */
+static void
+sg_transport_close (usec_ctx  *ctx,
+                    uint8_t    id)
+{
+  if (ctx->dev_fd[id] > 0)
+    close (ctx->dev_fd[id]);
+
+  ctx->dev_fd[id] = 0;
+}
+
+/*
+ * sg_transport_xfer()
  */
 static uint8_t
-scsi_it8951_cmd_set_pmic (int                fd,
-                          it8951_sg_io_hdr  *hdr,
-                          uint16_t           vcom,
-                          uint8_t            set_vcom,
-                          uint8_t            set_power,
-                          uint8_t            on_off)
+sg_transport_xfer (usec_ctx          *ctx,
+                   uint8_t            id,
+                   it8951_sg_io_hdr  *hdr)
 {
-  uint8_t cdb[16];
+  if (ioctl (ctx->dev_fd[id], SG_IO, hdr) < 0)
+    return USEC_DEV_ERR;
 
-  hdr->cmd_len = 16;
-  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+  return USEC_DEV_OK;
+}
+
+/*
+ * sg_transport_submit() - sg v3 asynchronous interface, write() queues the
+ * command and returns immediately
+ */
+static uint8_t
+sg_transport_submit (usec_ctx          *ctx,
+                     uint8_t            id,
+                     it8951_sg_io_hdr  *hdr)
+{
+  if (write (ctx->dev_fd[id], hdr, sizeof(*hdr)) < 0)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * sg_transport_reap() - wait for any completed command and read back its
+ * header (usr_ptr identifies the owner)
+ */
+static uint8_t
+sg_transport_reap (usec_ctx          *ctx,
+                   uint8_t            id,
+                   it8951_sg_io_hdr  *hdr,
+                   int                timeout)
+{
+  struct pollfd pfd;
+
+  pfd.fd      = ctx->dev_fd[id];
+  pfd.events  = POLLIN;
+  pfd.revents = 0;
+
+  if (poll (&pfd, 1, timeout) <= 0)
+    return USEC_DEV_ERR;
+
+  memset (hdr, 0, sizeof(*hdr));
+  hdr->interface_id = 'S';
+  hdr->pack_id = -1;
+
+  if (read (ctx->dev_fd[id], hdr, sizeof(*hdr)) < 0)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * sg_transport_map() - grow sg reserved buffer and map it into our address
+ * space; commands sent with SG_FLAG_MMAP_IO transfer straight from it
+ */
+static void *
+sg_transport_map (usec_ctx  *ctx,
+                  uint8_t    id,
+                  uint32_t   length)
+{
+  int size = length;
+  void *buf;
+
+  if (ioctl (ctx->dev_fd[id], SG_SET_RESERVED_SIZE, &size) < 0)
+    return NULL;
+
+  if (ioctl (ctx->dev_fd[id], SG_GET_RESERVED_SIZE, &size) < 0 ||
+      (uint32_t) size < length)
+    return NULL;
+
+  buf = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+              ctx->dev_fd[id], 0);
+  if (buf == MAP_FAILED)
+    return NULL;
+
+  return buf;
+}
+
+/*
+ * sg_transport_unmap()
+ */
+static void
+sg_transport_unmap (usec_ctx  *ctx,
+                    uint8_t    id,
+                    void      *buf,
+                    uint32_t   length)
+{
+  munmap (buf, length);
+}
+
+/*
+ * sg_transport_limit() - largest command data length host adapter accepts;
+ * sg grants reserved buffer up to queue max_sectors only, sysfs tells the
+ * current block layer limit
+ */
+static uint32_t
+sg_transport_limit (usec_ctx  *ctx,
+                    uint8_t    id)
+{
+  int size = USEC_DEV_MAX_XFER_LEN;
+  char path[128];
+  struct stat st;
+  uint32_t limit;
+  glob_t gl;
+
+  if (ioctl (ctx->dev_fd[id], SG_SET_RESERVED_SIZE, &size) < 0 ||
+      ioctl (ctx->dev_fd[id], SG_GET_RESERVED_SIZE, &size) < 0)
+    return 0;
+
+  limit = (uint32_t) size;
+
+  if (fstat (ctx->dev_fd[id], &st) < 0)
+    return limit;
+
+  snprintf (path, sizeof(path),
+            "/sys/dev/char/%u:%u/device/block/*/queue/max_sectors_kb",
+            major (st.st_rdev), minor (st.st_rdev));
+
+  if (glob (path, 0, NULL, &gl) == 0)
     {
-      switch(i)
-        {
-          case 0:
-            cdb[i] = 0xFE;
-          break;
+      FILE *file = fopen (gl.gl_pathv[0], "r");
+      unsigned int kb;
 
-          case 6:
-            cdb[i] = IT8951_USB_OP_PMIC_CTL;
-          break;
+      if (file != NULL)
+        {
+          if (fscanf (file, "%u", &kb) == 1 && kb * 1024 < limit)
+            limit = kb * 1024;
+          fclose (file);
+        }
+    }
+  globfree (&gl);
 
-          case 7:
-            cdb[i] = (uint8_t)((vcom & 0xFF00) >> 8);
-          break;
+  return limit;
+}
 
-          case 8:
-            cdb[i] = (uint8_t)(vcom & 0xFF);
-          break;
+static const struct usec_transport usec_sg_transport = {
+  .open   = sg_transport_open,
+  .close  = sg_transport_close,
+  .xfer   = sg_transport_xfer,
+  .submit = sg_transport_submit,
+  .reap   = sg_transport_reap,
+  .map    = sg_transport_map,
+  .unmap  = sg_transport_unmap,
+  .limit  = sg_transport_limit
+};
 
-          case 9:
-            cdb[i] = set_vcom;
-          break;
+/******************************************************************************/
 
-          case 10:
-            cdb[i] = set_power;
-          break;
+/*
+ * sim_reg_read()
+ */
+static uint32_t
+sim_reg_read (struct usec_sim  *sim,
+              uint32_t          addr)
+{
+  for (uint8_t i = 0; i < USEC_SIM_NUM_REGS; i++)
+    if (sim->reg[i].addr == addr)
+      return sim->reg[i].val;
 
-          case 11:
-            cdb[i] = on_off;
-          break;
+  return 0;
+}
 
-          default:
-            cdb[i] = 0x00;
+/*
+ * sim_reg_write()
+ */
+static uint8_t
+sim_reg_write (struct usec_sim  *sim,
+               uint32_t          addr,
+               uint32_t          val)
+{
+  for (uint8_t i = 0; i < USEC_SIM_NUM_REGS; i++)
+    {
+      if (sim->reg[i].addr == addr || sim->reg[i].addr == 0)
+        {
+          sim->reg[i].addr = addr;
+          sim->reg[i].val  = val;
+          return USEC_DEV_OK;
         }
     }
 
-  hdr->cmdp = cdb;
-  hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+  return USEC_DEV_ERR;
+}
 
-  if (ioctl (fd, SG_IO, hdr) < 0)
+/*
+ * sim_mem_check()
+ */
+static uint8_t
+sim_mem_check (struct usec_sim  *sim,
+               uint32_t          addr,
+               uint32_t          length)
+{
+  if (addr > sim->sdram_size || length > (sim->sdram_size - addr))
     return USEC_DEV_ERR;
 
   return USEC_DEV_OK;
 }
 
 /*
- * scsi_it8951_cmd_auto_reset()
+ * sim_xfer_read() - copy host data at given offset, handles both flat and
+ * scatter-gather (iovec_count) transfers
  */
 static uint8_t
-scsi_it8951_cmd_auto_reset (int                fd,
-                            it8951_sg_io_hdr  *hdr)
+sim_xfer_read (it8951_sg_io_hdr  *hdr,
+               uint32_t           offset,
+               void              *dst,
+               uint32_t           length)
 {
-  uint8_t cdb[16];
+  const sg_iovec_t *iov = hdr->dxferp;
 
-  hdr->cmd_len = 16;
-  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+  if (offset > hdr->dxfer_len || length > (hdr->dxfer_len - offset))
+    return USEC_DEV_ERR;
+
+  if (hdr->iovec_count == 0)
     {
-      switch(i)
+      memcpy (dst, (const uint8_t*) hdr->dxferp + offset, length);
+      return USEC_DEV_OK;
+    }
+
+  for (uint16_t i = 0; i < hdr->iovec_count && length > 0; i++)
+    {
+      uint32_t part;
+
+      if (offset >= iov[i].iov_len)
         {
-          case 0:
-            cdb[i] = 0xFE;
-          break;
+          offset -= iov[i].iov_len;
+          continue;
+        }
 
-          case 6:
-            cdb[i] = IT8951_USB_OP_AUTO_RESET;
-          break;
+      part = iov[i].iov_len - offset;
+      if (part > length)
+        part = length;
 
-          default:
-            cdb[i] = 0x00;
+      memcpy (dst, (const uint8_t*) iov[i].iov_base + offset, part);
+      dst = (uint8_t*) dst + part;
+      length -= part;
+      offset = 0;
+    }
+
+  return (length == 0) ? USEC_DEV_OK : USEC_DEV_ERR;
+}
+
+/*
+ * sim_cmd_inquiry()
+ */
+static uint8_t
+sim_cmd_inquiry (struct usec_sim   *sim,
+                 uint8_t            id,
+                 it8951_sg_io_hdr  *hdr)
+{
+  uint8_t data[36];
+
+  memset (data, 0, sizeof(data));
+  data[4] = sizeof(data) - 5;
+  memcpy (&data[8], "Generic ", 8);
+  memcpy (&data[16], "UniEPDC312BWN0-", 15);
+  data[31] = '1' + id;
+  memcpy (&data[32], "1.00", 4);
+
+  memcpy (hdr->dxferp, data,
+          hdr->dxfer_len < sizeof(data) ? hdr->dxfer_len : sizeof(data));
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * sim_cmd_system_info()
+ */
+static uint8_t
+sim_cmd_system_info (struct usec_sim   *sim,
+                     it8951_sg_io_hdr  *hdr)
+{
+  uint8_t data[offsetof(it8951_sys_info, cmd_info_data)];
+
+  memset (data, 0, sizeof(data));
+  put_be32 (&data[offsetof(it8951_sys_info, signature)], 0x38393531);
+  put_be32 (&data[offsetof(it8951_sys_info, width)], USEC_SIM_WIDTH);
+  put_be32 (&data[offsetof(it8951_sys_info, height)], USEC_SIM_HEIGHT);
+  put_be32 (&data[offsetof(it8951_sys_info, update_buf_base)],
+            USEC_SIM_UPDATE_BUF_BASE);
+  put_be32 (&data[offsetof(it8951_sys_info, image_buf_base)],
+            USEC_SIM_IMAGE_BUF_BASE);
+  put_be32 (&data[offsetof(it8951_sys_info, mode_no)], UPDATE_MODE_DU4 + 1);
+  put_be32 (&data[offsetof(it8951_sys_info, num_img_buf)],
+            USEC_SIM_NUM_IMG_BUF);
+  put_be32 (&data[offsetof(it8951_sys_info, wbf_addr)], USEC_SIM_WBF_ADDR);
+
+  memcpy (hdr->dxferp, data,
+          hdr->dxfer_len < sizeof(data) ? hdr->dxfer_len : sizeof(data));
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * sim_cmd_load_img()
+ */
+static uint8_t
+sim_cmd_load_img (struct usec_sim   *sim,
+                  it8951_sg_io_hdr  *hdr)
+{
+  uint8_t data[sizeof(it8951_load_arg)];
+  uint32_t addr, x, y, w, h;
+
+  if (sim_xfer_read (hdr, 0, data, sizeof(data)))
+    return USEC_DEV_ERR;
+
+  addr = get_be32 (data + offsetof(it8951_load_arg, addr));
+  x    = get_be32 (data + offsetof(it8951_load_arg, x));
+  y    = get_be32 (data + offsetof(it8951_load_arg, y));
+  w    = get_be32 (data + offsetof(it8951_load_arg, w));
+  h    = get_be32 (data + offsetof(it8951_load_arg, h));
+
+  if (x + w > USEC_SIM_WIDTH || y + h > USEC_SIM_HEIGHT ||
+      (uint64_t) w * h > hdr->dxfer_len - sizeof(it8951_load_arg))
+    return USEC_DEV_ERR;
+
+  if (sim_mem_check (sim, addr, USEC_SIM_WIDTH * USEC_SIM_HEIGHT))
+    return USEC_DEV_ERR;
+
+  for (uint32_t row = 0; row < h; row++)
+    {
+      if (sim_xfer_read (hdr, sizeof(it8951_load_arg) + row * w,
+                         sim->sdram + addr + (y + row) * USEC_SIM_WIDTH + x, w))
+        return USEC_DEV_ERR;
+    }
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * sim_lut_status() - one bit per running LUT engine, modelled as all of them
+ */
+static uint32_t
+sim_lut_status (struct usec_sim *sim)
+{
+  return (now_ns () < sim->busy_until) ? 0xFFFF : 0;
+}
+
+/*
+ * sim_cmd_dpy_area()
+ */
+static uint8_t
+sim_cmd_dpy_area (struct usec_sim   *sim,
+                  it8951_sg_io_hdr  *hdr)
+{
+  /* waveform time relative to GC16 [1/1000] */
+  static const uint16_t wave_permille[] = { 2000, 250, 1000, 1000, 125, 250 };
+  uint8_t data[sizeof(it8951_disp_arg)];
+  uint32_t addr, mode, x, y, w, h;
+  uint64_t until;
+  uint32_t bgvr;
+  uint8_t bpp1;
+
+  if (sim_xfer_read (hdr, 0, data, sizeof(data)))
+    return USEC_DEV_ERR;
+
+  addr = get_be32 (data + offsetof(it8951_disp_arg, mem_addr));
+  mode = get_be32 (data + offsetof(it8951_disp_arg, wav_mode));
+  x    = get_be32 (data + offsetof(it8951_disp_arg, pos_x));
+  y    = get_be32 (data + offsetof(it8951_disp_arg, pos_y));
+  w    = get_be32 (data + offsetof(it8951_disp_arg, width));
+  h    = get_be32 (data + offsetof(it8951_disp_arg, height));
+
+  if (mode > UPDATE_MODE_DU4 ||
+      x + w > USEC_SIM_WIDTH || y + h > USEC_SIM_HEIGHT)
+    return USEC_DEV_ERR;
+
+  if (sim_mem_check (sim, addr, USEC_SIM_WIDTH * USEC_SIM_HEIGHT))
+    return USEC_DEV_ERR;
+
+  /* 1bpp mode - image buffer rows hold packed bits (LSB first) */
+  bpp1 = (sim_reg_read (sim, IT8951_REG_UP1SR) & IT8951_UP1SR_1BPP) != 0;
+  bgvr = sim_reg_read (sim, IT8951_REG_BGVR);
+  if (bpp1 && ((x % 32) != 0 || (w % 32) != 0))
+    return USEC_DEV_ERR;
+
+  /* rails come up before the waveform can start */
+  if (!sim->power)
+    {
+      sleep_ns ((uint64_t) sim->cfg.power_on_us * 1000);
+      sim->power = 1;
+    }
+
+  /* waveform runs in the background, engines are busy until it ends */
+  until = now_ns () + (uint64_t) sim->cfg.update_us * wave_permille[mode];
+  if (until > sim->busy_until)
+    sim->busy_until = until;
+
+  for (uint32_t row = 0; row < h; row++)
+    {
+      uint8_t *dst = sim->panel + (y + row) * USEC_SIM_WIDTH + x;
+      const uint8_t *src = sim->sdram + addr + (y + row) * USEC_SIM_WIDTH;
+
+      if (mode == UPDATE_MODE_INIT)
+        memset (dst, 0xFF, w);
+      else if (bpp1)
+        for (uint32_t col = x; col < x + w; col++)
+          dst[col - x] = ((src[col >> 3] >> (col & 7)) & 1) ?
+                         (uint8_t)(bgvr >> 8) : (uint8_t) bgvr;
+      else
+        memcpy (dst, src + x, w);
+    }
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * sim_transport_open()
+ */
+static uint8_t
+sim_transport_open (usec_ctx    *ctx,
+                    uint8_t      id,
+                    const void  *cfg)
+{
+  struct usec_sim *sim;
+
+  sim = usec_dev_alloc (ctx, sizeof(*sim));
+  if (sim == NULL)
+    return USEC_DEV_ERR;
+
+  if (cfg != NULL)
+    sim->cfg = *(const usec_sim_cfg*) cfg;
+
+  sim->sdram_size = USEC_SIM_IMAGE_BUF_BASE +
+                    (USEC_SIM_NUM_IMG_BUF * USEC_SIM_WIDTH * USEC_SIM_HEIGHT);
+  sim->sdram = usec_dev_alloc (ctx, sim->sdram_size);
+  sim->panel = usec_dev_alloc (ctx, USEC_SIM_WIDTH * USEC_SIM_HEIGHT);
+  if (sim->sdram == NULL || sim->panel == NULL)
+    {
+      free (sim->sdram);
+      free (sim->panel);
+      free (sim);
+      return USEC_DEV_ERR;
+    }
+
+  memset (sim->panel, 0xFF, USEC_SIM_WIDTH * USEC_SIM_HEIGHT);
+  sim->vcom = USEC_SIM_VCOM;
+
+  ctx->dev_priv[id] = sim;
+  return USEC_DEV_OK;
+}
+
+/*
+ * sim_transport_close()
+ */
+static void
+sim_transport_close (usec_ctx  *ctx,
+                     uint8_t    id)
+{
+  struct usec_sim *sim = ctx->dev_priv[id];
+
+  if (sim == NULL)
+    return;
+
+  free (sim->mmap_buf);
+  free (sim->sdram);
+  free (sim->panel);
+  free (sim);
+
+  ctx->dev_priv[id] = NULL;
+}
+
+/*
+ * sim_transport_xfer()
+ */
+static uint8_t
+sim_transport_xfer (usec_ctx          *ctx,
+                    uint8_t            id,
+                    it8951_sg_io_hdr  *hdr)
+{
+  struct usec_sim *sim = ctx->dev_priv[id];
+  const uint8_t *cdb = hdr->cmdp;
+  it8951_sg_io_hdr mmap_hdr;
+  uint8_t *data = hdr->dxferp;
+  uint32_t addr, length;
+  uint8_t status;
+
+  if (sim == NULL)
+    return USEC_DEV_ERR;
+
+  if (sim->cfg.max_xfer_len != 0 && hdr->dxfer_len > sim->cfg.max_xfer_len)
+    {
+      hdr->info = SG_INFO_CHECK;
+      return USEC_DEV_ERR;
+    }
+
+  /* data lives in the mapped reserved buffer */
+  if (hdr->flags & SG_FLAG_MMAP_IO)
+    {
+      if (sim->mmap_buf == NULL)
+        return USEC_DEV_ERR;
+
+      mmap_hdr = *hdr;
+      mmap_hdr.dxferp = sim->mmap_buf;
+      mmap_hdr.iovec_count = 0;
+
+      hdr  = &mmap_hdr;
+      data = sim->mmap_buf;
+    }
+
+  if (cdb[0] != 0xFE && cdb[0] != IT8951_USB_INQUIRY)
+    return USEC_DEV_ERR;
+
+  addr   = get_be32 (&cdb[2]);
+  length = ((uint32_t)cdb[7] << 8) | cdb[8];
+  status = USEC_DEV_OK;
+
+  if (cdb[0] == IT8951_USB_INQUIRY)
+    {
+      status = sim_cmd_inquiry (sim, id, hdr);
+    }
+  else
+    {
+      switch (cdb[6])
+        {
+          case IT8951_USB_OP_GET_SYS:
+            status = sim_cmd_system_info (sim, hdr);
+          break;
+
+          case IT8951_USB_OP_READ_MEM:
+            if (length > hdr->dxfer_len || sim_mem_check (sim, addr, length))
+              status = USEC_DEV_ERR;
+            else
+              memcpy (data, sim->sdram + addr, length);
+          break;
+
+          case IT8951_USB_OP_WRITE_MEM:
+          case IT8951_USB_OP_FAST_WRITE_MEM:
+            if (sim_mem_check (sim, addr, length))
+              status = USEC_DEV_ERR;
+            else
+              status = sim_xfer_read (hdr, 0, sim->sdram + addr, length);
+          break;
+
+          case IT8951_USB_OP_READ_REG:
+            if (hdr->dxfer_len < sizeof(uint32_t))
+              status = USEC_DEV_ERR;
+            else
+              put_be32 (data, (addr == IT8951_REG_LUTAFSR) ?
+                              sim_lut_status (sim) : sim_reg_read (sim, addr));
+          break;
+
+          case IT8951_USB_OP_WRITE_REG:
+            {
+              uint8_t val[sizeof(uint32_t)];
+
+              status = sim_xfer_read (hdr, 0, val, sizeof(val));
+              if (status == USEC_DEV_OK)
+                status = sim_reg_write (sim, addr, get_be32 (val));
+            }
+          break;
+
+          case IT8951_USB_OP_DPY_AREA:
+            status = sim_cmd_dpy_area (sim, hdr);
+          break;
+
+          case IT8951_USB_OP_LD_IMG_AREA:
+            status = sim_cmd_load_img (sim, hdr);
+          break;
+
+          case IT8951_USB_OP_PMIC_CTL:
+            if (cdb[9])
+              sim->vcom = ((uint16_t)cdb[7] << 8) | cdb[8];
+            if (cdb[10])
+              sim->power = cdb[11];
+            if (data != NULL && hdr->dxfer_len >= sizeof(uint16_t))
+              {
+                data[0] = (uint8_t)(sim->vcom >> 8);
+                data[1] = (uint8_t)(sim->vcom & 0xFF);
+              }
+          break;
+
+          case IT8951_USB_OP_FSET_TEMP:
+            if (data != NULL && hdr->dxfer_len >= sizeof(it8951_temp_arg))
+              {
+                data[0] = USEC_SIM_TEMP;
+                data[1] = 0;
+              }
+          break;
+
+          case IT8951_USB_OP_AUTO_RESET:
+          break;
+
+          default:
+            status = USEC_DEV_ERR;
+        }
+    }
+
+  /* charge bus time */
+  sleep_ns ((uint64_t) sim->cfg.cmd_latency_us * 1000 +
+            (uint64_t) hdr->dxfer_len * sim->cfg.byte_latency_ns);
+
+  hdr->status = (status == USEC_DEV_OK) ? 0x00 : 0x02;
+  hdr->info   = (status == USEC_DEV_OK) ? SG_INFO_OK : SG_INFO_CHECK;
+  if (hdr->flags & SG_FLAG_DIRECT_IO)
+    hdr->info |= SG_INFO_DIRECT_IO;
+
+  return status;
+}
+
+/*
+ * sim_transport_submit() - command is executed right away, its header is
+ * queued for sim_transport_reap() just like sg driver does
+ */
+static uint8_t
+sim_transport_submit (usec_ctx          *ctx,
+                      uint8_t            id,
+                      it8951_sg_io_hdr  *hdr)
+{
+  struct usec_sim *sim = ctx->dev_priv[id];
+
+  if (sim == NULL || sim->done_count == USEC_DEV_MAX_QUEUE)
+    return USEC_DEV_ERR;
+
+  sim_transport_xfer (ctx, id, hdr);
+
+  sim->done[(sim->done_head + sim->done_count) % USEC_DEV_MAX_QUEUE] = hdr;
+  sim->done_count++;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * sim_transport_reap()
+ */
+static uint8_t
+sim_transport_reap (usec_ctx          *ctx,
+                    uint8_t            id,
+                    it8951_sg_io_hdr  *hdr,
+                    int                timeout)
+{
+  struct usec_sim *sim = ctx->dev_priv[id];
+
+  if (sim == NULL || sim->done_count == 0)
+    return USEC_DEV_ERR;
+
+  memcpy (hdr, sim->done[sim->done_head], sizeof(*hdr));
+  sim->done_head = (sim->done_head + 1) % USEC_DEV_MAX_QUEUE;
+  sim->done_count--;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * sim_transport_map()
+ */
+static void *
+sim_transport_map (usec_ctx  *ctx,
+                   uint8_t    id,
+                   uint32_t   length)
+{
+  struct usec_sim *sim = ctx->dev_priv[id];
+
+  if (sim == NULL || sim->mmap_buf != NULL)
+    return NULL;
+
+  sim->mmap_buf = usec_dev_alloc (ctx, length);
+  return sim->mmap_buf;
+}
+
+/*
+ * sim_transport_unmap()
+ */
+static void
+sim_transport_unmap (usec_ctx  *ctx,
+                     uint8_t    id,
+                     void      *buf,
+                     uint32_t   length)
+{
+  struct usec_sim *sim = ctx->dev_priv[id];
+
+  if (sim == NULL || sim->mmap_buf != buf)
+    return;
+
+  free (sim->mmap_buf);
+  sim->mmap_buf = NULL;
+}
+
+/*
+ * sim_transport_limit() - configured limit stands for what sg reserved size
+ * and sysfs max_sectors_kb report on real hardware
+ */
+static uint32_t
+sim_transport_limit (usec_ctx  *ctx,
+                     uint8_t    id)
+{
+  struct usec_sim *sim = ctx->dev_priv[id];
+
+  if (sim == NULL)
+    return 0;
+
+  return sim->cfg.max_xfer_len;
+}
+
+static const struct usec_transport usec_sim_transport = {
+  .open   = sim_transport_open,
+  .close  = sim_transport_close,
+  .xfer   = sim_transport_xfer,
+  .submit = sim_transport_submit,
+  .reap   = sim_transport_reap,
+  .map    = sim_transport_map,
+  .unmap  = sim_transport_unmap,
+  .limit  = sim_transport_limit
+};
+
+/******************************************************************************/
+
+/*
+ * usec_dev_xfer() - commands owned by a queue slot (usr_ptr set) are only
+ * submitted, their completion is collected by usec_queue_reap()
+ */
+static uint8_t
+usec_dev_xfer (usec_ctx          *ctx,
+               uint8_t            id,
+               it8951_sg_io_hdr  *hdr)
+{
+  __atomic_add_fetch (&ctx->stats.cmd_count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&ctx->stats.xfer_bytes, hdr->dxfer_len,
+                      __ATOMIC_RELAXED);
+
+  if (hdr->usr_ptr != NULL)
+    return ctx->dev_ops->submit (ctx, id, hdr);
+
+  return ctx->dev_ops->xfer (ctx, id, hdr);
+}
+
+/*
+ * usec_cost_init()
+ */
+static void
+usec_cost_init (struct usec_cost *cost)
+{
+  memset (cost, 0, sizeof(*cost));
+  cost->cmd_ns  = USEC_COST_PRIOR_CMD_NS;
+  cost->byte_ns = USEC_COST_PRIOR_BYTE_NS;
+}
+
+/*
+ * usec_cost_sample() - add measured transfer and refit the model
+ */
+static void
+usec_cost_sample (struct usec_cost  *cost,
+                  double             cmds,
+                  double             bytes,
+                  double             ns)
+{
+  double a11, a12, a22, r1, r2, det;
+  double cmd_ns, byte_ns;
+
+  cost->snn = cost->snn * USEC_COST_DECAY + cmds * cmds;
+  cost->snb = cost->snb * USEC_COST_DECAY + cmds * bytes;
+  cost->sbb = cost->sbb * USEC_COST_DECAY + bytes * bytes;
+  cost->snt = cost->snt * USEC_COST_DECAY + cmds * ns;
+  cost->sbt = cost->sbt * USEC_COST_DECAY + bytes * ns;
+
+  /* normal equations with ridge term towards the prior */
+  a11 = cost->snn + USEC_COST_LAMBDA_CMD;
+  a12 = cost->snb;
+  a22 = cost->sbb + USEC_COST_LAMBDA_BYTE;
+  r1  = cost->snt + USEC_COST_LAMBDA_CMD * USEC_COST_PRIOR_CMD_NS;
+  r2  = cost->sbt + USEC_COST_LAMBDA_BYTE * USEC_COST_PRIOR_BYTE_NS;
+
+  det = a11 * a22 - a12 * a12;
+  if (det <= 0.0)
+    return;
+
+  cmd_ns  = (r1 * a22 - r2 * a12) / det;
+  byte_ns = (a11 * r2 - a12 * r1) / det;
+
+  cost->cmd_ns  = (cmd_ns > 0.0) ? cmd_ns : 0.0;
+  cost->byte_ns = (byte_ns > 0.0) ? byte_ns : 0.0;
+}
+
+/*
+ * usec_cost_estimate()
+ */
+static double
+usec_cost_estimate (const struct usec_cost  *cost,
+                    uint32_t                 cmds,
+                    uint64_t                 bytes)
+{
+  return (double) cmds * cost->cmd_ns + (double) bytes * cost->byte_ns;
+}
+
+/*
+ * usec_xfer_rows() - rows of 'width' pixels sent by one command of given
+ * strategy
+ */
+static uint32_t
+usec_xfer_rows (usec_ctx  *ctx,
+                uint8_t    id,
+                uint8_t    strategy,
+                uint32_t   width)
+{
+  uint32_t length = ctx->dev_xfer_len[id];
+  uint32_t rows;
+
+  switch (strategy)
+    {
+      case XFER_STRATEGY_LD_IMG:
+        rows = (length - sizeof(it8951_load_arg)) / width;
+      break;
+
+      case XFER_STRATEGY_MEM:
+      case XFER_STRATEGY_FAST_MEM:
+        if (length > USEC_DEV_MEM_MAX_LEN)
+          length = USEC_DEV_MEM_MAX_LEN;
+        rows = length / width;
+      break;
+
+      default:
+        rows = 1;
+    }
+
+  return (rows != 0) ? rows : 1;
+}
+
+/*
+ * usec_xfer_plan() - pick the cheapest way to write 'width' x 'height'
+ * rectangle (rows 'stride' bytes apart) according to the controller cost
+ * model, estimated time goes to 'plan_ns' if not NULL
+ */
+static uint8_t
+usec_xfer_plan (usec_ctx  *ctx,
+                uint8_t    id,
+                uint32_t   width,
+                uint32_t   height,
+                uint32_t   stride,
+                uint8_t    dio,
+                double    *plan_ns)
+{
+  static const uint8_t strategy_op[XFER_STRATEGY_NUM] = {
+    USEC_COST_OP_LD_IMG,
+    USEC_COST_OP_MEM,
+    USEC_COST_OP_FAST_MEM,
+    USEC_COST_OP_MEM,
+    USEC_COST_OP_FAST_MEM
+  };
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint8_t best = XFER_STRATEGY_MEM_ROWS;
+  double best_ns = -1.0;
+
+  for (uint8_t strategy = 0; strategy < XFER_STRATEGY_NUM; strategy++)
+    {
+      uint32_t rows, cmds;
+      uint64_t bytes;
+      double ns;
+
+#if !USEC_DEV_FAST_WRITE
+      if (strategy_op[strategy] == USEC_COST_OP_FAST_MEM)
+        continue;
+#endif
+
+      /* LD_IMG_AREA takes at most 2048 px wide areas, contiguous memory
+         writes need whole controller rows without gaps, direct I/O needs
+         the latter */
+      if (strategy == XFER_STRATEGY_LD_IMG && (width > 2048 || dio))
+        continue;
+      if ((strategy == XFER_STRATEGY_MEM || strategy == XFER_STRATEGY_FAST_MEM)
+          && (width != ctx->dev_width[id] || stride != width))
+        continue;
+      if ((strategy == XFER_STRATEGY_MEM_ROWS ||
+           strategy == XFER_STRATEGY_FAST_MEM_ROWS) && dio)
+        continue;
+
+      rows  = usec_xfer_rows (ctx, id, strategy, width);
+      cmds  = (height + rows - 1) / rows;
+      bytes = (uint64_t) width * height;
+      if (strategy == XFER_STRATEGY_LD_IMG)
+        bytes += (uint64_t) cmds * sizeof(it8951_load_arg);
+
+      ns = usec_cost_estimate (&arena->cost[strategy_op[strategy]], cmds,
+                               bytes);
+      if (best_ns < 0.0 || ns < best_ns)
+        {
+          best = strategy;
+          best_ns = ns;
+        }
+    }
+
+  if (plan_ns != NULL)
+    *plan_ns = best_ns;
+
+  return best;
+}
+
+/*
+ * usec_arena_alloc() - make sure first 'depth' slots of every controller
+ * have their staging buffers
+ */
+static uint8_t
+usec_arena_alloc (usec_ctx  *ctx,
+                  uint8_t    depth)
+{
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      struct usec_arena *arena = ctx->dev_arena[cnt];
+
+      if (arena == NULL)
+        {
+          arena = usec_dev_alloc (ctx, sizeof(*arena));
+          if (arena == NULL)
+            return USEC_DEV_ERR;
+
+          for (uint8_t op = 0; op < USEC_COST_OPS; op++)
+            usec_cost_init (&arena->cost[op]);
+
+          pthread_mutex_init (&arena->lock, NULL);
+          ctx->dev_arena[cnt] = arena;
+        }
+
+      /* unpacked rows of 2/4bpp images, one transfer worth */
+      if (arena->stage == NULL && ctx->dev_xfer_len[cnt] != 0)
+        {
+          arena->stage = usec_dev_alloc (ctx, ctx->dev_xfer_len[cnt]);
+          if (arena->stage == NULL)
+            return USEC_DEV_ERR;
+        }
+
+      for (uint8_t i = 0; i < depth; i++)
+        {
+          if (arena->slot[i].buf != NULL)
+            continue;
+
+          arena->slot[i].buf = usec_dev_alloc (ctx, sizeof(it8951_load_arg) +
+                                               ctx->dev_xfer_len[cnt]);
+          if (arena->slot[i].buf == NULL)
+            return USEC_DEV_ERR;
+        }
+    }
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_arena_free()
+ */
+static void
+usec_arena_free (usec_ctx *ctx)
+{
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      struct usec_arena *arena = ctx->dev_arena[cnt];
+
+      if (arena == NULL)
+        continue;
+
+      for (uint8_t i = 0; i < USEC_DEV_MAX_QUEUE; i++)
+        free (arena->slot[i].buf);
+
+      free (arena->stage);
+      free (arena->shadow);
+      free (arena->tile_dirty);
+      free (arena->tile_pending);
+      free (arena->rects);
+      free (arena->rect_ns);
+      free (arena->rect_gain);
+      free (arena->panel);
+      free (arena->tile_mode);
+      free (arena->tile_mask);
+      free (arena->tile_ghost);
+      for (uint8_t i = 0; i < USEC_DEV_MAX_IMG_BUF; i++)
+        free (arena->tile_stale[i]);
+      pthread_mutex_destroy (&arena->lock);
+      free (arena);
+      ctx->dev_arena[cnt] = NULL;
+    }
+}
+
+/*
+ * usec_lock() - take locks of controllers in 'mask', always in ascending
+ * order so overlapping callers cannot deadlock
+ */
+static void
+usec_lock (usec_ctx  *ctx,
+           uint8_t    mask)
+{
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    if (mask & (1 << cnt))
+      pthread_mutex_lock (&ctx->dev_arena[cnt]->lock);
+}
+
+/*
+ * usec_unlock()
+ */
+static void
+usec_unlock (usec_ctx  *ctx,
+             uint8_t    mask)
+{
+  for (uint8_t cnt = 4; cnt-- > 0;)
+    if (mask & (1 << cnt))
+      pthread_mutex_unlock (&ctx->dev_arena[cnt]->lock);
+}
+
+/*
+ * usec_dio_account() - check whether direct I/O request has been honoured
+ */
+static void
+usec_dio_account (usec_ctx                *ctx,
+                  const it8951_sg_io_hdr  *hdr)
+{
+  if (!(hdr->flags & SG_FLAG_DIRECT_IO))
+    return;
+
+  if ((hdr->info & SG_INFO_DIRECT_IO_MASK) == SG_INFO_DIRECT_IO)
+    __atomic_add_fetch (&ctx->stats.dio_xfers, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_add_fetch (&ctx->stats.dio_fallbacks, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * usec_dio_check() - is source range a part of page-aligned frame buffer
+ * allocated with usec_buf_alloc()
+ */
+static uint8_t
+usec_dio_check (usec_ctx       *ctx,
+                uint8_t         id,
+                const uint8_t  *src,
+                size_t          length)
+{
+  if (ctx->dev_dio_off[id])
+    return 0;
+
+  for (uint8_t i = 0; i < USEC_DEV_MAX_DIO_BUFS; i++)
+    {
+      const struct usec_dio_buf *dio = &ctx->dev_dio[i];
+
+      if (dio->buf != NULL && src >= dio->buf &&
+          length <= dio->len && (size_t)(src - dio->buf) <= dio->len - length)
+        return 1;
+    }
+
+  return 0;
+}
+
+/*
+ * usec_queue_reap() - collect one completed command
+ */
+static uint8_t
+usec_queue_reap (usec_ctx  *ctx,
+                 uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  struct usec_slot *slot;
+  it8951_sg_io_hdr done;
+
+  if (ctx->dev_ops->reap (ctx, id, &done, USEC_DEV_TIMEOUT) != USEC_DEV_OK)
+    {
+      /* controller stopped responding - forget everything in flight */
+      for (uint8_t i = 0; i < USEC_DEV_MAX_QUEUE; i++)
+        arena->slot[i].busy = 0;
+      arena->inflight = 0;
+
+      return USEC_DEV_ERR;
+    }
+
+  slot = done.usr_ptr;
+  if (slot == NULL || !slot->busy)
+    return USEC_DEV_OK;
+
+  slot->busy = 0;
+  arena->inflight--;
+
+  usec_dio_account (ctx, &done);
+
+  if ((done.info & SG_INFO_OK_MASK) != SG_INFO_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_queue_slot() - get a free slot, waits for the oldest command when all
+ * slots are in flight
+ */
+static struct usec_slot *
+usec_queue_slot (usec_ctx  *ctx,
+                 uint8_t    id,
+                 uint8_t   *status)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+
+  while (arena->inflight >= ctx->queue_depth)
+    {
+      if (usec_queue_reap (ctx, id) != USEC_DEV_OK)
+        {
+          *status |= USEC_DEV_ERR;
+          if (arena->inflight == 0)
+            break;
+        }
+    }
+
+  for (uint8_t i = 0; i < ctx->queue_depth; i++)
+    {
+      struct usec_slot *slot = &arena->slot[i];
+
+      if (slot->busy)
+        continue;
+
+      memset (&slot->hdr, 0, sizeof(slot->hdr));
+      slot->hdr.interface_id = 'S';
+      slot->hdr.flags = SG_FLAG_LUN_INHIBIT;
+      slot->hdr.cmdp = slot->cdb;
+      set_sense_data (&slot->hdr, slot->sense, USEC_DEV_SENSE_LEN);
+
+      /* depth 1 keeps the blocking SG_IO path */
+      if (ctx->queue_depth > 1)
+        slot->hdr.usr_ptr = slot;
+
+      return slot;
+    }
+
+  return NULL;
+}
+
+/*
+ * usec_queue_commit() - account slot whose command has been submitted
+ */
+static void
+usec_queue_commit (usec_ctx          *ctx,
+                   uint8_t            id,
+                   struct usec_slot  *slot,
+                   uint8_t            status)
+{
+  if (slot->hdr.usr_ptr == NULL || status != USEC_DEV_OK)
+    return;
+
+  slot->busy = 1;
+  ctx->dev_arena[id]->inflight++;
+}
+
+/*
+ * usec_queue_drain() - wait until all queued commands are completed
+ */
+static uint8_t
+usec_queue_drain (usec_ctx  *ctx,
+                  uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint8_t status = USEC_DEV_OK;
+
+  while (arena->inflight > 0)
+    status |= usec_queue_reap (ctx, id);
+
+  return status;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+/*
+ * scsi_it8951_cmd_inquiry()
+ */
+static uint8_t
+scsi_it8951_cmd_inquiry (usec_ctx          *ctx,
+                         uint8_t            id,
+                         it8951_sg_io_hdr  *hdr)
+{
+  uint8_t *cdb = hdr->cmdp;
+
+  hdr->cmd_len = 16;
+  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+    {
+      switch(i)
+        {
+          case 0:
+            cdb[i] = IT8951_USB_INQUIRY;
+          break;
+
+          default:
+            cdb[i] = 0x00;
+          break;
+        }
+    }
+
+  hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+
+  if (usec_dev_xfer (ctx, id, hdr) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * scsi_it8951_cmd_system_info()
+ */
+static uint8_t
+scsi_it8951_cmd_system_info (usec_ctx          *ctx,
+                             uint8_t            id,
+                             it8951_sg_io_hdr  *hdr)
+{
+  uint8_t *cdb = hdr->cmdp;
+
+  hdr->cmd_len = 16;
+  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+    {
+      switch(i)
+        {
+          case 0:
+            cdb[i] = 0xFE;
+          break;
+
+          case 2:
+            cdb[i] = 0x38;
+          break;
+
+          case 3:
+            cdb[i] = 0x39;
+          break;
+
+          case 4:
+            cdb[i] = 0x35;
+          break;
+
+          case 5:
+            cdb[i] = 0x31;
+          break;
+
+          case 6:
+            cdb[i] = IT8951_USB_OP_GET_SYS;
+          break;
+
+          case 8:
+            cdb[i] = 0x01;
+          break;
+
+          case 10:
+            cdb[i] = 0x02;
+          break;
+
+          default:
+            cdb[i] = 0x00;
+        }
+    }
+
+  hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+
+  if (usec_dev_xfer (ctx, id, hdr) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * scsi_it8951_cmd_read_mem()
+ */
+static uint8_t
+scsi_it8951_cmd_read_mem (usec_ctx          *ctx,
+                          uint8_t            id,
+                          it8951_sg_io_hdr  *hdr,
+                          uint32_t           addr,
+                          uint16_t           length)
+{
+  uint8_t *cdb = hdr->cmdp;
+
+  hdr->cmd_len = 16;
+  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+    {
+      switch(i)
+        {
+          case 0:
+            cdb[i] = 0xFE;
+          break;
+
+          case 2:
+            cdb[i] = (uint8_t)((addr >> 24) & 0xFF);
+          break;
+
+          case 3:
+            cdb[i] = (uint8_t)((addr >> 16) & 0xFF);
+          break;
+
+          case 4:
+            cdb[i] = (uint8_t)((addr >> 8) & 0xFF);
+          break;
+
+          case 5:
+            cdb[i] = (uint8_t)(addr & 0xFF);
+          break;
+
+          case 6:
+            cdb[i] = IT8951_USB_OP_READ_MEM;
+          break;
+
+          case 7:
+            cdb[i] = (uint8_t)((length >> 8) & 0xFF);
+          break;
+
+          case 8:
+            cdb[i] = (uint8_t)(length & 0xFF);
+          break;
+
+          default:
+            cdb[i] = 0x00;
+        }
+    }
+
+  hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+
+  if (usec_dev_xfer (ctx, id, hdr) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * scsi_it8951_cmd_write_mem()
+ */
+static uint8_t
+scsi_it8951_cmd_write_mem (usec_ctx          *ctx,
+                           uint8_t            id,
+                           it8951_sg_io_hdr  *hdr,
+                           uint32_t           addr,
+                           uint16_t           length,
+                           uint8_t            fast)
+{
+  uint8_t *cdb = hdr->cmdp;
+
+  hdr->cmd_len = 16;
+  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+    {
+      switch(i)
+        {
+          case 0:
+            cdb[i] = 0xFE;
+          break;
+
+          case 2:
+            cdb[i] = (uint8_t)((addr >> 24) & 0xFF);
+          break;
+
+          case 3:
+            cdb[i] = (uint8_t)((addr >> 16) & 0xFF);
+          break;
+
+          case 4:
+            cdb[i] = (uint8_t)((addr >> 8) & 0xFF);
+          break;
+
+          case 5:
+            cdb[i] = (uint8_t)(addr & 0xFF);
+          break;
+
+          case 6:
+            cdb[i] = fast ? IT8951_USB_OP_FAST_WRITE_MEM :
+                            IT8951_USB_OP_WRITE_MEM;
+          break;
+
+          case 7:
+            cdb[i] = (uint8_t)((length >> 8) & 0xFF);
+          break;
+
+          case 8:
+            cdb[i] = (uint8_t)(length & 0xFF);
+          break;
+
+          default:
+            cdb[i] = 0x00;
+        }
+    }
+
+  hdr->dxfer_direction = SG_DXFER_TO_DEV;
+
+  if (usec_dev_xfer (ctx, id, hdr) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * scsi_it8951_cmd_read_reg()
+ */
+static uint8_t
+scsi_it8951_cmd_read_reg (usec_ctx          *ctx,
+                          uint8_t            id,
+                          it8951_sg_io_hdr  *hdr,
+                          uint32_t           addr)
+{
+  uint8_t *cdb = hdr->cmdp;
+
+  hdr->cmd_len = 16;
+  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+    {
+      switch(i)
+        {
+          case 0:
+            cdb[i] = 0xFE;
+          break;
+
+          case 2:
+            cdb[i] = (uint8_t)((addr >> 24) & 0xFF);
+          break;
+
+          case 3:
+            cdb[i] = (uint8_t)((addr >> 16) & 0xFF);
+          break;
+
+          case 4:
+            cdb[i] = (uint8_t)((addr >> 8) & 0xFF);
+          break;
+
+          case 5:
+            cdb[i] = (uint8_t)(addr & 0xFF);
+          break;
+
+          case 6:
+            cdb[i] = IT8951_USB_OP_READ_REG;
+          break;
+
+          case 8:
+            cdb[i] = 0x04;
+          break;
+
+          default:
+            cdb[i] = 0x00;
+        }
+    }
+
+  hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+
+  if (usec_dev_xfer (ctx, id, hdr) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * scsi_it8951_cmd_write_reg()
+ */
+static uint8_t
+scsi_it8951_cmd_write_reg (usec_ctx          *ctx,
+                           uint8_t            id,
+                           it8951_sg_io_hdr  *hdr,
+                           uint32_t           addr)
+{
+  uint8_t *cdb = hdr->cmdp;
+
+  hdr->cmd_len = 16;
+  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+    {
+      switch(i)
+        {
+          case 0:
+            cdb[i] = 0xFE;
+          break;
+
+          case 2:
+            cdb[i] = (uint8_t)((addr >> 24) & 0xFF);
+          break;
+
+          case 3:
+            cdb[i] = (uint8_t)((addr >> 16) & 0xFF);
+          break;
+
+          case 4:
+            cdb[i] = (uint8_t)((addr >> 8) & 0xFF);
+          break;
+
+          case 5:
+            cdb[i] = (uint8_t)(addr & 0xFF);
+          break;
+
+          case 6:
+            cdb[i] = IT8951_USB_OP_WRITE_REG;
+          break;
+
+          case 8:
+            cdb[i] = 0x04;
+          break;
+
+          default:
+            cdb[i] = 0x00;
+        }
+    }
+
+  hdr->dxfer_direction = SG_DXFER_TO_DEV;
+
+  if (usec_dev_xfer (ctx, id, hdr) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * scsi_it8951_cmd_dpy_area()
+ */
+static uint8_t
+scsi_it8951_cmd_dpy_area (usec_ctx          *ctx,
+                          uint8_t            id,
+                          it8951_sg_io_hdr  *hdr)
+{
+  uint8_t *cdb = hdr->cmdp;
+
+  hdr->cmd_len = 16;
+  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+    {
+      switch(i)
+        {
+          case 0:
+            cdb[i] = 0xFE;
+          break;
+
+          case 6:
+            cdb[i] = IT8951_USB_OP_DPY_AREA;
+          break;
+
+          default:
+            cdb[i] = 0x00;
+        }
+    }
+
+  hdr->dxfer_direction = SG_DXFER_TO_DEV;
+
+  if (usec_dev_xfer (ctx, id, hdr) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * scsi_it8951_cmd_load_img()
+ */
+static uint8_t
+scsi_it8951_cmd_load_img (usec_ctx          *ctx,
+                          uint8_t            id,
+                          it8951_sg_io_hdr  *hdr)
+{
+  uint8_t *cdb = hdr->cmdp;
+
+  hdr->cmd_len = 16;
+  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+    {
+      switch(i)
+        {
+          case 0:
+            cdb[i] = 0xFE;
+          break;
+
+          case 6:
+            cdb[i] = IT8951_USB_OP_LD_IMG_AREA;
+          break;
+
+          default:
+            cdb[i] = 0x00;
+        }
+    }
+
+  hdr->dxfer_direction = SG_DXFER_TO_DEV;
+
+  if (usec_dev_xfer (ctx, id, hdr) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * scsi_it8951_cmd_get_set_temp()
+ */
+static uint8_t
+scsi_it8951_cmd_get_set_temp (usec_ctx          *ctx,
+                              uint8_t            id,
+                              it8951_sg_io_hdr  *hdr,
+                              uint8_t            temp_option,
+                              uint8_t            temp_value)
+{
+  uint8_t *cdb = hdr->cmdp;
+
+  hdr->cmd_len = 16;
+  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+    {
+      switch(i)
+        {
+          case 0:
+            cdb[i] = 0xFE;
+          break;
+
+          case 6:
+            cdb[i] = IT8951_USB_OP_FSET_TEMP;
+          break;
+
+          case 7:
+            cdb[i] = temp_option;
+          break;
+
+          case 8:
+            cdb[i] = temp_value;
+          break;
+
+          default:
+            cdb[i] = 0x00;
+        }
+    }
+
+  hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+
+  if (usec_dev_xfer (ctx, id, hdr) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * scsi_it8951_cmd_set_pmic()
+ */
+static uint8_t
+scsi_it8951_cmd_set_pmic (usec_ctx          *ctx,
+                          uint8_t            id,
+                          it8951_sg_io_hdr  *hdr,
+                          uint16_t           vcom,
+                          uint8_t            set_vcom,
+                          uint8_t            set_power,
+                          uint8_t            on_off)
+{
+  uint8_t *cdb = hdr->cmdp;
+
+  hdr->cmd_len = 16;
+  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+    {
+      switch(i)
+        {
+          case 0:
+            cdb[i] = 0xFE;
+          break;
+
+          case 6:
+            cdb[i] = IT8951_USB_OP_PMIC_CTL;
+          break;
+
+          case 7:
+            cdb[i] = (uint8_t)((vcom & 0xFF00) >> 8);
+          break;
+
+          case 8:
+            cdb[i] = (uint8_t)(vcom & 0xFF);
+          break;
+
+          case 9:
+            cdb[i] = set_vcom;
+          break;
+
+          case 10:
+            cdb[i] = set_power;
+          break;
+
+          case 11:
+            cdb[i] = on_off;
+          break;
+
+          default:
+            cdb[i] = 0x00;
+        }
+    }
+
+  hdr->dxfer_direction = SG_DXFER_FROM_DEV;
+
+  if (usec_dev_xfer (ctx, id, hdr) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * scsi_it8951_cmd_auto_reset()
+ */
+static uint8_t
+scsi_it8951_cmd_auto_reset (usec_ctx          *ctx,
+                            uint8_t            id,
+                            it8951_sg_io_hdr  *hdr)
+{
+  uint8_t *cdb = hdr->cmdp;
+
+  hdr->cmd_len = 16;
+  for (uint8_t i = 0; i < (hdr->cmd_len); i++)
+    {
+      switch(i)
+        {
+          case 0:
+            cdb[i] = 0xFE;
+          break;
+
+          case 6:
+            cdb[i] = IT8951_USB_OP_AUTO_RESET;
+          break;
+
+          default:
+            cdb[i] = 0x00;
+        }
+    }
+
+  hdr->dxfer_direction = SG_DXFER_TO_DEV;
+
+  if (usec_dev_xfer (ctx, id, hdr) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/******************************************************************************/
+
+/*
+ * it8951_cmd_inquiry()
+ */
+static uint8_t
+it8951_cmd_inquiry (usec_ctx  *ctx,
+                    uint8_t    id)
+{
+  it8951_sg_io_hdr *hdr;
+  uint8_t data_buffer[USEC_DEV_BLOCK_LEN*256];
+  uint8_t status;
+
+  hdr = init_io_hdr (ctx, id);
+  set_xfer_data (hdr, data_buffer, USEC_DEV_BLOCK_LEN*256);
+
+  status = scsi_it8951_cmd_inquiry (ctx, id, hdr);
+
+  return status;
+}
+
+/*
+ * it8951_cmd_system_info()
+ */
+static uint8_t
+it8951_cmd_system_info (usec_ctx         *ctx,
+                        uint8_t           id,
+                        it8951_sys_info  *info)
+{
+  it8951_sg_io_hdr *hdr;
+  uint8_t status;
+
+  hdr = init_io_hdr (ctx, id);
+  set_xfer_data (hdr, info, offsetof(it8951_sys_info, cmd_info_data));
+
+  status = scsi_it8951_cmd_system_info (ctx, id, hdr);
+  if (status == USEC_DEV_OK)
+    {
+      it8951_sys_info *data = hdr->dxferp;
+
+      info->standard_cmd_no = data_swap_32 (data->standard_cmd_no);
+      info->extend_cmd_no   = data_swap_32 (data->extend_cmd_no);
+      info->signature       = data_swap_32 (data->signature);
+      info->version         = data_swap_32 (data->version);
+      info->width           = data_swap_32 (data->width);
+      info->height          = data_swap_32 (data->height);
+      info->update_buf_base = data_swap_32 (data->update_buf_base);
+      info->image_buf_base  = data_swap_32 (data->image_buf_base);
+      info->temperature_no  = data_swap_32 (data->temperature_no);
+      info->mode_no         = data_swap_32 (data->mode_no);
+
+      for (uint8_t i = 0; i < 8; i++)
+        info->frame_count[i] = data_swap_32 (data->frame_count[i]);
+
+      info->num_img_buf = data_swap_32 (data->num_img_buf);
+      info->wbf_addr    = data_swap_32 (data->wbf_addr);
+
+      for (uint8_t i = 0; i < 9; i++)
+        info->reserved[i] = data_swap_32 (data->reserved[i]);
+    }
+
+  return status;
+}
+
+/*
+ * usec_scratch_addr() - image buffer which is not displayed at init, trial
+ * transfers must leave the live one alone
+ */
+static uint8_t
+usec_scratch_addr (usec_ctx  *ctx,
+                   uint8_t    id,
+                   uint32_t  *addr)
+{
+  if (ctx->dev_img_bufs[id] < 2)
+    return USEC_DEV_ERR;
+
+  *addr = ctx->dev_arena[id]->buf_base + (ctx->dev_img_bufs[id] - 1) *
+          ctx->dev_width[id] * ctx->dev_height[id];
+  return USEC_DEV_OK;
+}
+
+/*
+ * it8951_cmd_probe_rows() - trial LD_IMG_AREA of 'rows' rows from 'buf' to
+ * the scratch buffer at 'addr'
+ */
+static uint8_t
+it8951_cmd_probe_rows (usec_ctx  *ctx,
+                       uint8_t    id,
+                       uint8_t   *buf,
+                       uint32_t   addr,
+                       uint32_t   width,
+                       uint32_t   rows)
+{
+  it8951_load_arg *load_arg = (it8951_load_arg*) buf;
+  it8951_sg_io_hdr *hdr;
+
+  load_arg->x    = 0;
+  load_arg->y    = 0;
+  load_arg->w    = data_swap_32 (width);
+  load_arg->h    = data_swap_32 (rows);
+  load_arg->addr = data_swap_32 (addr);
+
+  hdr = init_io_hdr (ctx, id);
+  set_xfer_data (hdr, buf, sizeof(it8951_load_arg) + rows * width);
+
+  if (scsi_it8951_cmd_load_img (ctx, id, hdr) != USEC_DEV_OK ||
+      (hdr->info & SG_INFO_OK_MASK) != SG_INFO_OK)
+    return USEC_DEV_ERR;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * it8951_cmd_probe_xfer() - find the largest LD_IMG_AREA transfer accepted
+ * by controller and host adapter; starts from the adapter limit (if known)
+ * and halves it until a trial passes, then bisects between the last passed
+ * and the last rejected trial in whole rows; USEC_DEV_SPT_LEN is always
+ * safe (and used as is when controller has no spare image buffer)
+ */
+static uint32_t
+it8951_cmd_probe_xfer (usec_ctx  *ctx,
+                       uint8_t    id,
+                       uint32_t   width,
+                       uint32_t   height)
+{
+  uint32_t length, limit, addr;
+  uint32_t rows, top, good, bad;
+  uint8_t *buf;
+
+  if (usec_scratch_addr (ctx, id, &addr) != USEC_DEV_OK)
+    return USEC_DEV_SPT_LEN;
+
+  length = USEC_DEV_MAX_XFER_LEN;
+
+  limit = ctx->dev_ops->limit (ctx, id);
+  if (limit != 0 && limit < length)
+    length = limit;
+
+  if (length <= USEC_DEV_SPT_LEN || width == 0 ||
+      width > length - sizeof(it8951_load_arg))
+    return USEC_DEV_SPT_LEN;
+
+  buf = usec_dev_alloc (ctx, length);
+  if (buf == NULL)
+    return USEC_DEV_SPT_LEN;
+
+  memset (buf, 0xFF, length);
+
+  /* whole controller fits in one command, longer commands are never sent */
+  rows = (length - sizeof(it8951_load_arg)) / width;
+  if (rows > height)
+    rows = height;
+
+  /* halve until a trial passes */
+  top  = rows;
+  good = 0;
+  bad  = rows + 1;
+  while (rows > 0 &&
+         sizeof(it8951_load_arg) + rows * width > USEC_DEV_SPT_LEN)
+    {
+      if (it8951_cmd_probe_rows (ctx, id, buf, addr, width,
+                                 rows) == USEC_DEV_OK)
+        {
+          good = rows;
+          break;
+        }
+
+      bad  = rows;
+      rows = rows / 2;
+    }
+
+  /* reported adapter limit holds */
+  if (good == top && limit != 0)
+    {
+      free (buf);
+      return length;
+    }
+
+  /* limit is not a power of two fraction of the first trial, rows within
+     USEC_DEV_SPT_LEN need no trial */
+  if (good == 0)
+    good = (USEC_DEV_SPT_LEN - sizeof(it8951_load_arg)) / width;
+
+  while (good != 0 && bad - good > 1)
+    {
+      rows = good + (bad - good) / 2;
+
+      if (it8951_cmd_probe_rows (ctx, id, buf, addr, width,
+                                 rows) == USEC_DEV_OK)
+        good = rows;
+      else
+        bad = rows;
+    }
+
+  free (buf);
+
+  length = sizeof(it8951_load_arg) + good * width;
+  if (length < USEC_DEV_SPT_LEN)
+    length = USEC_DEV_SPT_LEN;
+
+  return length;
+}
+
+/*
+ * it8951_cmd_calibrate() - seed the cost model of every opcode with one
+ * timed single-row and one full-chunk transfer to a spare image buffer;
+ * uploads keep refining it, priors stay when there is no spare buffer
+ */
+static void
+it8951_cmd_calibrate (usec_ctx  *ctx,
+                      uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t width = ctx->dev_width[id];
+  uint32_t length, addr;
+  uint8_t *buf;
+
+  length = ctx->dev_xfer_len[id];
+  if (width == 0 || width > length - sizeof(it8951_load_arg))
+    return;
+
+  if (usec_scratch_addr (ctx, id, &addr) != USEC_DEV_OK)
+    return;
+
+  buf = usec_dev_alloc (ctx, length);
+  if (buf == NULL)
+    return;
+
+  memset (buf, 0xFF, length);
+
+  for (uint8_t op = 0; op < USEC_COST_OPS; op++)
+    {
+#if !USEC_DEV_FAST_WRITE
+      if (op == USEC_COST_OP_FAST_MEM)
+        continue;
+#endif
+
+      /* first trial only warms up the path, it is not sampled */
+      for (uint8_t trial = 0; trial < 3; trial++)
+        {
+          it8951_sg_io_hdr *hdr;
+          uint32_t rows, size;
+          uint64_t start;
+          uint8_t status;
+
+          rows = usec_xfer_rows (ctx, id, (op == USEC_COST_OP_LD_IMG) ?
+                                 XFER_STRATEGY_LD_IMG : XFER_STRATEGY_MEM,
+                                 width);
+          if ((trial & 1) == 0)
+            rows = 1;
+          if (rows > ctx->dev_height[id])
+            rows = ctx->dev_height[id];
+
+          size = rows * width;
+
+          hdr = init_io_hdr (ctx, id);
+
+          start = now_ns ();
+          if (op == USEC_COST_OP_LD_IMG)
+            {
+              it8951_load_arg *load_arg = (it8951_load_arg*) buf;
+
+              load_arg->x    = 0;
+              load_arg->y    = 0;
+              load_arg->w    = data_swap_32 (width);
+              load_arg->h    = data_swap_32 (rows);
+              load_arg->addr = data_swap_32 (addr);
+
+              size += sizeof(it8951_load_arg);
+              set_xfer_data (hdr, buf, size);
+              status = scsi_it8951_cmd_load_img (ctx, id, hdr);
+            }
+          else
+            {
+              set_xfer_data (hdr, buf, size);
+              status = scsi_it8951_cmd_write_mem (ctx, id, hdr, addr, size,
+                       op == USEC_COST_OP_FAST_MEM);
+            }
+
+          if (status == USEC_DEV_OK && trial != 0)
+            usec_cost_sample (&arena->cost[op], 1, size, now_ns () - start);
+        }
+    }
+
+  free (buf);
+}
+
+/*
+ * it8951_cmd_read_mem()
+ */
+static uint8_t
+it8951_cmd_read_mem (usec_ctx  *ctx,
+                     uint8_t    id,
+                     uint32_t   addr,
+                     uint16_t   length,
+                     uint8_t   *buf)
+{
+  it8951_sg_io_hdr *hdr;
+  uint8_t status;
+
+  hdr = init_io_hdr (ctx, id);
+  set_xfer_data (hdr, buf, length);
+
+  status = scsi_it8951_cmd_read_mem (ctx, id, hdr, addr, length);
+
+  return status;
+}
+
+/*
+ * it8951_cmd_write_mem()
+ */
+static uint8_t
+it8951_cmd_write_mem (usec_ctx  *ctx,
+                      uint8_t    id,
+                      uint32_t   addr,
+                      uint16_t   length,
+                      uint8_t   *buf)
+{
+  it8951_sg_io_hdr *hdr;
+  uint8_t status;
+
+  hdr = init_io_hdr (ctx, id);
+  set_xfer_data (hdr, buf, length);
+
+  status = scsi_it8951_cmd_write_mem (ctx, id, hdr, addr, length,
+                                      USEC_DEV_FAST_WRITE);
+
+  return status;
+}
+
+/*
+ * it8951_cmd_read_reg()
+ */
+static uint8_t
+it8951_cmd_read_reg (usec_ctx  *ctx,
+                     uint8_t    id,
+                     uint32_t   addr,
+                     uint32_t  *buf)
+{
+  it8951_sg_io_hdr *hdr;
+  uint8_t status;
+
+  hdr = init_io_hdr (ctx, id);
+  set_xfer_data (hdr, buf, sizeof(uint32_t));
+
+  status = scsi_it8951_cmd_read_reg (ctx, id, hdr, addr);
+  if (status == USEC_DEV_OK)
+    *buf = data_swap_32 (*buf);
+
+  return status;
+}
+
+/*
+ * it8951_cmd_write_reg()
+ */
+static uint8_t
+it8951_cmd_write_reg (usec_ctx  *ctx,
+                      uint8_t    id,
+                      uint32_t   addr,
+                      uint32_t   buf)
+{
+  it8951_sg_io_hdr *hdr;
+  uint32_t buf_in;
+  uint8_t status;
+
+  hdr = init_io_hdr (ctx, id);
+  buf_in = data_swap_32 (buf);
+  set_xfer_data (hdr, &buf_in, sizeof(uint32_t));
+
+  status = scsi_it8951_cmd_write_reg (ctx, id, hdr, addr);
+
+  return status;
+}
+
+/*
+ * usec_front_format() - format of the image buffer display commands show;
+ * live uploads go to the shown buffer when they are the same, cached frames
+ * are always 8bpp
+ */
+static uint8_t
+usec_front_format (usec_ctx  *ctx,
+                   uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+
+  if (arena->frame_shown)
+    return IMG_8BPP;
+
+  if (arena->buf_front == arena->buf_back)
+    return ctx->dev_format[id];
+
+  return arena->buf_format[arena->buf_front];
+}
+
+/*
+ * it8951_cmd_set_1bpp() - switch display engine between 8bpp and 1bpp image
+ * buffer format; in 1bpp mode set bits are shown with front gray value,
+ * cleared ones with back gray value (both in BGVR)
+ */
+static uint8_t
+it8951_cmd_set_1bpp (usec_ctx  *ctx,
+                     uint8_t    id,
+                     uint8_t    enable)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t val;
+
+  if (arena->mode_1bpp == enable)
+    return USEC_DEV_OK;
+
+  if (it8951_cmd_read_reg (ctx, id, IT8951_REG_UP1SR, &val) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  if (enable)
+    val |= IT8951_UP1SR_1BPP;
+  else
+    val &= ~IT8951_UP1SR_1BPP;
+
+  if (it8951_cmd_write_reg (ctx, id, IT8951_REG_UP1SR, val) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  if (enable &&
+      it8951_cmd_write_reg (ctx, id, IT8951_REG_BGVR,
+                            (IT8951_1BPP_FRONT_GRAY << 8) |
+                            IT8951_1BPP_BACK_GRAY) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  arena->mode_1bpp = enable;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * it8951_cmd_dpy_area()
+ */
+static uint8_t
+it8951_cmd_dpy_area (usec_ctx  *ctx,
+                     uint8_t    id,
+                     uint32_t   pos_x,
+                     uint32_t   pos_y,
+                     uint32_t   width,
+                     uint32_t   height,
+                     uint32_t   wav_mode,
+                     uint32_t   wait_ready)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  it8951_sg_io_hdr *hdr;
+  it8951_disp_arg displayArg;
+  uint8_t status;
+
+  /* engine format follows the image on display */
+  status = it8951_cmd_set_1bpp (ctx, id,
+                                usec_front_format (ctx, id) == IMG_1BPP);
+  if (status != USEC_DEV_OK)
+    return status;
+
+  displayArg.pos_x        = data_swap_32 (pos_x);
+  displayArg.pos_y        = data_swap_32 (pos_y);
+  displayArg.width        = data_swap_32 (width);
+  displayArg.height       = data_swap_32 (height);
+  displayArg.engine_index = data_swap_32 (wait_ready);
+  displayArg.mem_addr     = data_swap_32 (arena->front_addr);
+  displayArg.wav_mode     = data_swap_32 (wav_mode);
+
+  hdr = init_io_hdr (ctx, id);
+  set_xfer_data (hdr, &displayArg, sizeof(it8951_disp_arg));
+
+  /* synchronized display - command is ready, wait for other controllers */
+  if (arena->dpy_sync != NULL)
+    {
+      pthread_barrier_wait (arena->dpy_sync);
+      arena->dpy_sync = NULL;
+    }
+
+  if (arena->dpy_start_ns == 0)
+    arena->dpy_start_ns = now_ns ();
+
+  status = scsi_it8951_cmd_dpy_area (ctx, id, hdr);
+
+  return status;
+}
+
+/*
+ * it8951_cmd_load_img()
+ */
+static uint8_t
+it8951_cmd_load_img (usec_ctx  *ctx,
+                     uint8_t    id,
+                     uint8_t   *src_img,
+                     uint32_t   pos_x,
+                     uint32_t   pos_y,
+                     uint32_t   width,
+                     uint32_t   height,
+                     uint32_t   stride)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint8_t status;
+  uint32_t counter;
+  uint32_t cmds;
+  uint64_t bytes, start;
+  uint8_t strategy;
+  uint8_t fast;
+  uint8_t dio;
+
+  status = 0;
+  cmds = 0;
+  bytes = 0;
+  start = now_ns ();
+
+  /* direct I/O only for plain memory writes from usec_buf_alloc() buffers */
+  dio = (width == ctx->dev_width[id]) && (stride == width) &&
+        usec_dio_check (ctx, id, src_img, (size_t) width * height);
+
+  strategy = usec_xfer_plan (ctx, id, width, height, stride, dio, NULL);
+  counter = usec_xfer_rows (ctx, id, strategy, width);
+  fast = (strategy == XFER_STRATEGY_FAST_MEM ||
+          strategy == XFER_STRATEGY_FAST_MEM_ROWS);
+
+  ctx->dev_strategy[id] = strategy;
+  __atomic_add_fetch (&ctx->stats.xfer_strategy[strategy], 1,
+                      __ATOMIC_RELAXED);
+
+  /* chunks are kept 512-byte aligned so block layer can map them as-is */
+  if (dio)
+    {
+      uint32_t step = 512;
+
+      while ((width % step) != 0)
+        step >>= 1;
+      step = 512 / step;
+
+      if (counter >= step)
+        counter -= counter % step;
+      else
+        dio = 0;
+    }
+
+  for (uint32_t i = 0; i < height; i += counter)
+    {
+      struct usec_slot *slot;
+      uint8_t cmd_status;
+
+      if (counter > (height-i))
+        counter = (height-i);
+
+      /* with queue depth > 1 this only waits when all slots are in flight */
+      slot = usec_queue_slot (ctx, id, &status);
+      if (slot == NULL)
+        return USEC_DEV_ERR;
+
+      if (strategy == XFER_STRATEGY_LD_IMG)
+        {
+          it8951_load_arg *load_arg = (it8951_load_arg*) slot->buf;
+
+          load_arg->x    = data_swap_32 (pos_x);
+          load_arg->y    = data_swap_32 (pos_y + i);
+          load_arg->w    = data_swap_32 (width);
+          load_arg->h    = data_swap_32 (counter);
+          load_arg->addr = data_swap_32 (ctx->dev_addr[id]);
+
+          if (stride == width)
+            {
+              /* header and caller's pixel rows go out as separate iovec
+                 entries - no staging copy of the pixel data */
+              slot->iov[0].iov_base = load_arg;
+              slot->iov[0].iov_len  = sizeof(it8951_load_arg);
+              slot->iov[1].iov_base = src_img+(i*stride);
+              slot->iov[1].iov_len  = width*counter;
+
+              set_xfer_iovec (&slot->hdr, slot->iov, 2);
+            }
+          else
+            {
+              uint8_t *dst = slot->buf + sizeof(it8951_load_arg);
+
+              /* gather rows of a wider source image behind the header */
+              for (uint32_t row = 0; row < counter; row++)
+                memcpy (dst + row * width, src_img + (i + row) * stride,
+                        width);
+
+              set_xfer_data (&slot->hdr, slot->buf,
+                             sizeof(it8951_load_arg) + width * counter);
+            }
+
+          cmd_status = scsi_it8951_cmd_load_img (ctx, id, &slot->hdr);
+          bytes += sizeof(it8951_load_arg);
+        }
+      else
+        {
+          uint32_t addr;
+
+          addr = ctx->dev_addr[id] + pos_x + ((pos_y + i) * \
+                 (ctx->dev_width[id]));
+
+          set_xfer_data (&slot->hdr, (src_img + (i * stride)), width*counter);
+          if (dio)
+            slot->hdr.flags |= SG_FLAG_DIRECT_IO;
+
+          cmd_status = scsi_it8951_cmd_write_mem (ctx, id, &slot->hdr, addr,
+                                                  (uint32_t)(width * counter),
+                                                  fast);
+
+          /* host adapter refused direct I/O - resend the usual way */
+          if (cmd_status != USEC_DEV_OK && dio)
+            {
+              ctx->dev_dio_off[id] = 1;
+              dio = 0;
+
+              slot->hdr.flags &= ~SG_FLAG_DIRECT_IO;
+              cmd_status = scsi_it8951_cmd_write_mem (ctx, id, &slot->hdr,
+                           addr, (uint32_t)(width * counter), fast);
+            }
+
+          if (slot->hdr.usr_ptr == NULL)
+            usec_dio_account (ctx, &slot->hdr);
+        }
+
+      usec_queue_commit (ctx, id, slot, cmd_status);
+      status |= cmd_status;
+
+      cmds++;
+      bytes += (uint64_t) width * counter;
+    }
+
+  /* wait for all chunks still in flight */
+  status |= usec_queue_drain (ctx, id);
+
+  /* every upload refines the model of the opcode it used */
+  if (status == USEC_DEV_OK)
+    usec_cost_sample (&arena->cost[strategy == XFER_STRATEGY_LD_IMG ?
+                                   USEC_COST_OP_LD_IMG : fast ?
+                                   USEC_COST_OP_FAST_MEM : USEC_COST_OP_MEM],
+                      cmds, bytes, now_ns () - start);
+
+  return status;
+}
+
+/*
+ * it8951_cmd_load_img_fmt() - upload whole controller area in given pixel
+ * format; 1bpp rows are written packed (controller expands them at display
+ * time), 2/4bpp rows are expanded to 8bpp on the host first
+ */
+static uint8_t
+it8951_cmd_load_img_fmt (usec_ctx  *ctx,
+                         uint8_t    id,
+                         uint8_t   *src_img,
+                         uint8_t    img_format)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t width, height, pitch;
+  uint32_t counter;
+  uint8_t status;
+
+  width  = ctx->dev_width[id];
+  height = ctx->dev_height[id];
+
+  switch (img_format)
+    {
+      case IMG_8BPP:
+        status = it8951_cmd_load_img (ctx, id, src_img, 0, 0, width, height,
+                                      width);
+      break;
+
+      case IMG_1BPP:
+        status = it8951_cmd_load_img (ctx, id, src_img, 0, 0, width / 8,
+                                      height, width / 8);
+      break;
+
+      case IMG_2BPP:
+      case IMG_4BPP:
+        pitch   = (img_format == IMG_2BPP) ? (width / 4) : (width / 2);
+        counter = (ctx->dev_xfer_len[id] / width);
+        status  = USEC_DEV_OK;
+
+        for (uint32_t i = 0; i < height && status == USEC_DEV_OK; i += counter)
+          {
+            if (counter > (height-i))
+              counter = (height-i);
+
+            for (uint32_t row = 0; row < counter; row++)
+              usec_kern.unpack[img_format] (arena->stage + row * width,
+                                            src_img + (i + row) * pitch,
+                                            width);
+
+            status = it8951_cmd_load_img (ctx, id, arena->stage, 0, i, width,
+                                          counter, width);
+          }
+      break;
+
+      default:
+        status = USEC_DEV_ERR;
+    }
+
+  if (status == USEC_DEV_OK)
+    ctx->dev_format[id] = img_format;
+
+  return status;
+}
+
+/*
+ * it8951_cmd_render_img() - upload whole controller area through the mapped
+ * sg reserved buffer, pixels are rendered in place by the caller right
+ * behind LD_IMG_AREA header
+ */
+static uint8_t
+it8951_cmd_render_img (usec_ctx        *ctx,
+                       uint8_t          id,
+                       usec_render_fn   render,
+                       void            *user_data)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  it8951_load_arg *load_arg = (it8951_load_arg*) arena->mmap_buf;
+  uint32_t width, height;
+  uint8_t status;
+  uint32_t counter;
+  uint32_t cmds;
+  uint64_t bytes, start;
+
+  width  = ctx->dev_width[id];
+  height = ctx->dev_height[id];
+
+  counter = usec_xfer_rows (ctx, id, XFER_STRATEGY_LD_IMG, width);
+  if (counter > (arena->mmap_len - sizeof(it8951_load_arg)) / width)
+    counter = (arena->mmap_len - sizeof(it8951_load_arg)) / width;
+
+  status = USEC_DEV_OK;
+  cmds = 0;
+  bytes = 0;
+  start = now_ns ();
+
+  for (uint32_t i = 0; i < height && status == USEC_DEV_OK; i += counter)
+    {
+      struct usec_slot *slot;
+
+      if (counter > (height-i))
+        counter = (height-i);
+
+      /* reserved buffer is reused by every chunk, previous one must be
+         gone before the renderer overwrites it */
+      status = usec_queue_drain (ctx, id);
+      if (status != USEC_DEV_OK)
+        break;
+
+      slot = usec_queue_slot (ctx, id, &status);
+      if (slot == NULL)
+        return USEC_DEV_ERR;
+
+      render (user_data, id, i, counter,
+              arena->mmap_buf + sizeof(it8951_load_arg));
+
+      load_arg->x    = data_swap_32 (0);
+      load_arg->y    = data_swap_32 (i);
+      load_arg->w    = data_swap_32 (width);
+      load_arg->h    = data_swap_32 (counter);
+      load_arg->addr = data_swap_32 (ctx->dev_addr[id]);
+
+      slot->hdr.flags |= SG_FLAG_MMAP_IO;
+      set_xfer_data (&slot->hdr, NULL,
+                     sizeof(it8951_load_arg) + width * counter);
+
+      status = scsi_it8951_cmd_load_img (ctx, id, &slot->hdr);
+      usec_queue_commit (ctx, id, slot, status);
+
+      cmds++;
+      bytes += sizeof(it8951_load_arg) + (uint64_t) width * counter;
+    }
+
+  /* wait for the last chunk */
+  status |= usec_queue_drain (ctx, id);
+
+  if (status == USEC_DEV_OK)
+    {
+      usec_cost_sample (&arena->cost[USEC_COST_OP_LD_IMG], cmds, bytes,
+                        now_ns () - start);
+      ctx->dev_format[id] = IMG_8BPP;
+    }
+
+  return status;
+}
+
+/*
+ * it8951_cmd_get_set_temp()
+ */
+static uint8_t
+it8951_cmd_get_set_temp (usec_ctx         *ctx,
+                         uint8_t           id,
+                         it8951_temp_arg  *temp)
+{
+  it8951_sg_io_hdr *hdr;
+  uint8_t status, flag;
+
+  flag = temp->set;
+  hdr = init_io_hdr (ctx, id);
+
+  set_xfer_data (hdr, temp, sizeof(it8951_temp_arg) / sizeof(uint8_t));
+
+  status = scsi_it8951_cmd_get_set_temp (ctx, id,
+                                         hdr, temp->set,temp->val);
+  if (status == USEC_DEV_OK)
+    {
+      if (flag == IT8951_TEMP_GET)
+        {
+          it8951_temp_arg *temp_tmp;
+          uint8_t temp_byte;
+
+          /* swap */
+          temp_tmp = hdr->dxferp;
+          temp_byte = temp_tmp->set;
+          temp_tmp->set = temp_tmp->val;
+          temp_tmp->val = temp_byte;
+        }
+    }
+
+  return status;
+}
+
+/*
+ * it8951_cmd_get_set_pmic()
+ */
+static uint8_t
+it8951_cmd_get_set_pmic (usec_ctx  *ctx,
+                         uint8_t    id,
+                         uint16_t   vcom_set_value,
+                         uint16_t  *vcom_get_value,
+                         uint8_t    do_set_vcom,
+                         uint8_t    do_set_power,
+                         uint8_t    power_on_off)
+{
+  it8951_sg_io_hdr *hdr;
+  uint8_t status;
+
+  hdr = init_io_hdr (ctx, id);
+  set_xfer_data (hdr, vcom_get_value, sizeof (uint16_t));
+
+  status = scsi_it8951_cmd_set_pmic(ctx, id, hdr, vcom_set_value,
+                                    do_set_vcom, do_set_power, power_on_off);
+if (status == USEC_DEV_OK)
+    {
+      if (vcom_set_value == 0xffff)
+        {
+          /* swap */
+          *vcom_get_value = (*vcom_get_value >> 8) | (*vcom_get_value << 8);
+        }
+    }
+
+  return status;
+}
+
+/*
+ * it8951_cmd_power_off() - switch panel rails off using given command slot
+ */
+static uint8_t
+it8951_cmd_power_off (usec_ctx          *ctx,
+                      uint8_t            id,
+                      struct usec_slot  *slot)
+{
+  it8951_sg_io_hdr *hdr;
+
+  hdr = init_slot_hdr (slot);
+  set_xfer_data (hdr, NULL, 0);
+  set_sense_data (hdr, slot->sense, USEC_DEV_SENSE_LEN);
+
+  return scsi_it8951_cmd_set_pmic (ctx, id, hdr, 0, 0, 1, 0);
+}
+
+/*
+ * it8951_cmd_auto_reset()
+ */
+static uint8_t
+it8951_cmd_auto_reset (usec_ctx  *ctx,
+                       uint8_t    id)
+{
+  it8951_sg_io_hdr *hdr;
+  uint8_t status;
+
+  hdr = init_io_hdr (ctx, id);
+  set_xfer_data (hdr, NULL, 0);
+
+  status = scsi_it8951_cmd_auto_reset (ctx, id, hdr);
+
+  return status;
+}
+
+/******************************************************************************/
+
+/*
+ * usec_dev_log()
+ */
+static void
+usec_dev_log (const char* fmt, ...)
+{
+#if USEC_DEV_DEBUG_LOG
+  va_list args;
+
+  va_start (args, fmt);
+  vprintf (fmt, args);
+  va_end (args);
+#endif
+}
+
+/******************************************************************************/
+
+/*
+ * usec_worker_main()
+ */
+static void *
+usec_worker_main (void *arg)
+{
+  struct usec_worker *worker = arg;
+
+  pthread_mutex_lock (&worker->lock);
+  for (;;)
+    {
+      while (!worker->pending && !worker->quit)
+        pthread_cond_wait (&worker->cond, &worker->lock);
+
+      if (worker->quit)
+        break;
+
+      pthread_mutex_unlock (&worker->lock);
+      worker->status = worker->job (worker->ctx, worker->id, worker->arg);
+      pthread_mutex_lock (&worker->lock);
+
+      worker->pending = 0;
+      pthread_cond_broadcast (&worker->cond);
+    }
+  pthread_mutex_unlock (&worker->lock);
+
+  return NULL;
+}
+
+/*
+ * usec_workers_start()
+ */
+static uint8_t
+usec_workers_start (usec_ctx *ctx)
+{
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      struct usec_worker *worker;
+
+      if (ctx->dev_worker[cnt] != NULL)
+        continue;
+
+      worker = usec_dev_alloc (ctx, sizeof(*worker));
+      if (worker == NULL)
+        return USEC_DEV_ERR;
+
+      worker->ctx = ctx;
+      worker->id  = cnt;
+      pthread_mutex_init (&worker->lock, NULL);
+      pthread_cond_init (&worker->cond, NULL);
+
+      if (pthread_create (&worker->thread, NULL, usec_worker_main, worker))
+        {
+          pthread_cond_destroy (&worker->cond);
+          pthread_mutex_destroy (&worker->lock);
+          free (worker);
+          return USEC_DEV_ERR;
+        }
+
+      ctx->dev_worker[cnt] = worker;
+    }
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_workers_stop()
+ */
+static void
+usec_workers_stop (usec_ctx *ctx)
+{
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      struct usec_worker *worker = ctx->dev_worker[cnt];
+
+      if (worker == NULL)
+        continue;
+
+      pthread_mutex_lock (&worker->lock);
+      worker->quit = 1;
+      pthread_cond_broadcast (&worker->cond);
+      pthread_mutex_unlock (&worker->lock);
+
+      pthread_join (worker->thread, NULL);
+      pthread_cond_destroy (&worker->cond);
+      pthread_mutex_destroy (&worker->lock);
+      free (worker);
+
+      ctx->dev_worker[cnt] = NULL;
+    }
+}
+
+/*
+ * usec_workers_run() - run job on all controllers at once and wait for
+ * completion; per-controller result is stored in ctx->dev_status[],
+ * controllers with NULL argument are left alone
+ */
+static uint8_t
+usec_workers_run (usec_ctx     *ctx,
+                  usec_job_fn   job,
+                  void         *args[4])
+{
+  uint8_t status = USEC_DEV_OK;
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      struct usec_worker *worker = ctx->dev_worker[cnt];
+
+      if (args[cnt] == NULL)
+        continue;
+
+      pthread_mutex_lock (&worker->lock);
+      worker->job     = job;
+      worker->arg     = args[cnt];
+      worker->pending = 1;
+      pthread_cond_broadcast (&worker->cond);
+      pthread_mutex_unlock (&worker->lock);
+    }
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      struct usec_worker *worker = ctx->dev_worker[cnt];
+
+      if (args[cnt] == NULL)
+        continue;
+
+      pthread_mutex_lock (&worker->lock);
+      while (worker->pending)
+        pthread_cond_wait (&worker->cond, &worker->lock);
+      pthread_mutex_unlock (&worker->lock);
+
+      ctx->dev_status[cnt] = worker->status;
+      status |= worker->status;
+    }
+
+  return status;
+}
+
+/******************************************************************************/
+
+/*
+ * usec_power_main() - switch rails off once the deadline passes without
+ * another update
+ */
+static void *
+usec_power_main (void *arg)
+{
+  struct usec_power *power = arg;
+  usec_ctx *ctx = power->ctx;
+
+  pthread_mutex_lock (&power->lock);
+  for (;;)
+    {
+      uint64_t now;
+
+      while (power->deadline == 0 && !power->quit)
+        pthread_cond_wait (&power->cond, &power->lock);
+
+      if (power->quit)
+        break;
+
+      now = now_ns ();
+      if (now < power->deadline)
+        {
+          struct timespec ts;
+
+          ts.tv_sec  = power->deadline / 1000000000ULL;
+          ts.tv_nsec = power->deadline % 1000000000ULL;
+          pthread_cond_timedwait (&power->cond, &power->lock, &ts);
+          continue;
+        }
+
+      /* controller lock comes before ours elsewhere, do not wait for it
+         here; whoever holds it is about to finish */
+      if (pthread_mutex_trylock (&ctx->dev_arena[0]->lock) != 0)
+        {
+          struct timespec ts;
+
+          now += USEC_DEV_POLL_MAX_US * 1000ULL;
+          ts.tv_sec  = now / 1000000000ULL;
+          ts.tv_nsec = now % 1000000000ULL;
+          pthread_cond_timedwait (&power->cond, &power->lock, &ts);
+          continue;
+        }
+
+      power->deadline = 0;
+      if (it8951_cmd_power_off (ctx, 0, &power->cmd) == USEC_DEV_OK)
+        {
+          ctx->power_on = 0;
+          __atomic_add_fetch (&ctx->stats.power_offs, 1, __ATOMIC_RELAXED);
+        }
+      pthread_mutex_unlock (&ctx->dev_arena[0]->lock);
+    }
+  pthread_mutex_unlock (&power->lock);
+
+  return NULL;
+}
+
+/*
+ * usec_power_start()
+ */
+static uint8_t
+usec_power_start (usec_ctx *ctx)
+{
+  struct usec_power *power;
+  pthread_condattr_t attr;
+
+  if (ctx->dev_power != NULL)
+    return USEC_DEV_OK;
+
+  power = usec_dev_alloc (ctx, sizeof(*power));
+  if (power == NULL)
+    return USEC_DEV_ERR;
+
+  power->ctx = ctx;
+  pthread_mutex_init (&power->lock, NULL);
+
+  /* deadlines come from the monotonic clock */
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&power->cond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  if (pthread_create (&power->thread, NULL, usec_power_main, power))
+    {
+      pthread_cond_destroy (&power->cond);
+      pthread_mutex_destroy (&power->lock);
+      free (power);
+      return USEC_DEV_ERR;
+    }
+
+  ctx->dev_power = power;
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_power_stop() - pending power-off is dropped, rails stay as they are
+ */
+static void
+usec_power_stop (usec_ctx *ctx)
+{
+  struct usec_power *power = ctx->dev_power;
+
+  if (power == NULL)
+    return;
+
+  pthread_mutex_lock (&power->lock);
+  power->quit = 1;
+  pthread_cond_broadcast (&power->cond);
+  pthread_mutex_unlock (&power->lock);
+
+  pthread_join (power->thread, NULL);
+  pthread_cond_destroy (&power->cond);
+  pthread_mutex_destroy (&power->lock);
+  free (power);
+
+  ctx->dev_power = NULL;
+}
+
+/*
+ * usec_power_begin() - display sequence must not interleave with the timer
+ */
+static void
+usec_power_begin (usec_ctx *ctx)
+{
+  if (ctx->dev_power != NULL)
+    pthread_mutex_lock (&ctx->dev_power->lock);
+}
+
+/*
+ * usec_power_end() - apply power policy after display sequence ('used' -
+ * some display command was sent), returns power command status
+ */
+static uint8_t
+usec_power_end (usec_ctx  *ctx,
+                uint8_t    used)
+{
+  struct usec_power *power = ctx->dev_power;
+  uint8_t status = USEC_DEV_OK;
+
+  if (used)
+    {
+      switch (ctx->power_policy)
+        {
+          case POWER_POLICY_OFF:
+            status = it8951_cmd_get_set_pmic (ctx, 0, 2, NULL, 0, 1, 0);
+            if (status == USEC_DEV_OK)
+              {
+                ctx->power_on = 0;
+                __atomic_add_fetch (&ctx->stats.power_offs, 1,
+                                    __ATOMIC_RELAXED);
+              }
+          break;
+
+          case POWER_POLICY_IDLE:
+            ctx->power_on = 1;
+            power->deadline = now_ns () +
+                              (uint64_t) ctx->power_idle_ms * 1000000ULL;
+            pthread_cond_broadcast (&power->cond);
+          break;
+
+          default:
+            ctx->power_on = 1;
+        }
+    }
+
+  if (power != NULL)
+    pthread_mutex_unlock (&power->lock);
+
+  return status;
+}
+
+/******************************************************************************/
+
+/*
+ * usec_submit_take() - claim the newest submitted frame and drop the ones it
+ * supersedes, NULL when there is none
+ */
+static struct usec_submit_slot *
+usec_submit_take (struct usec_submit *sub)
+{
+  struct usec_submit_slot *newest;
+  uint64_t state = 0;
+
+  for (;;)
+    {
+      newest = NULL;
+      for (uint8_t i = 0; i < USEC_DEV_SUBMIT_SLOTS; i++)
+        {
+          uint64_t cur = __atomic_load_n (&sub->slot[i].state,
+                                          __ATOMIC_SEQ_CST);
+
+          if ((cur & USEC_SUBMIT_MASK) == USEC_SUBMIT_READY &&
+              (newest == NULL || cur > state))
+            {
+              newest = &sub->slot[i];
+              state = cur;
+            }
+        }
+
+      if (newest == NULL)
+        return NULL;
+
+      /* lost it to producer reusing the slot, look again */
+      if (__atomic_compare_exchange_n (&newest->state, &state,
+                                       (state & ~(uint64_t) USEC_SUBMIT_MASK) |
+                                       USEC_SUBMIT_BUSY, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        break;
+    }
+
+  for (uint8_t i = 0; i < USEC_DEV_SUBMIT_SLOTS; i++)
+    {
+      uint64_t cur = __atomic_load_n (&sub->slot[i].state, __ATOMIC_SEQ_CST);
+
+      if ((cur & USEC_SUBMIT_MASK) == USEC_SUBMIT_READY && cur < state &&
+          __atomic_compare_exchange_n (&sub->slot[i].state, &cur,
+                                       USEC_SUBMIT_FREE, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        __atomic_add_fetch (&sub->ctx->stats.submit_drops, 1,
+                            __ATOMIC_RELAXED);
+    }
+
+  return newest;
+}
+
+/*
+ * usec_submit_show() - upload and display frame with the regular calls, they
+ * take controller locks as any other caller
+ */
+static uint8_t
+usec_submit_show (struct usec_submit       *sub,
+                  struct usec_submit_slot  *slot)
+{
+  usec_ctx *ctx = sub->ctx;
+  uint64_t latency;
+  uint8_t single;
+
+  /* settings are changed with all controller locks held */
+  usec_lock (ctx, 1);
+  single = (ctx->img_buffers < 2);
+  usec_unlock (ctx, 1);
+
+  if (usec_img_upload (ctx, slot->img_data, sub->img_size) != USEC_DEV_OK ||
+      usec_img_update (ctx, slot->update_mode, 0) != USEC_DEV_OK)
+    {
+      __atomic_add_fetch (&ctx->stats.submit_errors, 1, __ATOMIC_RELAXED);
+      return USEC_DEV_ERR;
+    }
+
+  latency = now_ns () - slot->submit_ns;
+  __atomic_store_n (&ctx->stats.submit_latency_ns, latency, __ATOMIC_RELAXED);
+  if (latency > ctx->stats.submit_latency_max_ns)
+    __atomic_store_n (&ctx->stats.submit_latency_max_ns, latency,
+                      __ATOMIC_RELAXED);
+
+  /* the only image buffer is being displayed, next upload must not touch
+     it; frames submitted meanwhile get coalesced */
+  if (single)
+    usec_wait_ready (ctx, USEC_DEV_BUF_WAIT_MS);
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_submit_main() - I/O thread, always sends the newest frame; pending one
+ * is still shown before quitting, failed one stays pending until the next
+ * wake-up (unless a newer frame replaces it)
+ */
+static void *
+usec_submit_main (void *arg)
+{
+  struct usec_submit *sub = arg;
+  struct usec_submit_slot *slot;
+
+  for (;;)
+    {
+      while (sem_wait (&sub->wake) != 0 && errno == EINTR)
+        ;
+
+      __atomic_store_n (&sub->pending, 0, __ATOMIC_SEQ_CST);
+      while ((slot = usec_submit_take (sub)) != NULL)
+        {
+          uint64_t state = __atomic_load_n (&slot->state, __ATOMIC_SEQ_CST);
+
+          if (usec_submit_show (sub, slot) != USEC_DEV_OK)
+            {
+              __atomic_store_n (&slot->state,
+                                (state & ~(uint64_t) USEC_SUBMIT_MASK) |
+                                USEC_SUBMIT_READY, __ATOMIC_SEQ_CST);
+              break;
+            }
+
+          __atomic_store_n (&slot->state, USEC_SUBMIT_FREE, __ATOMIC_SEQ_CST);
+        }
+
+      if (__atomic_load_n (&sub->quit, __ATOMIC_SEQ_CST))
+        break;
+    }
+
+  return NULL;
+}
+
+/*
+ * usec_submit_start()
+ */
+static uint8_t
+usec_submit_start (usec_ctx *ctx)
+{
+  struct usec_submit *sub;
+
+  if (ctx->dev_submit != NULL)
+    return USEC_DEV_OK;
+
+  sub = usec_dev_alloc (ctx, sizeof(*sub));
+  if (sub == NULL)
+    return USEC_DEV_ERR;
+
+  sub->ctx = ctx;
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    sub->img_size += ctx->dev_width[cnt] * ctx->dev_height[cnt];
+
+  for (uint8_t i = 0; i < USEC_DEV_SUBMIT_SLOTS; i++)
+    {
+      sub->slot[i].img_data = usec_dev_alloc (ctx, sub->img_size);
+      if (sub->slot[i].img_data == NULL)
+        goto fail;
+    }
+
+  if (sem_init (&sub->wake, 0, 0))
+    goto fail;
+
+  if (pthread_create (&sub->thread, NULL, usec_submit_main, sub))
+    {
+      sem_destroy (&sub->wake);
+      goto fail;
+    }
+
+  ctx->dev_submit = sub;
+  return USEC_DEV_OK;
+
+fail:
+  for (uint8_t i = 0; i < USEC_DEV_SUBMIT_SLOTS; i++)
+    free (sub->slot[i].img_data);
+  free (sub);
+  return USEC_DEV_ERR;
+}
+
+/*
+ * usec_submit_stop() - frame still waiting in the queue is shown first
+ */
+static void
+usec_submit_stop (usec_ctx *ctx)
+{
+  struct usec_submit *sub = ctx->dev_submit;
+
+  if (sub == NULL)
+    return;
+
+  __atomic_store_n (&sub->quit, 1, __ATOMIC_SEQ_CST);
+  sem_post (&sub->wake);
+
+  pthread_join (sub->thread, NULL);
+  sem_destroy (&sub->wake);
+  for (uint8_t i = 0; i < USEC_DEV_SUBMIT_SLOTS; i++)
+    free (sub->slot[i].img_data);
+  free (sub);
+
+  ctx->dev_submit = NULL;
+}
+
+/******************************************************************************/
+
+/*
+ * usec_mmap_free()
+ */
+static void
+usec_mmap_free (usec_ctx *ctx)
+{
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      struct usec_arena *arena = ctx->dev_arena[cnt];
+
+      if (arena == NULL || arena->mmap_buf == NULL)
+        continue;
+
+      ctx->dev_ops->unmap (ctx, cnt, arena->mmap_buf, arena->mmap_len);
+      arena->mmap_buf = NULL;
+      arena->mmap_len = 0;
+    }
+}
+
+/*
+ * usec_ctx_free()
+ */
+static void
+usec_ctx_free (usec_ctx *ctx)
+{
+  usec_submit_stop (ctx);
+  usec_workers_stop (ctx);
+  usec_power_stop (ctx);
+
+  /* rails left on by power policy */
+  if (ctx->power_on)
+    it8951_cmd_get_set_pmic (ctx, 0, 2, NULL, 0, 1, 0);
+  usec_mmap_free (ctx);
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    ctx->dev_ops->close (ctx, cnt);
+
+  if (ctx->dev_dio != NULL)
+    {
+      for (uint8_t i = 0; i < USEC_DEV_MAX_DIO_BUFS; i++)
+        usec_buf_free (ctx, ctx->dev_dio[i].buf);
+      free (ctx->dev_dio);
+    }
+
+  usec_arena_free (ctx);
+
+  free (ctx);
+}
+
+/*
+ * usec_init_transport()
+ */
+static usec_ctx *
+usec_init_transport (const struct usec_transport  *ops,
+                     const void                   *cfg)
+{
+  usec_ctx *ctx;
+  it8951_sys_info info;
+  uint8_t status;
+
+  /* init usec context */
+  ctx = malloc(sizeof(*ctx));
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: cannot initialize device context\n\r");
+      return NULL;
+    }
+  memset (ctx, 0, sizeof(*ctx));
+
+  ctx->dev_ops = ops;
+  ctx->upload_mode = UPLOAD_MODE_SERIAL;
+
+  usec_dev_log ("[usec] status: pixel kernels - %s\n\r",
+                usec_kernels_init ()->name);
+  ctx->dev_fd[0] = 0;
+  ctx->dev_fd[1] = 0;
+  ctx->dev_fd[2] = 0;
+  ctx->dev_fd[3] = 0;
+
+  /* init command arenas - blocking transfers by default */
+  ctx->queue_depth = 1;
+  ctx->img_buffers = 1;
+  ctx->dev_dio = usec_dev_alloc (ctx, USEC_DEV_MAX_DIO_BUFS *
+                                      sizeof(struct usec_dio_buf));
+  if (ctx->dev_dio == NULL || usec_arena_alloc (ctx, 0) != USEC_DEV_OK)
+    {
+      usec_dev_log ("[usec] error: cannot initialize device context\n\r");
+
+      usec_arena_free (ctx);
+      free (ctx->dev_dio);
+      free (ctx);
+      return NULL;
+    }
+
+  /* open all devices */
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      /* open usec device */
+      status = ops->open (ctx, cnt, cfg);
+      if (status != 0)
+        {
+          usec_dev_log ("[usec] error: cannot open device %d\n\r", cnt);
+
+          usec_ctx_free (ctx);
+          return NULL;
+        }
+
+      /* send 'inquiry' command */
+      status = it8951_cmd_inquiry(ctx, cnt);
+      if (status != 0)
+        {
+          usec_dev_log ("[usec] error: cannot send 'inquiry' command\n\r");
+
+          usec_ctx_free (ctx);
+          return NULL;
+        }
+
+      status = it8951_cmd_system_info (ctx, cnt, &info);
+      if (status != 0)
+        {
+          usec_dev_log ("[usec] error: cannot read data from controller\n\r");
+
+          usec_ctx_free (ctx);
+          return NULL;
+        }
+
+      ctx->dev_width[cnt]  = info.width;
+      ctx->dev_height[cnt] = info.height;
+      ctx->dev_addr[cnt]   = info.image_buf_base;
+      ctx->dev_format[cnt] = IMG_8BPP;
+      ctx->dev_img_bufs[cnt] = info.num_img_buf;
+
+      ctx->dev_arena[cnt]->buf_base   = info.image_buf_base;
+      ctx->dev_arena[cnt]->front_addr = info.image_buf_base;
+
+      ctx->dev_xfer_len[cnt] = it8951_cmd_probe_xfer (ctx, cnt, info.width,
+                                                      info.height);
+      it8951_cmd_calibrate (ctx, cnt);
+
+      usec_dev_log ("[usec] status: screen width - %d [px]\n\r",
+                    ctx->dev_width[cnt]);
+      usec_dev_log ("[usec] status: screen height - %d [px]\n\r",
+                    ctx->dev_height[cnt]);
+      usec_dev_log ("[usec] status: transfer length - %d [B]\n\r",
+                    ctx->dev_xfer_len[cnt]);
+  }
+
+  /* staging buffers are sized from probed transfer lengths */
+  if (usec_arena_alloc (ctx, ctx->queue_depth) != USEC_DEV_OK)
+    {
+      usec_dev_log ("[usec] error: cannot initialize device context\n\r");
+
+      usec_ctx_free (ctx);
+      return NULL;
+    }
+
+  return ctx;
+}
+
+/*
+ * usec_init()
+ */
+usec_ctx *
+usec_init (void)
+{
+  return usec_init_transport (&usec_sg_transport, NULL);
+}
+
+/*
+ * usec_init_sim()
+ */
+usec_ctx *
+usec_init_sim (const usec_sim_cfg *cfg)
+{
+  return usec_init_transport (&usec_sim_transport, cfg);
+}
+
+/*
+ * usec_deinit()
+ */
+void
+usec_deinit (usec_ctx *ctx)
+{
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return;
+    }
+
+  usec_ctx_free (ctx);
+}
+
+/*
+ * usec_sim_get_panel()
+ */
+const uint8_t *
+usec_sim_get_panel (usec_ctx  *ctx,
+                    uint8_t    id)
+{
+  struct usec_sim *sim;
+
+  if (ctx == NULL || id > 3 || ctx->dev_ops != &usec_sim_transport)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return NULL;
+    }
+
+  sim = ctx->dev_priv[id];
+  return sim->panel;
+}
+
+/*
+ * usec_get_temp()
+ */
+uint8_t
+usec_get_temp (usec_ctx  *ctx,
+               uint8_t   *temp_val)
+{
+  it8951_temp_arg temp;
+  uint8_t status;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  temp.set = IT8951_TEMP_GET;
+  usec_lock (ctx, 1 << 2);
+  status = it8951_cmd_get_set_temp (ctx, 2, &temp);
+  usec_unlock (ctx, 1 << 2);
+  if (status == USEC_DEV_OK)
+    {
+      usec_dev_log ("[usec] status: screen temp - %d [degC]\n\r", temp.val);
+      if (temp_val != NULL)
+        *temp_val = temp.val;
+    }
+  else
+    {
+      usec_dev_log ("[usec] error: cannot read data from temperature " \
+                    "sensor\n\r");
+    }
+
+  return status;
+}
+
+/*
+ * usec_get_vcom()
+ */
+uint8_t
+usec_get_vcom (usec_ctx  *ctx,
+               uint16_t  *vcom_val)
+{
+  uint16_t vcom;
+  uint8_t status;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  usec_lock (ctx, 1 << 2);
+  status = it8951_cmd_get_set_pmic (ctx, 2, 0xFFFF, &vcom, 0, 0, 0);
+  usec_unlock (ctx, 1 << 2);
+  if (status == USEC_DEV_OK)
+    {
+      usec_dev_log ("[usec] status: screen vcom - -%.2f [V]\n\r",
+                    (float)vcom/1000);
+      if (vcom_val != NULL)
+        *vcom_val = vcom;
+    }
+  else
+    {
+      usec_dev_log ("[usec] error: cannot read vcom value\n\r");
+    }
+
+  return status;
+}
+
+/*
+ * usec_set_upload_mode_locked()
+ */
+static uint8_t
+usec_set_upload_mode_locked (usec_ctx  *ctx,
+                             uint8_t    upload_mode)
+{
+  if (upload_mode > UPLOAD_MODE_PARALLEL)
+    {
+      usec_dev_log ("[usec] error: invalid upload mode value\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  if (upload_mode == UPLOAD_MODE_PARALLEL)
+    {
+      if (usec_workers_start (ctx) != USEC_DEV_OK)
+        {
+          usec_dev_log ("[usec] error: cannot start upload workers\n\r");
+
+          usec_workers_stop (ctx);
+          ctx->upload_mode = UPLOAD_MODE_SERIAL;
+          return USEC_DEV_ERR;
+        }
+    }
+  else if (ctx->dpy_mode != DPY_MODE_SYNC)
+    {
+      usec_workers_stop (ctx);
+    }
+
+  ctx->upload_mode = upload_mode;
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_set_upload_mode()
+ */
+uint8_t
+usec_set_upload_mode (usec_ctx  *ctx,
+                      uint8_t    upload_mode)
+{
+  uint8_t status;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_set_upload_mode_locked (ctx, upload_mode);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return status;
+}
+
+/*
+ * usec_set_dpy_mode_locked()
+ */
+static uint8_t
+usec_set_dpy_mode_locked (usec_ctx  *ctx,
+                          uint8_t    dpy_mode)
+{
+  if (dpy_mode > DPY_MODE_SYNC)
+    {
+      usec_dev_log ("[usec] error: invalid display mode value\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  if (dpy_mode == DPY_MODE_SYNC)
+    {
+      if (usec_workers_start (ctx) != USEC_DEV_OK)
+        {
+          usec_dev_log ("[usec] error: cannot start display workers\n\r");
+
+          if (ctx->upload_mode != UPLOAD_MODE_PARALLEL)
+            usec_workers_stop (ctx);
+          ctx->dpy_mode = DPY_MODE_SERIAL;
+          return USEC_DEV_ERR;
+        }
+    }
+  else if (ctx->upload_mode != UPLOAD_MODE_PARALLEL)
+    {
+      usec_workers_stop (ctx);
+    }
+
+  ctx->dpy_mode = dpy_mode;
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_set_dpy_mode() - display commands of controllers are sent by upload
+ * workers in DPY_MODE_SYNC
+ */
+uint8_t
+usec_set_dpy_mode (usec_ctx  *ctx,
+                   uint8_t    dpy_mode)
+{
+  uint8_t status;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_set_dpy_mode_locked (ctx, dpy_mode);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return status;
+}
+
+/*
+ * usec_set_queue_depth_locked()
+ */
+static uint8_t
+usec_set_queue_depth_locked (usec_ctx  *ctx,
+                             uint8_t    queue_depth)
+{
+  if (queue_depth < 1 || queue_depth > USEC_DEV_MAX_QUEUE)
+    {
+      usec_dev_log ("[usec] error: invalid queue depth value\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  if (usec_arena_alloc (ctx, queue_depth) != USEC_DEV_OK)
+    {
+      usec_dev_log ("[usec] error: cannot allocate command slots\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  ctx->queue_depth = queue_depth;
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_set_queue_depth()
+ */
+uint8_t
+usec_set_queue_depth (usec_ctx  *ctx,
+                      uint8_t    queue_depth)
+{
+  uint8_t status;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_set_queue_depth_locked (ctx, queue_depth);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return status;
+}
+
+/*
+ * usec_ghost_level() - fast updates since the last cleaning, worst tile when
+ * tiles are tracked
+ */
+static uint32_t
+usec_ghost_level (usec_ctx  *ctx,
+                  uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t level = 0;
+
+  if (arena->tile_ghost == NULL)
+    return arena->ghost;
+
+  for (uint32_t t = 0; t < arena->tiles_x * arena->tiles_y; t++)
+    if (arena->tile_ghost[t] > level)
+      level = arena->tile_ghost[t];
+
+  return level;
+}
+
+/*
+ * usec_set_power_policy_locked()
+ */
+static uint8_t
+usec_set_power_policy_locked (usec_ctx  *ctx,
+                              uint8_t    power_policy,
+                              uint32_t   idle_ms)
+{
+  uint8_t status = USEC_DEV_OK;
+
+  if (power_policy > POWER_POLICY_IDLE)
+    {
+      usec_dev_log ("[usec] error: invalid power policy value\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  if (power_policy == POWER_POLICY_IDLE)
+    {
+      if (usec_power_start (ctx) != USEC_DEV_OK)
+        {
+          usec_dev_log ("[usec] error: cannot start power timer\n\r");
+          return USEC_DEV_ERR;
+        }
+
+      pthread_mutex_lock (&ctx->dev_power->lock);
+      ctx->power_policy  = power_policy;
+      ctx->power_idle_ms = idle_ms;
+      pthread_mutex_unlock (&ctx->dev_power->lock);
+      return USEC_DEV_OK;
+    }
+
+  usec_power_stop (ctx);
+
+  /* rails may still be on from the previous policy */
+  if (power_policy == POWER_POLICY_OFF && ctx->power_on)
+    {
+      status = it8951_cmd_get_set_pmic (ctx, 0, 2, NULL, 0, 1, 0);
+      if (status == USEC_DEV_OK)
+        ctx->power_on = 0;
+    }
+
+  ctx->power_policy  = power_policy;
+  ctx->power_idle_ms = idle_ms;
+  return status;
+}
+
+/*
+ * usec_set_power_policy()
+ */
+uint8_t
+usec_set_power_policy (usec_ctx  *ctx,
+                       uint8_t    power_policy,
+                       uint32_t   idle_ms)
+{
+  uint8_t status;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_set_power_policy_locked (ctx, power_policy, idle_ms);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return status;
+}
+
+/*
+ * usec_get_stats()
+ */
+uint8_t
+usec_get_stats (usec_ctx    *ctx,
+                usec_stats  *stats)
+{
+  if (ctx == NULL || stats == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  stats->heap_allocs = __atomic_load_n (&ctx->stats.heap_allocs,
+                                        __ATOMIC_RELAXED);
+  stats->cmd_count   = __atomic_load_n (&ctx->stats.cmd_count,
+                                        __ATOMIC_RELAXED);
+  stats->xfer_bytes  = __atomic_load_n (&ctx->stats.xfer_bytes,
+                                        __ATOMIC_RELAXED);
+  stats->dio_xfers   = __atomic_load_n (&ctx->stats.dio_xfers,
+                                        __ATOMIC_RELAXED);
+  stats->dio_fallbacks = __atomic_load_n (&ctx->stats.dio_fallbacks,
+                                          __ATOMIC_RELAXED);
+
+  stats->dirty_rects = __atomic_load_n (&ctx->stats.dirty_rects,
+                                       __ATOMIC_RELAXED);
+  stats->skipped_uploads = __atomic_load_n (&ctx->stats.skipped_uploads,
+                                           __ATOMIC_RELAXED);
+  stats->merged_rects = __atomic_load_n (&ctx->stats.merged_rects,
+                                        __ATOMIC_RELAXED);
+
+  stats->ready_polls = __atomic_load_n (&ctx->stats.ready_polls,
+                                        __ATOMIC_RELAXED);
+  stats->power_offs = __atomic_load_n (&ctx->stats.power_offs,
+                                       __ATOMIC_RELAXED);
+  stats->ghost_refreshes = __atomic_load_n (&ctx->stats.ghost_refreshes,
+                                           __ATOMIC_RELAXED);
+  for (uint8_t i = 0; i < 4; i++)
+    {
+      usec_lock (ctx, 1 << i);
+      stats->ghost_level[i] = usec_ghost_level (ctx, i);
+      usec_unlock (ctx, 1 << i);
+    }
+
+  stats->buf_flips = __atomic_load_n (&ctx->stats.buf_flips, __ATOMIC_RELAXED);
+  stats->dpy_skew_ns = __atomic_load_n (&ctx->stats.dpy_skew_ns,
+                                        __ATOMIC_RELAXED);
+  stats->dpy_skew_max_ns = __atomic_load_n (&ctx->stats.dpy_skew_max_ns,
+                                            __ATOMIC_RELAXED);
+  stats->frame_hits = __atomic_load_n (&ctx->stats.frame_hits,
+                                       __ATOMIC_RELAXED);
+  stats->frame_misses = __atomic_load_n (&ctx->stats.frame_misses,
+                                         __ATOMIC_RELAXED);
+  stats->buf_waits = __atomic_load_n (&ctx->stats.buf_waits, __ATOMIC_RELAXED);
+
+  stats->submit_frames = __atomic_load_n (&ctx->stats.submit_frames,
+                                          __ATOMIC_RELAXED);
+  stats->submit_drops = __atomic_load_n (&ctx->stats.submit_drops,
+                                         __ATOMIC_RELAXED);
+  stats->submit_errors = __atomic_load_n (&ctx->stats.submit_errors,
+                                          __ATOMIC_RELAXED);
+  stats->submit_latency_ns = __atomic_load_n (&ctx->stats.submit_latency_ns,
+                                              __ATOMIC_RELAXED);
+  stats->submit_latency_max_ns =
+    __atomic_load_n (&ctx->stats.submit_latency_max_ns, __ATOMIC_RELAXED);
+
+  for (uint8_t i = 0; i < UPDATE_MODE_AUTO; i++)
+    stats->auto_mode[i] = __atomic_load_n (&ctx->stats.auto_mode[i],
+                                           __ATOMIC_RELAXED);
+
+  for (uint8_t i = 0; i < XFER_STRATEGY_NUM; i++)
+    stats->xfer_strategy[i] = __atomic_load_n (&ctx->stats.xfer_strategy[i],
+                                               __ATOMIC_RELAXED);
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_set_mmap_mode_locked()
+ */
+static uint8_t
+usec_set_mmap_mode_locked (usec_ctx  *ctx,
+                           uint8_t    enable)
+{
+  if (!enable)
+    {
+      usec_mmap_free (ctx);
+      return USEC_DEV_OK;
+    }
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      struct usec_arena *arena = ctx->dev_arena[cnt];
+      uint32_t length;
+
+      if (arena->mmap_buf != NULL)
+        continue;
+
+      /* rendered chunks are sent with LD_IMG_AREA, header included */
+      length = ctx->dev_xfer_len[cnt];
+
+      arena->mmap_buf = ctx->dev_ops->map (ctx, cnt, length);
+      if (arena->mmap_buf == NULL)
+        {
+          usec_dev_log ("[usec] error: cannot map reserved buffer\n\r");
+
+          usec_mmap_free (ctx);
+          return USEC_DEV_ERR;
+        }
+      arena->mmap_len = length;
+    }
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_set_mmap_mode()
+ */
+uint8_t
+usec_set_mmap_mode (usec_ctx  *ctx,
+                    uint8_t    enable)
+{
+  uint8_t status;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_set_mmap_mode_locked (ctx, enable);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return status;
+}
+
+/*
+ * usec_ready_poll() - refresh 'busy' state of one controller
+ */
+static uint8_t
+usec_ready_poll (usec_ctx  *ctx,
+                 uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t lut;
+
+  if (!arena->busy)
+    return USEC_DEV_OK;
+
+  __atomic_add_fetch (&ctx->stats.ready_polls, 1, __ATOMIC_RELAXED);
+  if (it8951_cmd_read_reg (ctx, id, IT8951_REG_LUTAFSR, &lut) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  if (lut != 0)
+    {
+      arena->poll_ns = now_ns ();
+      return USEC_DEV_OK;
+    }
+
+  /* learn how long single mode updates take, engines stopped somewhere
+     between the last two polls */
+  if (arena->busy_mode < UPDATE_MODE_AUTO)
+    {
+      uint64_t *ready = &arena->ready_ns[arena->busy_mode];
+      uint64_t took = (arena->poll_ns + now_ns ()) / 2 - arena->dpy_ns;
+
+      *ready = (*ready == 0) ? took : (*ready * 3 + took) / 4;
+    }
+
+  arena->busy = 0;
+  arena->buf_inuse = 0;
+  arena->frame_inuse = 0;
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_ready_wait() - poll one controller with backoff until display engine
+ * is idle
+ */
+static uint8_t
+usec_ready_wait (usec_ctx  *ctx,
+                 uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint64_t delay = USEC_DEV_POLL_MIN_US * 1000ULL;
+  uint64_t deadline = now_ns () + USEC_DEV_BUF_WAIT_MS * 1000000ULL;
+
+  while (arena->busy)
+    {
+      if (usec_ready_poll (ctx, id) != USEC_DEV_OK || now_ns () > deadline)
+        return USEC_DEV_ERR;
+
+      if (arena->busy)
+        {
+          sleep_ns (delay);
+          if (delay < USEC_DEV_POLL_MAX_US * 1000ULL)
+            delay *= 2;
+        }
+    }
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_buf_prepare() - back buffer may still be read by a waveform started
+ * before the last flip, wait for the engine then
+ */
+static uint8_t
+usec_buf_prepare (usec_ctx  *ctx,
+                  uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+
+  if (ctx->img_buffers < 2 || !(arena->buf_inuse & (1 << arena->buf_back)))
+    return USEC_DEV_OK;
+
+  __atomic_add_fetch (&ctx->stats.buf_waits, 1, __ATOMIC_RELAXED);
+
+  return usec_ready_wait (ctx, id);
+}
+
+/*
+ * usec_buf_damage() - back buffer got new content in 'tiles' (NULL - whole
+ * frame), other buffers fall behind there; 'whole' tiles were written in full
+ * and back buffer is up to date within them
+ */
+static void
+usec_buf_damage (usec_ctx       *ctx,
+                 uint8_t         id,
+                 const uint8_t  *tiles,
+                 uint8_t         whole)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t count = arena->tiles_x * arena->tiles_y;
+
+  if (ctx->img_buffers < 2)
+    return;
+
+  arena->buf_fresh = 1;
+  for (uint8_t b = 0; b < ctx->img_buffers; b++)
+    {
+      if (tiles == NULL)
+        {
+          memset (arena->tile_stale[b], b != arena->buf_back, count);
+          continue;
+        }
+
+      if (b != arena->buf_back)
+        for (uint32_t t = 0; t < count; t++)
+          arena->tile_stale[b][t] |= tiles[t];
+      else if (whole)
+        for (uint32_t t = 0; t < count; t++)
+          arena->tile_stale[b][t] &= !tiles[t];
+    }
+}
+
+/*
+ * usec_buf_reset() - back to single image buffer
+ */
+static void
+usec_buf_reset (usec_ctx  *ctx,
+                uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+
+  for (uint8_t b = 0; b < USEC_DEV_MAX_IMG_BUF; b++)
+    {
+      free (arena->tile_stale[b]);
+      arena->tile_stale[b] = NULL;
+    }
+
+  arena->buf_front  = 0;
+  arena->buf_back   = 0;
+  arena->buf_fresh  = 0;
+  arena->buf_inuse  = 0;
+  arena->front_addr = arena->buf_base;
+  ctx->dev_addr[id] = arena->buf_base;
+}
+
+/*
+ * usec_frame_leave() - live image buffers are shown again, whole panel waits
+ * for update as it still shows the cached frame
+ */
+static void
+usec_frame_leave (usec_ctx  *ctx,
+                  uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+
+  if (!arena->frame_shown)
+    return;
+
+  arena->front_addr  = arena->buf_base + arena->buf_front *
+                       ctx->dev_width[id] * ctx->dev_height[id];
+  arena->frame_shown = 0;
+
+  if (arena->tile_pending != NULL)
+    memset (arena->tile_pending, 1, arena->tiles_x * arena->tiles_y);
+}
+
+/*
+ * usec_frame_reset() - drop all cached frames; cache takes image buffers
+ * left over by the live ones
+ */
+static void
+usec_frame_reset (usec_ctx  *ctx,
+                  uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t count = 0;
+
+  usec_frame_leave (ctx, id);
+
+  if (ctx->frame_cache && ctx->dev_img_bufs[id] > ctx->img_buffers)
+    count = ctx->dev_img_bufs[id] - ctx->img_buffers;
+
+  memset (arena->frames, 0, sizeof(arena->frames));
+  arena->frame_count = (count < USEC_DEV_MAX_FRAMES) ? count :
+                       USEC_DEV_MAX_FRAMES;
+  arena->frame_inuse = 0;
+  arena->frame_clock = 0;
+}
+
+/*
+ * usec_shadow_free()
+ */
+static void
+usec_shadow_free (struct usec_arena *arena)
+{
+  free (arena->shadow);
+  free (arena->tile_dirty);
+  free (arena->tile_pending);
+  free (arena->rects);
+  free (arena->rect_ns);
+  free (arena->rect_gain);
+  free (arena->panel);
+  free (arena->tile_mode);
+  free (arena->tile_mask);
+  free (arena->tile_ghost);
+
+  arena->shadow       = NULL;
+  arena->tile_dirty   = NULL;
+  arena->tile_pending = NULL;
+  arena->rects        = NULL;
+  arena->rect_ns      = NULL;
+  arena->rect_gain    = NULL;
+  arena->panel        = NULL;
+  arena->tile_mode    = NULL;
+  arena->tile_mask    = NULL;
+  arena->tile_ghost   = NULL;
+  arena->shadow_valid = 0;
+  arena->panel_valid  = 0;
+}
+
+/*
+ * usec_shadow_invalidate() - controller image buffer content is not known
+ * any more, next upload is sent in full and whole panel waits for update
+ */
+static void
+usec_shadow_invalidate (usec_ctx  *ctx,
+                        uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+
+  if (arena->shadow == NULL)
+    return;
+
+  arena->shadow_valid = 0;
+  memset (arena->tile_pending, 1, arena->tiles_x * arena->tiles_y);
+}
+
+/*
+ * usec_shadow_rects() - turn tile map into rectangles; runs of tiles in a row
+ * are joined, then grown downwards while next row has the same run
+ */
+static uint32_t
+usec_shadow_rects (usec_ctx       *ctx,
+                   uint8_t         id,
+                   const uint8_t  *tiles)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  struct usec_rect *rects = arena->rects;
+  uint32_t count = 0, open = 0;
+
+  for (uint32_t ty = 0; ty < arena->tiles_y; ty++)
+    {
+      const uint8_t *line = tiles + ty * arena->tiles_x;
+      uint32_t first = count;
+
+      for (uint32_t tx = 0; tx < arena->tiles_x; )
+        {
+          uint32_t start, i;
+
+          if (!line[tx])
+            {
+              tx++;
+              continue;
+            }
+
+          for (start = tx; tx < arena->tiles_x && line[tx]; tx++)
+            ;
+
+          /* rectangles ending at the previous row are [open, first) */
+          for (i = open; i < first; i++)
+            if (rects[i].x == start && rects[i].w == tx - start &&
+                rects[i].y + rects[i].h == ty)
+              break;
+
+          if (i < first)
+            {
+              rects[i].h++;
+            }
+          else
+            {
+              rects[count].x = start;
+              rects[count].y = ty;
+              rects[count].w = tx - start;
+              rects[count].h = 1;
+              count++;
+            }
+        }
+
+      /* keep only rectangles still growing at the front of the list */
+      for (uint32_t i = open; i < first; i++)
+        {
+          if (rects[i].y + rects[i].h != ty + 1)
+            {
+              struct usec_rect done = rects[i];
+
+              memmove (&rects[open + 1], &rects[open],
+                       (i - open) * sizeof(*rects));
+              rects[open++] = done;
+            }
+        }
+    }
+
+  /* tiles to pixels, last row/column of tiles may be cut */
+  for (uint32_t i = 0; i < count; i++)
+    {
+      struct usec_rect *r = &rects[i];
+
+      r->x *= USEC_DEV_TILE;
+      r->y *= USEC_DEV_TILE;
+      r->w *= USEC_DEV_TILE;
+      r->h *= USEC_DEV_TILE;
+
+      if (r->x + r->w > ctx->dev_width[id])
+        r->w = ctx->dev_width[id] - r->x;
+      if (r->y + r->h > ctx->dev_height[id])
+        r->h = ctx->dev_height[id] - r->y;
+    }
+
+  return count;
+}
+
+/*
+ * usec_rect_cost() - estimated time of sending rectangle in its own command
+ * sequence, rows of the shadow are 'width' bytes apart
+ */
+static double
+usec_rect_cost (usec_ctx                *ctx,
+                uint8_t                  id,
+                const struct usec_rect  *rect)
+{
+  double ns;
+
+  usec_xfer_plan (ctx, id, rect->w, rect->h, ctx->dev_width[id], 0, &ns);
+
+  return ns;
+}
+
+/*
+ * usec_rect_union()
+ */
+static struct usec_rect
+usec_rect_union (const struct usec_rect  *a,
+                 const struct usec_rect  *b)
+{
+  struct usec_rect r;
+  uint32_t x1, y1;
+
+  r.x = (a->x < b->x) ? a->x : b->x;
+  r.y = (a->y < b->y) ? a->y : b->y;
+  x1  = (a->x + a->w > b->x + b->w) ? a->x + a->w : b->x + b->w;
+  y1  = (a->y + a->h > b->y + b->h) ? a->y + a->h : b->y + b->h;
+  r.w = x1 - r.x;
+  r.h = y1 - r.y;
+
+  return r;
+}
+
+/*
+ * usec_rect_inside() - is 'a' fully covered by 'b'
+ */
+static uint8_t
+usec_rect_inside (const struct usec_rect  *a,
+                  const struct usec_rect  *b)
+{
+  return a->x >= b->x && a->y >= b->y &&
+         a->x + a->w <= b->x + b->w && a->y + a->h <= b->y + b->h;
+}
+
+/*
+ * usec_rect_allowed() - rectangle planned for 'mode' must not cover tiles
+ * planned for other modes ('tile_mode' NULL allows everything)
+ */
+static uint8_t
+usec_rect_allowed (usec_ctx                *ctx,
+                   uint8_t                  id,
+                   const struct usec_rect  *rect,
+                   const uint8_t           *tile_mode,
+                   uint8_t                  mode)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+
+  if (tile_mode == NULL)
+    return 1;
+
+  for (uint32_t ty = rect->y / USEC_DEV_TILE;
+       ty <= (rect->y + rect->h - 1) / USEC_DEV_TILE; ty++)
+    for (uint32_t tx = rect->x / USEC_DEV_TILE;
+         tx <= (rect->x + rect->w - 1) / USEC_DEV_TILE; tx++)
+      {
+        uint8_t m = tile_mode[ty * arena->tiles_x + tx];
+
+        if (m != mode && m != USEC_TILE_IDLE)
+          return 0;
+      }
+
+  return 1;
+}
+
+/*
+ * usec_rect_join() - replace rects[i] with 'rect', drop every rectangle it
+ * covers, returns new count
+ */
+static uint32_t
+usec_rect_join (struct usec_rect  *rects,
+                double            *cost,
+                uint32_t           count,
+                uint32_t           i,
+                struct usec_rect   rect,
+                double             rect_ns)
+{
+  uint32_t n = 0;
+
+  rects[i] = rect;
+  cost[i]  = rect_ns;
+
+  for (uint32_t k = 0; k < count; k++)
+    {
+      if (k != i && usec_rect_inside (&rects[k], &rect))
+        continue;
+
+      rects[n] = rects[k];
+      cost[n]  = cost[k];
+      n++;
+    }
+
+  return n;
+}
+
+/*
+ * usec_rect_gain() - time saved by sending rects[i] and rects[i + 1] as their
+ * bounding box, 0 when it is not allowed
+ */
+static double
+usec_rect_gain (usec_ctx                *ctx,
+                uint8_t                  id,
+                const struct usec_rect  *rects,
+                const double            *cost,
+                uint32_t                 i,
+                const uint8_t           *tile_mode,
+                uint8_t                  mode)
+{
+  struct usec_rect r = usec_rect_union (&rects[i], &rects[i + 1]);
+  double gain = cost[i] + cost[i + 1] - usec_rect_cost (ctx, id, &r);
+
+  if (gain <= 0.0 || !usec_rect_allowed (ctx, id, &r, tile_mode, mode))
+    return 0.0;
+
+  return gain;
+}
+
+/*
+ * usec_rect_merge() - coalesce rectangles while one command sequence for
+ * the bounding box is estimated cheaper than two for the parts (extra bytes
+ * against per-command overhead), returns new count; merged set never costs
+ * more than the one passed in
+ *
+ * Long lists are first cut down by joining the neighbours (in list order,
+ * they come out of usec_shadow_rects() sorted by rows) which save the most,
+ * then best pair over all rectangles is merged until no merge pays off.
+ * With 'tile_mode' merged rectangles stay within tiles planned for 'mode'
+ * (see usec_mode_plan()).
+ */
+static uint32_t
+usec_rect_merge (usec_ctx          *ctx,
+                 uint8_t            id,
+                 struct usec_rect  *rects,
+                 uint32_t           count,
+                 const uint8_t     *tile_mode,
+                 uint8_t            mode)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  double *cost = arena->rect_ns;
+  double *gain = arena->rect_gain;
+  uint32_t total = count;
+
+  for (uint32_t i = 0; i < count; i++)
+    cost[i] = usec_rect_cost (ctx, id, &rects[i]);
+
+  if (count > USEC_DEV_MERGE_MAX)
+    for (uint32_t i = 0; i + 1 < count; i++)
+      gain[i] = usec_rect_gain (ctx, id, rects, cost, i, tile_mode, mode);
+
+  while (count > USEC_DEV_MERGE_MAX)
+    {
+      uint32_t best = count;
+
+      for (uint32_t i = 0; i + 1 < count; i++)
+        if (gain[i] > 0.0 && (best == count || gain[i] > gain[best]))
+          best = i;
+
+      /* no join pays off, too many rectangles to plan - send as is */
+      if (best == count)
+        goto merge_done;
+
+      rects[best] = usec_rect_union (&rects[best], &rects[best + 1]);
+      cost[best]  = cost[best] + cost[best + 1] - gain[best];
+      memmove (&rects[best + 1], &rects[best + 2],
+               (count - best - 2) * sizeof(*rects));
+      memmove (&cost[best + 1], &cost[best + 2],
+               (count - best - 2) * sizeof(*cost));
+      memmove (&gain[best + 1], &gain[best + 2],
+               (count - best - 2) * sizeof(*gain));
+      count--;
+
+      /* only pairs with the joined rectangle changed */
+      if (best > 0)
+        gain[best - 1] = usec_rect_gain (ctx, id, rects, cost, best - 1,
+                                         tile_mode, mode);
+      if (best + 1 < count)
+        gain[best] = usec_rect_gain (ctx, id, rects, cost, best, tile_mode,
+                                     mode);
+    }
+
+  while (count > 1)
+    {
+      struct usec_rect best_rect = rects[0];
+      uint32_t best_i = 0;
+      double best_gain = 0.0, best_ns = 0.0;
+
+      for (uint32_t i = 0; i < count; i++)
+        {
+          for (uint32_t k = i + 1; k < count; k++)
+            {
+              struct usec_rect r = usec_rect_union (&rects[i], &rects[k]);
+              double ns = usec_rect_cost (ctx, id, &r);
+              double save = cost[i] + cost[k] - ns;
+
+              if (save > best_gain &&
+                  usec_rect_allowed (ctx, id, &r, tile_mode, mode))
+                {
+                  best_rect = r;
+                  best_i    = i;
+                  best_gain = save;
+                  best_ns   = ns;
+                }
+            }
+        }
+
+      if (best_gain <= 0.0)
+        break;
+
+      count = usec_rect_join (rects, cost, count, best_i, best_rect, best_ns);
+    }
+
+merge_done:
+  __atomic_add_fetch (&ctx->stats.merged_rects, total - count,
+                      __ATOMIC_RELAXED);
+
+  return count;
+}
+
+/*
+ * usec_buf_flip() - bring back buffer up to date from the shadow and show it
+ * from now on, next buffer becomes the back one
+ */
+static uint8_t
+usec_buf_flip (usec_ctx  *ctx,
+               uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t width = ctx->dev_width[id];
+  uint8_t status = USEC_DEV_OK;
+  uint32_t count;
+
+  if (ctx->img_buffers < 2 || !arena->buf_fresh)
+    return USEC_DEV_OK;
+
+  /* without shadow the back buffer cannot be completed, show it as it is
+     and keep writing into it */
+  if (!arena->shadow_valid)
+    {
+      arena->buf_format[arena->buf_back] = ctx->dev_format[id];
+      arena->front_addr = ctx->dev_addr[id];
+      arena->buf_front  = arena->buf_back;
+      arena->buf_fresh  = 0;
+      return USEC_DEV_OK;
+    }
+
+  count = usec_shadow_rects (ctx, id, arena->tile_stale[arena->buf_back]);
+  count = usec_rect_merge (ctx, id, arena->rects, count, NULL, 0);
+  for (uint32_t i = 0; i < count && status == USEC_DEV_OK; i++)
+    {
+      struct usec_rect *r = &arena->rects[i];
+
+      status = it8951_cmd_load_img (ctx, id, arena->shadow + r->y * width +
+                                    r->x, r->x, r->y, r->w, r->h, width);
+    }
+  if (status != USEC_DEV_OK)
+    return status;
+
+  memset (arena->tile_stale[arena->buf_back], 0,
+          arena->tiles_x * arena->tiles_y);
+
+  arena->buf_format[arena->buf_back] = ctx->dev_format[id];
+  arena->buf_front  = arena->buf_back;
+  arena->buf_back   = (arena->buf_back + 1) % ctx->img_buffers;
+  arena->front_addr = ctx->dev_addr[id];
+  arena->buf_fresh  = 0;
+
+  ctx->dev_addr[id] = arena->buf_base + arena->buf_back * width *
+                      ctx->dev_height[id];
+
+  __atomic_add_fetch (&ctx->stats.buf_flips, 1, __ATOMIC_RELAXED);
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_buf_flip_all()
+ */
+static uint8_t
+usec_buf_flip_all (usec_ctx *ctx)
+{
+  uint8_t status = USEC_DEV_OK;
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    status |= usec_buf_flip (ctx, cnt);
+
+  if (status != USEC_DEV_OK)
+    usec_dev_log ("[usec] error: cannot update back buffer\n\r");
+
+  return status;
+}
+
+/*
+ * usec_shadow_upload() - send only tiles which differ from the last upload
+ */
+static uint8_t
+usec_shadow_upload (usec_ctx  *ctx,
+                    uint8_t    id,
+                    uint8_t   *src_img)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t width  = ctx->dev_width[id];
+  uint32_t height = ctx->dev_height[id];
+  uint32_t tiles  = arena->tiles_x * arena->tiles_y;
+  uint8_t status = USEC_DEV_OK;
+  uint32_t count;
+
+  if (arena->shadow_valid)
+    {
+      memset (arena->tile_dirty, 0, tiles);
+      for (uint32_t row = 0; row < height; row++)
+        usec_kern.diff (arena->shadow + row * width, src_img + row * width,
+                        width, arena->tile_dirty +
+                        (row / USEC_DEV_TILE) * arena->tiles_x);
+    }
+  else
+    {
+      memset (arena->tile_dirty, 1, tiles);
+    }
+
+  count = usec_shadow_rects (ctx, id, arena->tile_dirty);
+  count = usec_rect_merge (ctx, id, arena->rects, count, NULL, 0);
+  if (count == 0)
+    {
+      __atomic_add_fetch (&ctx->stats.skipped_uploads, 1, __ATOMIC_RELAXED);
+      return USEC_DEV_OK;
+    }
+
+  for (uint32_t i = 0; i < count && status == USEC_DEV_OK; i++)
+    {
+      struct usec_rect *r = &arena->rects[i];
+
+      status = it8951_cmd_load_img (ctx, id, src_img + r->y * width + r->x,
+                                    r->x, r->y, r->w, r->h, width);
+    }
+
+  __atomic_add_fetch (&ctx->stats.dirty_rects, count, __ATOMIC_RELAXED);
+
+  if (status != USEC_DEV_OK)
+    {
+      usec_shadow_invalidate (ctx, id);
+      return status;
+    }
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+      struct usec_rect *r = &arena->rects[i];
+
+      for (uint32_t row = r->y; row < r->y + r->h; row++)
+        memcpy (arena->shadow + row * width + r->x,
+                src_img + row * width + r->x, r->w);
+    }
+
+  for (uint32_t i = 0; i < tiles; i++)
+    arena->tile_pending[i] |= arena->tile_dirty[i];
+
+  arena->shadow_valid = 1;
+  usec_buf_damage (ctx, id, arena->tile_dirty, 1);
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_shadow_area() - keep shadow in sync with directly uploaded area
+ */
+static void
+usec_shadow_area (usec_ctx              *ctx,
+                  uint8_t                id,
+                  struct usec_area_arg  *area)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t width = ctx->dev_width[id];
+
+  if (arena->shadow == NULL)
+    return;
+
+  if (arena->shadow_valid)
+    for (uint32_t row = 0; row < area->height; row++)
+      memcpy (arena->shadow + (area->pos_y + row) * width + area->pos_x,
+              area->img_data + row * area->stride, area->width);
+
+  memset (arena->tile_dirty, 0, arena->tiles_x * arena->tiles_y);
+  for (uint32_t ty = area->pos_y / USEC_DEV_TILE;
+       ty <= (area->pos_y + area->height - 1) / USEC_DEV_TILE; ty++)
+    for (uint32_t tx = area->pos_x / USEC_DEV_TILE;
+         tx <= (area->pos_x + area->width - 1) / USEC_DEV_TILE; tx++)
+      {
+        arena->tile_pending[ty * arena->tiles_x + tx] = 1;
+        arena->tile_dirty[ty * arena->tiles_x + tx]   = 1;
+      }
+
+  usec_buf_damage (ctx, id, arena->tile_dirty, 0);
+}
+
+/*
+ * usec_set_shadow_locked()
+ */
+static uint8_t
+usec_set_shadow_locked (usec_ctx  *ctx,
+                        uint8_t    enable)
+{
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      struct usec_arena *arena = ctx->dev_arena[cnt];
+      uint32_t tiles;
+
+      if (!enable)
+        {
+          usec_frame_leave (ctx, cnt);
+          usec_buf_reset (ctx, cnt);
+          usec_shadow_free (arena);
+          ctx->img_buffers = 1;
+          usec_frame_reset (ctx, cnt);
+          continue;
+        }
+
+      if (arena->shadow != NULL)
+        continue;
+
+      arena->tiles_x = (ctx->dev_width[cnt] + USEC_DEV_TILE - 1) /
+                       USEC_DEV_TILE;
+      arena->tiles_y = (ctx->dev_height[cnt] + USEC_DEV_TILE - 1) /
+                       USEC_DEV_TILE;
+      tiles = arena->tiles_x * arena->tiles_y;
+
+      arena->shadow = usec_dev_alloc (ctx, ctx->dev_width[cnt] *
+                                           ctx->dev_height[cnt]);
+      arena->tile_dirty   = usec_dev_alloc (ctx, tiles);
+      arena->tile_pending = usec_dev_alloc (ctx, tiles);
+      arena->rects = usec_dev_alloc (ctx, tiles * sizeof(struct usec_rect));
+      arena->rect_ns   = usec_dev_alloc (ctx, tiles * sizeof(double));
+      arena->rect_gain = usec_dev_alloc (ctx, tiles * sizeof(double));
+      arena->panel = usec_dev_alloc (ctx, ctx->dev_width[cnt] *
+                                          ctx->dev_height[cnt]);
+      arena->tile_mode = usec_dev_alloc (ctx, tiles);
+      arena->tile_mask = usec_dev_alloc (ctx, tiles);
+      arena->tile_ghost = usec_dev_alloc (ctx, tiles * sizeof(uint16_t));
+      if (arena->shadow == NULL || arena->tile_dirty == NULL ||
+          arena->tile_pending == NULL || arena->rects == NULL ||
+          arena->rect_ns == NULL || arena->rect_gain == NULL ||
+          arena->panel == NULL || arena->tile_mode == NULL ||
+          arena->tile_mask == NULL || arena->tile_ghost == NULL)
+        {
+          usec_dev_log ("[usec] error: cannot allocate shadow buffer\n\r");
+
+          for (uint8_t i = 0; i <= cnt; i++)
+            usec_shadow_free (ctx->dev_arena[i]);
+          return USEC_DEV_ERR;
+        }
+
+      /* image buffer content is unknown until the first full upload, panel
+         until the first full update */
+      usec_shadow_invalidate (ctx, cnt);
+      arena->panel_valid = 0;
+
+      /* tiles inherit what controller collected so far */
+      for (uint32_t t = 0; t < tiles; t++)
+        arena->tile_ghost[t] = (arena->ghost < UINT16_MAX) ? arena->ghost :
+                               UINT16_MAX;
+    }
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_set_shadow()
+ */
+uint8_t
+usec_set_shadow (usec_ctx  *ctx,
+                 uint8_t    enable)
+{
+  uint8_t status;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_set_shadow_locked (ctx, enable);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return status;
+}
+
+/*
+ * usec_set_img_buffers_locked()
+ */
+static uint8_t
+usec_set_img_buffers_locked (usec_ctx  *ctx,
+                             uint8_t    img_buffers)
+{
+  if (img_buffers == 0 || img_buffers > USEC_DEV_MAX_IMG_BUF)
+    {
+      usec_dev_log ("[usec] error: invalid number of image buffers\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  /* stale tiles are refilled from the shadow */
+  if (img_buffers > 1 && ctx->dev_arena[0]->shadow == NULL)
+    {
+      usec_dev_log ("[usec] error: image buffers require shadow\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    if (img_buffers > ctx->dev_img_bufs[cnt])
+      {
+        usec_dev_log ("[usec] error: controller has not enough image "
+                      "buffers\n\r");
+        return USEC_DEV_ERR;
+      }
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    if (usec_ready_wait (ctx, cnt) != USEC_DEV_OK)
+      {
+        usec_dev_log ("[usec] error: display engine busy - timeout\n\r");
+        return USEC_DEV_ERR;
+      }
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      struct usec_arena *arena = ctx->dev_arena[cnt];
+      uint32_t tiles = arena->tiles_x * arena->tiles_y;
+
+      usec_frame_leave (ctx, cnt);
+      usec_buf_reset (ctx, cnt);
+      if (img_buffers == 1)
+        {
+          /* buffer 0 is shown from now on, its content is unknown */
+          if (ctx->img_buffers > 1)
+            usec_shadow_invalidate (ctx, cnt);
+          continue;
+        }
+
+      for (uint8_t b = 0; b < img_buffers; b++)
+        {
+          arena->tile_stale[b] = usec_dev_alloc (ctx, tiles);
+          if (arena->tile_stale[b] == NULL)
+            {
+              usec_dev_log ("[usec] error: cannot allocate image buffers\n\r");
+
+              ctx->img_buffers = 1;
+              for (uint8_t i = 0; i < 4; i++)
+                {
+                  usec_buf_reset (ctx, i);
+                  usec_frame_reset (ctx, i);
+                }
+              return USEC_DEV_ERR;
+            }
+
+          /* only front buffer holds what shadow describes */
+          memset (arena->tile_stale[b], b != 0, tiles);
+        }
+
+      arena->buf_back    = 1;
+      arena->buf_format[0] = ctx->dev_format[cnt];
+      ctx->dev_addr[cnt] = arena->buf_base + ctx->dev_width[cnt] *
+                           ctx->dev_height[cnt];
+    }
+
+  ctx->img_buffers = img_buffers;
+
+  /* cached frames live right after the live buffers */
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    usec_frame_reset (ctx, cnt);
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_set_img_buffers() - uploads go to a back buffer while the panel is
+ * refreshed from the front one, buffers swap on every update
+ */
+uint8_t
+usec_set_img_buffers (usec_ctx  *ctx,
+                      uint8_t    img_buffers)
+{
+  uint8_t status;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_set_img_buffers_locked (ctx, img_buffers);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return status;
+}
+
+/*
+ * usec_buf_alloc_locked()
+ */
+static uint8_t *
+usec_buf_alloc_locked (usec_ctx  *ctx,
+                       size_t     size,
+                       uint8_t    lock)
+{
+  struct usec_dio_buf *dio = NULL;
+  size_t page, len;
+  void *buf;
+
+  if (ctx == NULL || size == 0)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return NULL;
+    }
+
+  for (uint8_t i = 0; i < USEC_DEV_MAX_DIO_BUFS && dio == NULL; i++)
+    if (ctx->dev_dio[i].buf == NULL)
+      dio = &ctx->dev_dio[i];
+
+  if (dio == NULL)
+    {
+      usec_dev_log ("[usec] error: too many frame buffers\n\r");
+      return NULL;
+    }
+
+  page = (size_t) sysconf (_SC_PAGESIZE);
+  len  = (size + page - 1) & ~(page - 1);
+
+  if (posix_memalign (&buf, page, len) != 0)
+    {
+      usec_dev_log ("[usec] error: cannot allocate frame buffer\n\r");
+      return NULL;
+    }
+  __atomic_add_fetch (&ctx->stats.heap_allocs, 1, __ATOMIC_RELAXED);
+  memset (buf, 0, len);
+
+  dio->buf    = buf;
+  dio->len    = len;
+  dio->locked = 0;
+
+  if (lock)
+    {
+      if (mlock (buf, len) == 0)
+        dio->locked = 1;
+      else
+        usec_dev_log ("[usec] status: cannot lock frame buffer\n\r");
+    }
+
+  return buf;
+}
+
+/*
+ * usec_buf_alloc()
+ */
+uint8_t *
+usec_buf_alloc (usec_ctx  *ctx,
+                size_t     size,
+                uint8_t    lock)
+{
+  uint8_t *buf;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return NULL;
+    }
+
+  usec_lock (ctx, USEC_LOCK_ALL);
+  buf = usec_buf_alloc_locked (ctx, size, lock);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return buf;
+}
+
+/*
+ * usec_buf_free_locked()
+ */
+static void
+usec_buf_free_locked (usec_ctx  *ctx,
+                      uint8_t   *buf)
+{
+  if (ctx == NULL || buf == NULL)
+    return;
+
+  for (uint8_t i = 0; i < USEC_DEV_MAX_DIO_BUFS; i++)
+    {
+      struct usec_dio_buf *dio = &ctx->dev_dio[i];
+
+      if (dio->buf != buf)
+        continue;
+
+      if (dio->locked)
+        munlock (dio->buf, dio->len);
+
+      free (dio->buf);
+      memset (dio, 0, sizeof(*dio));
+      return;
+    }
+
+  usec_dev_log ("[usec] error: unknown frame buffer\n\r");
+}
+
+/*
+ * usec_buf_free()
+ */
+void
+usec_buf_free (usec_ctx  *ctx,
+               uint8_t   *buf)
+{
+  if (ctx == NULL)
+    return;
+
+  usec_lock (ctx, USEC_LOCK_ALL);
+  usec_buf_free_locked (ctx, buf);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+}
+
+/*
+ * usec_img_render_job()
+ */
+static uint8_t
+usec_img_render_job (usec_ctx  *ctx,
+                     uint8_t    id,
+                     void      *arg)
+{
+  void **render_arg = arg;
+  uint8_t status;
+
+  if (usec_buf_prepare (ctx, id) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  status = it8951_cmd_render_img (ctx, id, (usec_render_fn) render_arg[0],
+                                  render_arg[1]);
+  if (status == USEC_DEV_OK)
+    usec_buf_damage (ctx, id, NULL, 1);
+
+  return status;
+}
+
+/*
+ * usec_img_render_locked()
+ */
+static uint8_t
+usec_img_render_locked (usec_ctx        *ctx,
+                        usec_render_fn   render,
+                        void            *user_data)
+{
+  void *render_arg[2] = { (void*) render, user_data };
+  uint8_t status;
+
+  if (render == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid render callback\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      if (ctx->dev_arena[cnt]->mmap_buf == NULL)
+        {
+          usec_dev_log ("[usec] error: mmap mode is not enabled\n\r");
+          return USEC_DEV_ERR;
+        }
+    }
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    usec_shadow_invalidate (ctx, cnt);
+
+  if (ctx->upload_mode == UPLOAD_MODE_PARALLEL)
+    {
+      void *args[4] = { render_arg, render_arg, render_arg, render_arg };
+
+      status = usec_workers_run (ctx, usec_img_render_job, args);
+    }
+  else
+    {
+      status = USEC_DEV_OK;
+      for (uint8_t cnt = 0; cnt < 4; cnt++)
+        {
+          ctx->dev_status[cnt] = usec_img_render_job (ctx, cnt, render_arg);
+          status |= ctx->dev_status[cnt];
+        }
+    }
+
+  if (status == USEC_DEV_OK)
+    usec_dev_log ("[usec] status: rendering image - all parts\n\r");
+  else
+    usec_dev_log ("[usec] error: cannot upload rendered image data\n\r");
+
+  return status;
+}
+
+/*
+ * usec_img_render()
+ */
+uint8_t
+usec_img_render (usec_ctx        *ctx,
+                 usec_render_fn   render,
+                 void            *user_data)
+{
+  uint8_t status;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_img_render_locked (ctx, render, user_data);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return status;
+}
+
+/*
+ * usec_img_pack()
+ */
+uint8_t
+usec_img_pack (uint8_t        *dst,
+               const uint8_t  *src,
+               size_t          pixels,
+               uint8_t         img_format)
+{
+  if (dst == NULL || src == NULL || img_format >= IMG_8BPP ||
+      (pixels % 8) != 0)
+    {
+      usec_dev_log ("[usec] error: invalid pixel data\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  usec_kernels_init ()->pack[img_format] (dst, src, pixels);
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_img_unpack()
+ */
+uint8_t
+usec_img_unpack (uint8_t        *dst,
+                 const uint8_t  *src,
+                 size_t          pixels,
+                 uint8_t         img_format)
+{
+  if (dst == NULL || src == NULL || img_format >= IMG_8BPP ||
+      (pixels % 8) != 0)
+    {
+      usec_dev_log ("[usec] error: invalid pixel data\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  usec_kernels_init ()->unpack[img_format] (dst, src, pixels);
+
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_img_upload_job()
+ */
+static uint8_t
+usec_img_upload_job (usec_ctx  *ctx,
+                     uint8_t    id,
+                     void      *arg)
+{
+  struct usec_upload_arg *upload = arg;
+  uint8_t status;
+
+  if (usec_buf_prepare (ctx, id) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  /* shadow tracks 8bpp images only */
+  if (upload->img_format == IMG_8BPP && ctx->dev_arena[id]->shadow != NULL &&
+      ctx->dev_format[id] == IMG_8BPP)
+    return usec_shadow_upload (ctx, id, upload->img_data);
+
+  usec_shadow_invalidate (ctx, id);
+
+  status = it8951_cmd_load_img_fmt (ctx, id, upload->img_data,
+                                    upload->img_format);
+  if (status == USEC_DEV_OK)
+    usec_buf_damage (ctx, id, NULL, 1);
+
+  return status;
+}
+
+/*
+ * usec_img_upload()
+ */
+uint8_t
+usec_img_upload (usec_ctx  *ctx,
+                 uint8_t   *img_data,
+                 size_t     img_size)
+{
+  return usec_img_upload_fmt (ctx, img_data, img_size, IMG_8BPP);
+}
+
+/*
+ * usec_img_upload_fmt_locked()
+ */
+static uint8_t
+usec_img_upload_fmt_locked (usec_ctx  *ctx,
+                            uint8_t   *img_data,
+                            size_t     img_size,
+                            uint8_t    img_format)
+{
+  static const uint8_t img_bpp[] = { 1, 2, 4, 8 };
+  uint8_t status;
+
+  if (img_format > IMG_8BPP)
+    {
+      usec_dev_log ("[usec] error: invalid image format value\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  if (img_size != ((4*1440*640) * img_bpp[img_format] / 8))
+    {
+      usec_dev_log ("[usec] error: invalid image data size\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  if (ctx->upload_mode == UPLOAD_MODE_PARALLEL)
+    {
+      struct usec_upload_arg upload[4];
+      void *args[4];
+
+      /* each controller gets its own part of the frame */
+      for (uint8_t cnt = 0; cnt < 4; cnt++)
+        {
+          upload[cnt].img_data   = img_data;
+          upload[cnt].img_format = img_format;
+          args[cnt] = &upload[cnt];
+
+          img_data += ctx->dev_width[cnt]*ctx->dev_height[cnt] *
+                      img_bpp[img_format] / 8;
+        }
+
+      status = usec_workers_run (ctx, usec_img_upload_job, args);
+      if (status == USEC_DEV_OK)
+        usec_dev_log ("[usec] status: uploading image - all parts\n\r");
+      else
+        usec_dev_log ("[usec] error: cannot upload image data\n\r");
+
+      return status;
+    }
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      struct usec_upload_arg upload = { img_data, img_format };
+
+      status = usec_img_upload_job (ctx, cnt, &upload);
+      ctx->dev_status[cnt] = status;
+      if (status == USEC_DEV_OK)
+        {
+          img_data += ctx->dev_width[cnt]*ctx->dev_height[cnt] *
+                      img_bpp[img_format] / 8;
+
+          usec_dev_log ("[usec] status: uploading image - part %d\n\r", cnt);
+        }
+      else
+        {
+          usec_dev_log ("[usec] error: cannot upload image data\n\r");
+          return status;
+        }
+    }
+
+  return status;
+}
+
+/*
+ * usec_img_upload_fmt()
+ */
+uint8_t
+usec_img_upload_fmt (usec_ctx  *ctx,
+                     uint8_t   *img_data,
+                     size_t     img_size,
+                     uint8_t    img_format)
+{
+  uint8_t status;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_img_upload_fmt_locked (ctx, img_data, img_size, img_format);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return status;
+}
+
+/*
+ * usec_img_upload_area_job()
+ */
+static uint8_t
+usec_img_upload_area_job (usec_ctx  *ctx,
+                          uint8_t    id,
+                          void      *arg)
+{
+  struct usec_area_arg *area = arg;
+  uint8_t status;
+
+  if (area->height == 0)
+    return USEC_DEV_OK;
+
+  if (usec_buf_prepare (ctx, id) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  if (ctx->dev_format[id] != IMG_8BPP)
+    usec_shadow_invalidate (ctx, id);
+
+  status = it8951_cmd_load_img (ctx, id, area->img_data, area->pos_x,
+                                area->pos_y, area->width, area->height,
+                                area->stride);
+  if (status == USEC_DEV_OK)
+    {
+      ctx->dev_format[id] = IMG_8BPP;
+      usec_shadow_area (ctx, id, area);
+    }
+  else
+    {
+      usec_shadow_invalidate (ctx, id);
+    }
+
+  return status;
+}
+
+/*
+ * usec_img_upload_area() - controllers are stacked vertically on the global
+ * canvas, every one gets only the part of the area it covers
+ */
+uint8_t
+usec_img_upload_area (usec_ctx  *ctx,
+                      uint32_t   pos_x,
+                      uint32_t   pos_y,
+                      uint32_t   width,
+                      uint32_t   height,
+                      uint8_t   *img_data,
+                      uint32_t   stride)
+{
+  struct usec_area_arg area[4];
+  void *args[4] = { NULL, NULL, NULL, NULL };
+  uint32_t top = 0;
+  uint8_t mask = 0;
+  uint8_t status;
+
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  if (img_data == NULL || width == 0 || height == 0 || stride < width ||
+      pos_x + width > ctx->dev_width[0] ||
+      pos_y + height > ctx->dev_height[0] + ctx->dev_height[1] +
+                       ctx->dev_height[2] + ctx->dev_height[3])
+    {
+      usec_dev_log ("[usec] error: invalid image area\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      uint32_t y0, y1;
+
+      y0 = (pos_y > top) ? pos_y : top;
+      y1 = (pos_y + height < top + ctx->dev_height[cnt]) ?
+           (pos_y + height) : (top + ctx->dev_height[cnt]);
+
+      memset (&area[cnt], 0, sizeof(area[cnt]));
+      if (y0 < y1)
+        {
+          area[cnt].img_data = img_data + (size_t)(y0 - pos_y) * stride;
+          area[cnt].pos_x    = pos_x;
+          area[cnt].pos_y    = y0 - top;
+          area[cnt].width    = width;
+          area[cnt].height   = y1 - y0;
+          area[cnt].stride   = stride;
+
+          args[cnt] = &area[cnt];
+          mask |= 1 << cnt;
+        }
+
+      top += ctx->dev_height[cnt];
+    }
+
+  /* other controllers stay free for other threads */
+  usec_lock (ctx, mask);
+  if (ctx->upload_mode == UPLOAD_MODE_PARALLEL)
+    {
+      status = usec_workers_run (ctx, usec_img_upload_area_job, args);
+    }
+  else
+    {
+      status = USEC_DEV_OK;
+      for (uint8_t cnt = 0; cnt < 4 && status == USEC_DEV_OK; cnt++)
+        {
+          if (args[cnt] == NULL)
+            continue;
+
+          status = usec_img_upload_area_job (ctx, cnt, args[cnt]);
+          ctx->dev_status[cnt] = status;
+        }
+    }
+  usec_unlock (ctx, mask);
+
+  if (status == USEC_DEV_OK)
+    usec_dev_log ("[usec] status: uploading image area\n\r");
+  else
+    usec_dev_log ("[usec] error: cannot upload image data\n\r");
+
+  return status;
+}
+
+/*
+ * usec_mode_class() - fastest waveform able to show transitions counted in
+ * 'hist' of 'pixels' pixels, UPDATE_MODE_AUTO when nothing changed
+ */
+static uint8_t
+usec_mode_class (const struct usec_arena  *arena,
+                 struct usec_hist         *hist,
+                 uint64_t                  pixels)
+{
+  /* unknown panel content counts as gray */
+  if (!arena->panel_valid)
+    {
+      if (hist->changed == 0)
+        return UPDATE_MODE_GC16;
+      hist->src_gray = hist->changed;
+    }
+
+  if (hist->changed == 0)
+    return UPDATE_MODE_AUTO;
+
+  if (hist->dst_gray == 0)
+    return (hist->src_gray == 0) ? UPDATE_MODE_A2 : UPDATE_MODE_DU;
+
+  if (hist->dst_gray4 == 0)
+    return UPDATE_MODE_DU4;
+
+  /* mostly white page - anti-aliased text, sparse content */
+  if (hist->dst_white * 4 >= pixels * 3)
+    return UPDATE_MODE_GL16;
+
+  return UPDATE_MODE_GC16;
+}
+
+/*
+ * usec_mode_auto() - pick the fastest waveform able to show transitions
+ * from the panel mirror to the image buffer (shadow); UPDATE_MODE_AUTO is
+ * returned when the panel already shows the image
+ */
+static uint8_t
+usec_mode_auto (usec_ctx  *ctx,
+                uint8_t    id,
+                uint32_t   pos_x,
+                uint32_t   pos_y,
+                uint32_t   width,
+                uint32_t   height)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t stride = ctx->dev_width[id];
+  struct usec_hist hist;
+
+  /* 1bpp images are black and white only */
+  if (usec_front_format (ctx, id) == IMG_1BPP)
+    return UPDATE_MODE_DU;
+
+  if (arena->shadow == NULL || !arena->shadow_valid)
+    return UPDATE_MODE_GC16;
+
+  memset (&hist, 0, sizeof(hist));
+  for (uint32_t row = pos_y; row < pos_y + height; row++)
+    usec_kern.hist (arena->panel + row * stride + pos_x,
+                    arena->shadow + row * stride + pos_x, width, &hist);
+
+  return usec_mode_class (arena, &hist, (uint64_t) width * height);
+}
+
+/*
+ * usec_mode_plan() - classify every pending tile on its own, tiles without
+ * change get USEC_TILE_IDLE; returns non-zero when some tile needs update
+ */
+static uint8_t
+usec_mode_plan (usec_ctx  *ctx,
+                uint8_t    id)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t stride = ctx->dev_width[id];
+  uint32_t height = ctx->dev_height[id];
+  uint8_t busy = 0;
+
+  for (uint32_t ty = 0; ty < arena->tiles_y; ty++)
+    {
+      uint32_t y0 = ty * USEC_DEV_TILE;
+      uint32_t y1 = (y0 + USEC_DEV_TILE < height) ? y0 + USEC_DEV_TILE : height;
+
+      for (uint32_t tx = 0; tx < arena->tiles_x; tx++)
+        {
+          uint32_t t  = ty * arena->tiles_x + tx;
+          uint32_t x0 = tx * USEC_DEV_TILE;
+          uint32_t w  = (x0 + USEC_DEV_TILE < stride) ? USEC_DEV_TILE :
+                        stride - x0;
+          struct usec_hist hist;
+          uint8_t mode;
+
+          arena->tile_mode[t] = USEC_TILE_IDLE;
+          if (!arena->tile_pending[t])
+            continue;
+
+          memset (&hist, 0, sizeof(hist));
+          for (uint32_t row = y0; row < y1; row++)
+            usec_kern.hist (arena->panel + row * stride + x0,
+                            arena->shadow + row * stride + x0, w, &hist);
+
+          mode = usec_mode_class (arena, &hist, (uint64_t) w * (y1 - y0));
+          if (mode != UPDATE_MODE_AUTO)
+            {
+              arena->tile_mode[t] = mode;
+              busy = 1;
+            }
+        }
+    }
+
+  return busy;
+}
+
+/*
+ * usec_panel_sync() - panel mirror follows what the display area just showed
+ */
+static void
+usec_panel_sync (usec_ctx  *ctx,
+                 uint8_t    id,
+                 uint32_t   pos_x,
+                 uint32_t   pos_y,
+                 uint32_t   width,
+                 uint32_t   height,
+                 uint8_t    update_mode)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t stride = ctx->dev_width[id];
+  uint8_t full;
+
+  /* cached frame is shown, mirror got it at usec_frame_show() */
+  if (arena->panel == NULL || arena->frame_shown)
+    return;
+
+  full = (width == stride && height == ctx->dev_height[id]);
+
+  if (update_mode == UPDATE_MODE_INIT)
+    {
+      for (uint32_t row = pos_y; row < pos_y + height; row++)
+        memset (arena->panel + row * stride + pos_x, 0xFF, width);
+    }
+  else if (arena->shadow_valid && usec_front_format (ctx, id) == IMG_8BPP)
+    {
+      for (uint32_t row = pos_y; row < pos_y + height; row++)
+        memcpy (arena->panel + row * stride + pos_x,
+                arena->shadow + row * stride + pos_x, width);
+    }
+  else
+    {
+      arena->panel_valid = 0;
+      return;
+    }
+
+  if (full)
+    arena->panel_valid = 1;
+}
+
+/*
+ * usec_ghost_account() - fast modes leave ghosting behind, GC16 and INIT
+ * clean covered area; controller counter is reset by full area updates only
+ */
+static void
+usec_ghost_account (usec_ctx  *ctx,
+                    uint8_t    id,
+                    uint32_t   pos_x,
+                    uint32_t   pos_y,
+                    uint32_t   width,
+                    uint32_t   height,
+                    uint8_t    update_mode)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint8_t clean, fast;
+
+  clean = (update_mode == UPDATE_MODE_INIT || update_mode == UPDATE_MODE_GC16);
+  fast  = (update_mode == UPDATE_MODE_DU || update_mode == UPDATE_MODE_A2 ||
+           update_mode == UPDATE_MODE_DU4);
+
+  if (clean && width == ctx->dev_width[id] && height == ctx->dev_height[id])
+    arena->ghost = 0;
+  else if (fast && arena->ghost < UINT32_MAX)
+    arena->ghost++;
+
+  if (arena->tile_ghost == NULL || !(clean || fast))
+    return;
+
+  for (uint32_t ty = pos_y / USEC_DEV_TILE;
+       ty <= (pos_y + height - 1) / USEC_DEV_TILE; ty++)
+    for (uint32_t tx = pos_x / USEC_DEV_TILE;
+         tx <= (pos_x + width - 1) / USEC_DEV_TILE; tx++)
+      {
+        uint16_t *ghost = &arena->tile_ghost[ty * arena->tiles_x + tx];
+        uint32_t x0 = tx * USEC_DEV_TILE, y0 = ty * USEC_DEV_TILE;
+        uint32_t x1 = x0 + USEC_DEV_TILE, y1 = y0 + USEC_DEV_TILE;
+
+        if (fast)
+          {
+            if (*ghost < UINT16_MAX)
+              (*ghost)++;
+            continue;
+          }
+
+        /* edge tiles are cut by the panel border */
+        if (x1 > ctx->dev_width[id])
+          x1 = ctx->dev_width[id];
+        if (y1 > ctx->dev_height[id])
+          y1 = ctx->dev_height[id];
+
+        if (x0 >= pos_x && y0 >= pos_y &&
+            x1 <= pos_x + width && y1 <= pos_y + height)
+          *ghost = 0;
+      }
+}
+
+/*
+ * usec_ready_track() - remember display start for usec_wait_ready(), modes
+ * mixed before engines went idle are not learned
+ */
+static void
+usec_ready_track (usec_ctx  *ctx,
+                  uint8_t    id,
+                  uint8_t    update_mode)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+
+  if (!arena->busy)
+    {
+      arena->busy      = 1;
+      arena->busy_mode = update_mode;
+    }
+  else if (arena->busy_mode != update_mode)
+    {
+      arena->busy_mode = UPDATE_MODE_AUTO;
+    }
+
+  arena->dpy_ns  = now_ns ();
+  arena->poll_ns = arena->dpy_ns;
+  arena->buf_inuse |= 1 << arena->buf_front;
+}
+
+/*
+ * usec_dpy_rect() - display area of one controller, resolves
+ * UPDATE_MODE_AUTO and keeps the panel mirror up to date
+ */
+static uint8_t
+usec_dpy_rect (usec_ctx  *ctx,
+               uint8_t    id,
+               uint32_t   pos_x,
+               uint32_t   pos_y,
+               uint32_t   width,
+               uint32_t   height,
+               uint8_t    update_mode,
+               uint8_t    update_wait)
+{
+  uint8_t status;
+
+  if (update_mode == UPDATE_MODE_AUTO)
+    {
+      update_mode = usec_mode_auto (ctx, id, pos_x, pos_y, width, height);
+      if (update_mode == UPDATE_MODE_AUTO)
+        return USEC_DEV_OK;
+
+      __atomic_add_fetch (&ctx->stats.auto_mode[update_mode], 1,
+                          __ATOMIC_RELAXED);
+    }
+
+  status = it8951_cmd_dpy_area (ctx, id, pos_x, pos_y, width, height,
+                                update_mode, update_wait);
+  if (status == USEC_DEV_OK)
+    {
+      usec_ready_track (ctx, id, update_mode);
+      usec_panel_sync (ctx, id, pos_x, pos_y, width, height, update_mode);
+      usec_ghost_account (ctx, id, pos_x, pos_y, width, height, update_mode);
+    }
+  else if (ctx->dev_arena[id]->panel != NULL)
+    ctx->dev_arena[id]->panel_valid = 0;
+
+  return status;
+}
+
+/*
+ * usec_ghost_clean() - GC16 refresh of areas with at least 'limit' fast
+ * updates since their last cleaning (whole controller when tiles are not
+ * tracked), returns number of display commands
+ */
+static uint32_t
+usec_ghost_clean (usec_ctx  *ctx,
+                  uint32_t   limit,
+                  uint8_t    update_wait,
+                  uint8_t   *status)
+{
+  static const uint8_t update_order[4] = { 0, 1, 3, 2 };
+  uint32_t total = 0;
+
+  if (limit == 0)
+    return 0;
+
+  for (uint8_t i = 0; i < 4; i++)
+    {
+      uint8_t id = update_order[i];
+      struct usec_arena *arena = ctx->dev_arena[id];
+      uint32_t tiles = arena->tiles_x * arena->tiles_y;
+      uint32_t count = 0;
+
+      if (arena->tile_ghost == NULL)
+        {
+          if (arena->ghost < limit)
+            continue;
+
+          *status |= usec_dpy_rect (ctx, id, 0, 0, ctx->dev_width[id],
+                                    ctx->dev_height[id], UPDATE_MODE_GC16,
+                                    update_wait);
+          total++;
+          continue;
+        }
+
+      for (uint32_t t = 0; t < tiles; t++)
+        {
+          arena->tile_mask[t] = (arena->tile_ghost[t] >= limit);
+          count += arena->tile_mask[t];
+        }
+      if (count == 0)
+        continue;
+
+      count = usec_shadow_rects (ctx, id, arena->tile_mask);
+      count = usec_rect_merge (ctx, id, arena->rects, count, NULL, 0);
+      for (uint32_t k = 0; k < count; k++)
+        {
+          struct usec_rect *r = &arena->rects[k];
+          uint8_t dpy_status;
+
+          dpy_status = usec_dpy_rect (ctx, id, r->x, r->y, r->w, r->h,
+                                      UPDATE_MODE_GC16, update_wait);
+
+          /* refreshed tiles show the current image */
+          if (dpy_status == USEC_DEV_OK && arena->shadow_valid)
+            for (uint32_t ty = r->y / USEC_DEV_TILE;
+                 ty <= (r->y + r->h - 1) / USEC_DEV_TILE; ty++)
+              for (uint32_t tx = r->x / USEC_DEV_TILE;
+                   tx <= (r->x + r->w - 1) / USEC_DEV_TILE; tx++)
+                arena->tile_pending[ty * arena->tiles_x + tx] = 0;
+
+          *status |= dpy_status;
+        }
+
+      total += count;
+    }
+
+  __atomic_add_fetch (&ctx->stats.ghost_refreshes, total, __ATOMIC_RELAXED);
+
+  return total;
+}
+
+/*
+ * usec_dpy_sync_job() - run display job, release of the first display
+ * command is synchronized with other controllers; controllers with nothing
+ * to display still take part
+ */
+static uint8_t
+usec_dpy_sync_job (usec_ctx  *ctx,
+                   uint8_t    id,
+                   void      *arg)
+{
+  struct usec_arena *arena = ctx->dev_arena[id];
+  struct usec_dpy_arg *dpy = arg;
+  uint8_t status;
+
+  arena->dpy_sync = dpy->sync;
+  status = dpy->job (ctx, id, dpy);
+
+  if (arena->dpy_sync != NULL)
+    {
+      pthread_barrier_wait (arena->dpy_sync);
+      arena->dpy_sync = NULL;
+    }
+
+  return status;
+}
+
+/*
+ * usec_dpy_run() - run display job of every controller, one after another
+ * or all at once (DPY_MODE_SYNC); skew of the first display commands is
+ * measured either way
+ */
+static uint8_t
+usec_dpy_run (usec_ctx             *ctx,
+              usec_job_fn           job,
+              struct usec_dpy_arg  *dpy)
+{
+  static const uint8_t update_order[4] = { 0, 1, 3, 2 };
+  uint8_t status = USEC_DEV_OK;
+  uint64_t first = UINT64_MAX, last = 0;
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      ctx->dev_arena[cnt]->dpy_start_ns = 0;
+      dpy[cnt].job   = job;
+      dpy[cnt].count = 0;
+    }
+
+  if (ctx->dpy_mode == DPY_MODE_SYNC)
+    {
+      pthread_barrier_t sync;
+      uint8_t dev_status[4];
+      void *args[4];
+
+      pthread_barrier_init (&sync, NULL, 4);
+      for (uint8_t cnt = 0; cnt < 4; cnt++)
+        {
+          dpy[cnt].sync = &sync;
+          args[cnt] = &dpy[cnt];
+        }
+
+      /* 'dev_status' reports uploads only */
+      memcpy (dev_status, ctx->dev_status, sizeof(dev_status));
+      status = usec_workers_run (ctx, usec_dpy_sync_job, args);
+      memcpy (ctx->dev_status, dev_status, sizeof(dev_status));
+
+      pthread_barrier_destroy (&sync);
+    }
+  else
+    {
+      for (uint8_t i = 0; i < 4; i++)
+        status |= job (ctx, update_order[i], &dpy[update_order[i]]);
+    }
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      uint64_t start = ctx->dev_arena[cnt]->dpy_start_ns;
+
+      if (start == 0)
+        continue;
+
+      first = (start < first) ? start : first;
+      last  = (start > last) ? start : last;
+    }
+
+  if (last != 0)
+    {
+      __atomic_store_n (&ctx->stats.dpy_skew_ns, last - first,
+                        __ATOMIC_RELAXED);
+      if (last - first > ctx->stats.dpy_skew_max_ns)
+        __atomic_store_n (&ctx->stats.dpy_skew_max_ns, last - first,
+                          __ATOMIC_RELAXED);
+    }
+
+  return status;
+}
+
+/*
+ * usec_dpy_area_job()
+ */
+static uint8_t
+usec_dpy_area_job (usec_ctx  *ctx,
+                   uint8_t    id,
+                   void      *arg)
+{
+  struct usec_dpy_arg *dpy = arg;
+
+  if (dpy->area.width == 0 || dpy->area.height == 0)
+    return USEC_DEV_OK;
+
+  dpy->count = 1;
+
+  return usec_dpy_rect (ctx, id, dpy->area.pos_x, dpy->area.pos_y,
+                        dpy->area.width, dpy->area.height, dpy->update_mode,
+                        dpy->update_wait);
+}
+
+/*
+ * usec_img_update_areas() - trigger display update of given area of every
+ * controller (empty areas are skipped), then switch panel power off
+ */
+static uint8_t
+usec_img_update_areas (usec_ctx              *ctx,
+                       struct usec_area_arg  *area,
+                       uint8_t                update_mode,
+                       uint8_t                update_wait)
+{
+  struct usec_dpy_arg dpy[4];
+  uint8_t status;
+
+  memset (dpy, 0, sizeof(dpy));
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      dpy[cnt].area        = area[cnt];
+      dpy[cnt].update_mode = update_mode;
+      dpy[cnt].update_wait = update_wait;
+    }
+
+  usec_power_begin (ctx);
+
+  status = usec_dpy_run (ctx, usec_dpy_area_job, dpy);
+
+  /* caller does not give us idle time, ghosting must not grow forever */
+  usec_ghost_clean (ctx, ctx->ghost_budget * USEC_DEV_GHOST_HARD,
+                    update_wait, &status);
+
+  if (status == USEC_DEV_OK)
+    {
+      usec_dev_log ("[usec] status: screen update\n\r");
+    }
+  else
+    {
+       usec_dev_log ("[usec] error: cannot update selected display area\n\r");
+    }
+
+  return usec_power_end (ctx, 1);
+}
+
+/*
+ * usec_mode_update() - mixed waveform update of one controller, tiles are
+ * grouped by their own mode and every group gets its own display areas
+ * (fast modes first, so text shows up before photos finish); returns number
+ * of areas
+ */
+static uint32_t
+usec_mode_update (usec_ctx  *ctx,
+                  uint8_t    id,
+                  uint8_t    update_wait,
+                  uint8_t   *status)
+{
+  static const uint8_t mode_order[] = {
+    UPDATE_MODE_A2, UPDATE_MODE_DU, UPDATE_MODE_DU4, UPDATE_MODE_GL16,
+    UPDATE_MODE_GC16
+  };
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t tiles = arena->tiles_x * arena->tiles_y;
+  uint32_t total = 0;
+
+  if (!usec_mode_plan (ctx, id))
+    return 0;
+
+  for (uint8_t i = 0; i < sizeof(mode_order); i++)
+    {
+      uint8_t mode = mode_order[i];
+      uint32_t count = 0;
+
+      for (uint32_t t = 0; t < tiles; t++)
+        {
+          arena->tile_mask[t] = (arena->tile_mode[t] == mode);
+          count += arena->tile_mask[t];
         }
-    }
+      if (count == 0)
+        continue;
 
-  hdr->cmdp = cdb;
-  hdr->dxfer_direction = SG_DXFER_TO_DEV;
+      count = usec_shadow_rects (ctx, id, arena->tile_mask);
+      count = usec_rect_merge (ctx, id, arena->rects, count, arena->tile_mode,
+                               mode);
+      for (uint32_t k = 0; k < count; k++)
+        {
+          struct usec_rect *r = &arena->rects[k];
 
-  if (ioctl (fd, SG_IO, hdr) < 0)
-    return USEC_DEV_ERR;
+          __atomic_add_fetch (&ctx->stats.auto_mode[mode], 1,
+                              __ATOMIC_RELAXED);
+          *status |= usec_dpy_rect (ctx, id, r->x, r->y, r->w, r->h, mode,
+                                    update_wait);
+        }
 
-  return USEC_DEV_OK;
-}
+      total += count;
+    }
 
-/******************************************************************************/
+  return total;
+}
 
 /*
- * it8951_cmd_inquiry()
+ * usec_shadow_update_job()
  */
 static uint8_t
-it8951_cmd_inquiry (usec_ctx  *ctx,
-                    uint8_t    id)
+usec_shadow_update_job (usec_ctx  *ctx,
+                        uint8_t    id,
+                        void      *arg)
 {
-  it8951_sg_io_hdr *hdr;
-  uint8_t data_buffer[USEC_DEV_BLOCK_LEN*256];
-  uint8_t status;
+  struct usec_arena *arena = ctx->dev_arena[id];
+  struct usec_dpy_arg *dpy = arg;
+  uint8_t status = USEC_DEV_OK;
 
-  hdr = init_io_hdr();
-  set_xfer_data (hdr, data_buffer, USEC_DEV_BLOCK_LEN*256);
-  set_sense_data (hdr, ctx->dev_sense_buf, USEC_DEV_SENSE_LEN);
+  if (dpy->update_mode == UPDATE_MODE_AUTO && arena->shadow_valid &&
+      ctx->dev_format[id] == IMG_8BPP)
+    {
+      dpy->count = usec_mode_update (ctx, id, dpy->update_wait, &status);
+    }
+  else
+    {
+      dpy->count = usec_shadow_rects (ctx, id, arena->tile_pending);
+      dpy->count = usec_rect_merge (ctx, id, arena->rects, dpy->count,
+                                    NULL, 0);
+      for (uint32_t k = 0; k < dpy->count; k++)
+        status |= usec_dpy_rect (ctx, id, arena->rects[k].x,
+                                 arena->rects[k].y, arena->rects[k].w,
+                                 arena->rects[k].h, dpy->update_mode,
+                                 dpy->update_wait);
+    }
 
-  status = scsi_it8951_cmd_inquiry (ctx->dev_fd[id], hdr);
+  if (status == USEC_DEV_OK)
+    memset (arena->tile_pending, 0, arena->tiles_x * arena->tiles_y);
 
-  destroy_io_hdr(hdr);
   return status;
 }
 
 /*
- * it8951_cmd_system_info()
+ * usec_shadow_update() - refresh only tiles changed since the last update,
+ * controllers without changes are not touched at all
  */
 static uint8_t
-it8951_cmd_system_info (usec_ctx         *ctx,
-                        uint8_t           id,
-                        it8951_sys_info  *info)
+usec_shadow_update (usec_ctx  *ctx,
+                    uint8_t    update_mode,
+                    uint8_t    update_wait)
 {
-  it8951_sg_io_hdr *hdr;
+  struct usec_dpy_arg dpy[4];
   uint8_t status;
+  uint32_t total = 0;
 
-  hdr = init_io_hdr();
-  set_xfer_data (hdr, info, (sizeof(it8951_sys_info) / sizeof(uint32_t)));
-  set_sense_data (hdr, ctx->dev_sense_buf, USEC_DEV_SENSE_LEN);
-
-  status = scsi_it8951_cmd_system_info (ctx->dev_fd[id], hdr);
-  if (status == USEC_DEV_OK)
+  memset (dpy, 0, sizeof(dpy));
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
     {
-      it8951_sys_info *data = hdr->dxferp;
+      dpy[cnt].update_mode = update_mode;
+      dpy[cnt].update_wait = update_wait;
+    }
 
-      info->standard_cmd_no = data_swap_32 (data->standard_cmd_no);
-      info->extend_cmd_no   = data_swap_32 (data->extend_cmd_no);
-      info->signature       = data_swap_32 (data->signature);
-      info->version         = data_swap_32 (data->version);
-      info->width           = data_swap_32 (data->width);
-      info->height          = data_swap_32 (data->height);
-      info->update_buf_base = data_swap_32 (data->update_buf_base);
-      info->image_buf_base  = data_swap_32 (data->image_buf_base);
-      info->temperature_no  = data_swap_32 (data->temperature_no);
-      info->mode_no         = data_swap_32 (data->mode_no);
+  usec_power_begin (ctx);
 
-      for (uint8_t i = 0; i < 8; i++)
-        info->frame_count[i] = data_swap_32 (data->frame_count[i]);
+  status = usec_dpy_run (ctx, usec_shadow_update_job, dpy);
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    total += dpy[cnt].count;
 
-      info->num_img_buf = data_swap_32 (data->num_img_buf);
-      info->wbf_addr    = data_swap_32 (data->wbf_addr);
+  /* caller does not give us idle time, ghosting must not grow forever */
+  total += usec_ghost_clean (ctx, ctx->ghost_budget * USEC_DEV_GHOST_HARD,
+                             update_wait, &status);
 
-      for (uint8_t i = 0; i < 9; i++)
-        info->reserved[i] = data_swap_32 (data->reserved[i]);
+  if (total == 0)
+    return usec_power_end (ctx, 0);
+
+  if (status == USEC_DEV_OK)
+    {
+      usec_dev_log ("[usec] status: screen update\n\r");
+    }
+  else
+    {
+       usec_dev_log ("[usec] error: cannot update selected display area\n\r");
     }
 
-  destroy_io_hdr(hdr);
-  return status;
+  return usec_power_end (ctx, 1);
 }
 
 /*
- * it8951_cmd_read_mem()
+ * usec_img_update_locked()
  */
 static uint8_t
-it8951_cmd_read_mem (usec_ctx  *ctx,
-                     uint8_t    id,
-                     uint32_t   addr,
-                     uint16_t   length,
-                     uint8_t   *buf)
+usec_img_update_locked (usec_ctx  *ctx,
+                        uint8_t    update_mode,
+                        uint8_t    update_wait)
 {
-  it8951_sg_io_hdr *hdr;
-  uint8_t status;
+  struct usec_area_arg area[4];
 
-  hdr = init_io_hdr();
-  set_xfer_data (hdr, buf, length);
-  set_sense_data (hdr, ctx->dev_sense_buf, USEC_DEV_SENSE_LEN);
+  if (update_mode > UPDATE_MODE_AUTO)
+    {
+      usec_dev_log ("[usec] error: invalid update mode value\n\r");
+      return USEC_DEV_ERR;
+    }
 
-  status = scsi_it8951_cmd_read_mem (ctx->dev_fd[id], hdr, addr, length);
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    usec_frame_leave (ctx, cnt);
 
-  destroy_io_hdr(hdr);
-  return status;
+  if (usec_buf_flip_all (ctx) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  if (ctx->dev_arena[0]->shadow != NULL && update_mode != UPDATE_MODE_INIT)
+    return usec_shadow_update (ctx, update_mode, update_wait);
+
+  memset (area, 0, sizeof(area));
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      area[cnt].width  = ctx->dev_width[cnt];
+      area[cnt].height = ctx->dev_height[cnt];
+
+      /* everything is refreshed, nothing stays pending */
+      if (ctx->dev_arena[cnt]->shadow != NULL)
+        memset (ctx->dev_arena[cnt]->tile_pending, 0,
+                ctx->dev_arena[cnt]->tiles_x * ctx->dev_arena[cnt]->tiles_y);
+    }
+
+  return usec_img_update_areas (ctx, area, update_mode, update_wait);
 }
 
 /*
- * it8951_cmd_write_mem()
+ * usec_img_update()
  */
-static uint8_t
-it8951_cmd_write_mem (usec_ctx  *ctx,
-                      uint8_t    id,
-                      uint32_t   addr,
-                      uint16_t   length,
-                      uint8_t   *buf)
+uint8_t
+usec_img_update (usec_ctx  *ctx,
+                 uint8_t    update_mode,
+                 uint8_t    update_wait)
 {
-  it8951_sg_io_hdr *hdr;
   uint8_t status;
 
-  hdr = init_io_hdr();
-  set_xfer_data (hdr, buf, length);
-  set_sense_data (hdr, ctx->dev_sense_buf, USEC_DEV_SENSE_LEN);
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
 
-  status = scsi_it8951_cmd_write_mem (ctx->dev_fd[id], hdr, addr, length);
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_img_update_locked (ctx, update_mode, update_wait);
+  usec_unlock (ctx, USEC_LOCK_ALL);
 
-  destroy_io_hdr(hdr);
   return status;
 }
 
 /*
- * it8951_cmd_read_reg()
+ * usec_img_update_area_locked()
  */
 static uint8_t
-it8951_cmd_read_reg (usec_ctx  *ctx,
-                     uint8_t    id,
-                     uint32_t   addr,
-                     uint32_t  *buf)
+usec_img_update_area_locked (usec_ctx  *ctx,
+                             uint32_t   pos_x,
+                             uint32_t   pos_y,
+                             uint32_t   width,
+                             uint32_t   height,
+                             uint8_t    update_mode,
+                             uint8_t    update_wait)
 {
-  it8951_sg_io_hdr *hdr;
-  uint8_t status;
+  struct usec_area_arg area[4];
+  uint32_t top = 0;
 
-  hdr = init_io_hdr();
-  set_xfer_data (hdr, buf, sizeof(uint32_t));
-  set_sense_data (hdr, ctx->dev_sense_buf, USEC_DEV_SENSE_LEN);
+  if (update_mode > UPDATE_MODE_AUTO)
+    {
+      usec_dev_log ("[usec] error: invalid update mode value\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  if (width == 0 || height == 0 || pos_x + width > ctx->dev_width[0] ||
+      pos_y + height > ctx->dev_height[0] + ctx->dev_height[1] +
+                       ctx->dev_height[2] + ctx->dev_height[3])
+    {
+      usec_dev_log ("[usec] error: invalid display area\n\r");
+      return USEC_DEV_ERR;
+    }
 
-  status = scsi_it8951_cmd_read_reg (ctx->dev_fd[id], hdr, addr);
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    usec_frame_leave (ctx, cnt);
 
-  destroy_io_hdr(hdr);
-  return status;
+  if (usec_buf_flip_all (ctx) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
+
+  memset (area, 0, sizeof(area));
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      uint32_t y0, y1;
+
+      y0 = (pos_y > top) ? pos_y : top;
+      y1 = (pos_y + height < top + ctx->dev_height[cnt]) ?
+           (pos_y + height) : (top + ctx->dev_height[cnt]);
+
+      if (y0 < y1)
+        {
+          area[cnt].pos_x  = pos_x;
+          area[cnt].pos_y  = y0 - top;
+          area[cnt].width  = width;
+          area[cnt].height = y1 - y0;
+
+          /* 1bpp display mode works on 32 px wide columns */
+          if (usec_front_format (ctx, cnt) == IMG_1BPP)
+            {
+              uint32_t x1 = (pos_x + width + 31) & ~31u;
+
+              area[cnt].pos_x = pos_x & ~31u;
+              area[cnt].width = ((x1 < ctx->dev_width[cnt]) ? x1 :
+                                 ctx->dev_width[cnt]) - area[cnt].pos_x;
+            }
+        }
+
+      top += ctx->dev_height[cnt];
+    }
+
+  return usec_img_update_areas (ctx, area, update_mode, update_wait);
 }
 
 /*
- * it8951_cmd_write_reg()
+ * usec_img_update_area() - only controllers covering part of the area are
+ * updated, each one just within the covered rectangle
  */
-static uint8_t
-it8951_cmd_write_reg (usec_ctx  *ctx,
-                      uint8_t    id,
-                      uint32_t   addr,
-                      uint32_t   buf)
+uint8_t
+usec_img_update_area (usec_ctx  *ctx,
+                      uint32_t   pos_x,
+                      uint32_t   pos_y,
+                      uint32_t   width,
+                      uint32_t   height,
+                      uint8_t    update_mode,
+                      uint8_t    update_wait)
 {
-  it8951_sg_io_hdr *hdr;
-  uint32_t buf_in;
   uint8_t status;
 
-  hdr = init_io_hdr();
-  buf_in = data_swap_32 (buf);
-  set_xfer_data (hdr, &buf_in, sizeof(uint32_t));
-  set_sense_data (hdr, ctx->dev_sense_buf, USEC_DEV_SENSE_LEN);
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
 
-  status = scsi_it8951_cmd_write_reg (ctx->dev_fd[id], hdr, addr);
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_img_update_area_locked (ctx, pos_x, pos_y, width, height,
+                                        update_mode, update_wait);
+  usec_unlock (ctx, USEC_LOCK_ALL);
 
-  destroy_io_hdr(hdr);
   return status;
 }
 
 /*
- * it8951_cmd_dpy_area()
+ * usec_frame_hash() - content key of a cached frame
  */
-static uint8_t
-it8951_cmd_dpy_area (usec_ctx  *ctx,
-                     uint8_t    id,
-                     uint32_t   pos_x,
-                     uint32_t   pos_y,
-                     uint32_t   width,
-                     uint32_t   height,
-                     uint32_t   wav_mode,
-                     uint32_t   wait_ready)
+static uint64_t
+usec_frame_hash (const uint8_t  *data,
+                 size_t          size)
 {
-  it8951_sg_io_hdr *hdr;
-  it8951_disp_arg displayArg;
-  uint8_t status;
+  uint64_t hash = 0xCBF29CE484222325ULL ^ size;
+  size_t i;
 
-  displayArg.pos_x        = data_swap_32 (pos_x);
-  displayArg.pos_y        = data_swap_32 (pos_y);
-  displayArg.width        = data_swap_32 (width);
-  displayArg.height       = data_swap_32 (height);
-  displayArg.engine_index = data_swap_32 (wait_ready);
-  displayArg.mem_addr     = data_swap_32 (ctx->dev_addr[id]);
-  displayArg.wav_mode     = data_swap_32 (wav_mode);
+  for (i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+      uint64_t word;
 
-  hdr = init_io_hdr();
-  set_xfer_data (hdr, &displayArg, sizeof(it8951_disp_arg));
-  set_sense_data (hdr, ctx->dev_sense_buf, USEC_DEV_SENSE_LEN);
+      memcpy (&word, data + i, sizeof(word));
+      hash = (hash ^ word) * 0x100000001B3ULL;
+      hash ^= hash >> 29;
+    }
 
-  status = scsi_it8951_cmd_dpy_area (ctx->dev_fd[id], hdr);
+  for (; i < size; i++)
+    hash = (hash ^ data[i]) * 0x100000001B3ULL;
 
-  destroy_io_hdr(hdr);
-  return status;
+  return hash;
 }
 
 /*
- * it8951_cmd_load_img()
+ * usec_frame_load_job() - find controller part of the frame in the cache,
+ * otherwise load it in place of the least recently used one
  */
 static uint8_t
-it8951_cmd_load_img (usec_ctx  *ctx,
+usec_frame_load_job (usec_ctx  *ctx,
                      uint8_t    id,
-                     uint8_t   *src_img,
-                     uint32_t   pos_x,
-                     uint32_t   pos_y,
-                     uint32_t   width,
-                     uint32_t   height)
+                     void      *arg)
 {
+  struct usec_arena *arena = ctx->dev_arena[id];
+  uint32_t width  = ctx->dev_width[id];
+  uint32_t height = ctx->dev_height[id];
+  uint8_t *img_data = arg;
+  uint32_t live_addr;
+  uint64_t hash;
+  uint8_t victim = 0;
   uint8_t status;
-  uint32_t counter;
 
-  counter = (USEC_DEV_SPT_LEN / width);
-  status = 0;
+  hash = usec_frame_hash (img_data, width * height);
+  arena->frame_clock++;
 
-  if (width <= 2048 && width != (ctx->dev_width[id]))
+  for (uint8_t i = 0; i < arena->frame_count; i++)
     {
-      it8951_sg_io_hdr  *hdr;
-      it8951_load_arg    load_arg;
+      struct usec_frame *frame = &arena->frames[i];
 
-      hdr = init_io_hdr();
-      for (uint32_t i = 0; i < height; i += counter)
+      if (frame->valid && frame->hash == hash)
         {
-          uint8_t *buf;
-
-          if (counter > (height-i))
-            counter = (height-i);
-
-          buf = malloc((sizeof(it8951_load_arg)+(width*counter)));
-
-          load_arg.x    = data_swap_32 (pos_x);
-          load_arg.y    = data_swap_32 (pos_y + i);
-          load_arg.w    = data_swap_32 (width);
-          load_arg.h    = data_swap_32 (counter);
-          load_arg.addr = data_swap_32 (ctx->dev_addr[id]);
-
-          memcpy (buf, &load_arg, sizeof(it8951_load_arg));
-          memcpy ((buf + sizeof(it8951_load_arg)),
-                  src_img+(i*width), width*counter);
-
-          set_xfer_data (hdr, buf, sizeof(it8951_load_arg) + (width*counter));
-          set_sense_data (hdr, ctx->dev_sense_buf, USEC_DEV_SENSE_LEN);
-
-          status |= scsi_it8951_cmd_load_img (ctx->dev_fd[id], hdr);
-          free(buf);
+          frame->used = arena->frame_clock;
+          arena->frame_slot = i;
+          __atomic_add_fetch (&ctx->stats.frame_hits, 1, __ATOMIC_RELAXED);
+          return USEC_DEV_OK;
         }
 
-      destroy_io_hdr(hdr);
-    }
-  else
-    {
-      for (uint32_t i = 0; i < height; i += counter)
-        {
-          if (counter > (height-i))
-            counter = (height-i);
+      if (!arena->frames[victim].valid)
+        continue;
 
-          status |= it8951_cmd_write_mem (ctx, id,
-                    (ctx->dev_addr[id] + pos_x + ((pos_y + i) * \
-                    (ctx->dev_width[id]))),
-                    (uint32_t)(width * counter), (src_img + (i * width)));
-        }
+      if (!frame->valid || frame->used < arena->frames[victim].used)
+        victim = i;
     }
 
-  return status;
-}
+  __atomic_add_fetch (&ctx->stats.frame_misses, 1, __ATOMIC_RELAXED);
 
-/*
- * it8951_cmd_get_set_temp()
- */
-static uint8_t
-it8951_cmd_get_set_temp (usec_ctx         *ctx,
-                         uint8_t           id,
-                         it8951_temp_arg  *temp)
-{
-  it8951_sg_io_hdr *hdr;
-  uint8_t status, flag;
+  /* waveform may still read the slot */
+  if ((arena->frame_inuse & (1 << victim)) &&
+      usec_ready_wait (ctx, id) != USEC_DEV_OK)
+    return USEC_DEV_ERR;
 
-  flag = temp->set;
-  hdr = init_io_hdr();
+  arena->frames[victim].valid = 0;
 
-  set_xfer_data (hdr, temp, sizeof(it8951_temp_arg) / sizeof(uint8_t));
-  set_sense_data (hdr, ctx->dev_sense_buf, USEC_DEV_SENSE_LEN);
+  live_addr = ctx->dev_addr[id];
+  ctx->dev_addr[id] = arena->buf_base + (ctx->img_buffers + victim) *
+                      width * height;
+  status = it8951_cmd_load_img (ctx, id, img_data, 0, 0, width, height,
+                                width);
+  ctx->dev_addr[id] = live_addr;
 
-  status = scsi_it8951_cmd_get_set_temp (ctx->dev_fd[id],
-                                         hdr, temp->set,temp->val);
-  if (status == USEC_DEV_OK)
-    {
-      if (flag == IT8951_TEMP_GET)
-        {
-          it8951_temp_arg *temp_tmp;
-          uint8_t temp_byte;
+  if (status != USEC_DEV_OK)
+    return status;
 
-          /* swap */
-          temp_tmp = hdr->dxferp;
-          temp_byte = temp_tmp->set;
-          temp_tmp->set = temp_tmp->val;
-          temp_tmp->val = temp_byte;
-        }
-    }
+  arena->frames[victim].hash  = hash;
+  arena->frames[victim].used  = arena->frame_clock;
+  arena->frames[victim].valid = 1;
+  arena->frame_slot = victim;
 
-  destroy_io_hdr(hdr);
-  return status;
+  return USEC_DEV_OK;
 }
 
 /*
- * it8951_cmd_get_set_pmic()
+ * usec_frame_dpy_job() - display cached frame of one controller, 'img_data'
+ * is its content for the panel mirror
  */
 static uint8_t
-it8951_cmd_get_set_pmic (usec_ctx  *ctx,
-                         uint8_t    id,
-                         uint16_t   vcom_set_value,
-                         uint16_t  *vcom_get_value,
-                         uint8_t    do_set_vcom,
-                         uint8_t    do_set_power,
-                         uint8_t    power_on_off)
+usec_frame_dpy_job (usec_ctx  *ctx,
+                    uint8_t    id,
+                    void      *arg)
 {
-  it8951_sg_io_hdr *hdr;
+  struct usec_arena *arena = ctx->dev_arena[id];
+  struct usec_dpy_arg *dpy = arg;
+  const uint8_t *img_data = dpy->img_data;
+  uint32_t width  = ctx->dev_width[id];
+  uint32_t height = ctx->dev_height[id];
+  uint8_t update_mode = dpy->update_mode;
   uint8_t status;
 
-  hdr = init_io_hdr();
-  set_xfer_data (hdr, vcom_get_value, sizeof (uint16_t));
-  set_sense_data (hdr, ctx->dev_sense_buf, USEC_DEV_SENSE_LEN);
+  arena->front_addr  = arena->buf_base + (ctx->img_buffers +
+                       arena->frame_slot) * width * height;
+  arena->frame_shown = 1;
 
-  status = scsi_it8951_cmd_set_pmic(ctx->dev_fd[id], hdr, vcom_set_value,
-                                    do_set_vcom, do_set_power, power_on_off);
-if (status == USEC_DEV_OK)
+  if (update_mode == UPDATE_MODE_AUTO)
     {
-      if (vcom_set_value == 0xffff)
+      struct usec_hist hist;
+
+      update_mode = UPDATE_MODE_GC16;
+      if (arena->panel != NULL && arena->panel_valid)
         {
-          /* swap */
-          *vcom_get_value = (*vcom_get_value >> 8) | (*vcom_get_value << 8);
+          memset (&hist, 0, sizeof(hist));
+          for (uint32_t row = 0; row < height; row++)
+            usec_kern.hist (arena->panel + row * width,
+                            img_data + row * width, width, &hist);
+
+          update_mode = usec_mode_class (arena, &hist,
+                                         (uint64_t) width * height);
+          if (update_mode == UPDATE_MODE_AUTO)
+            return USEC_DEV_OK;
         }
-    }
 
-  destroy_io_hdr(hdr);
-  return status;
-}
+      __atomic_add_fetch (&ctx->stats.auto_mode[update_mode], 1,
+                          __ATOMIC_RELAXED);
+    }
 
-/*
- * it8951_cmd_auto_reset()
- */
-static uint8_t
-it8951_cmd_auto_reset (usec_ctx  *ctx,
-                       uint8_t    id)
-{
-  it8951_sg_io_hdr *hdr;
-  uint8_t status;
+  dpy->count = 1;
+  status = it8951_cmd_dpy_area (ctx, id, 0, 0, width, height, update_mode,
+                                dpy->update_wait);
+  if (status != USEC_DEV_OK)
+    {
+      if (arena->panel != NULL)
+        arena->panel_valid = 0;
+      return status;
+    }
 
-  hdr = init_io_hdr();
-  set_xfer_data (hdr, NULL, 0);
-  set_sense_data (hdr, ctx->dev_sense_buf, USEC_DEV_SENSE_LEN);
+  usec_ready_track (ctx, id, update_mode);
+  arena->frame_inuse |= 1 << arena->frame_slot;
 
-  status = scsi_it8951_cmd_auto_reset (ctx->dev_fd[id], hdr);
+  if (arena->panel != NULL)
+    {
+      if (update_mode == UPDATE_MODE_INIT)
+        memset (arena->panel, 0xFF, width * height);
+      else
+        memcpy (arena->panel, img_data, width * height);
+      arena->panel_valid = 1;
+    }
 
-  destroy_io_hdr(hdr);
-  return status;
-}
+  usec_ghost_account (ctx, id, 0, 0, width, height, update_mode);
 
-/******************************************************************************/
+  return USEC_DEV_OK;
+}
 
 /*
- * usec_dev_log()
+ * usec_set_frame_cache_locked()
  */
-static void
-usec_dev_log (const char* fmt, ...)
+static uint8_t
+usec_set_frame_cache_locked (usec_ctx  *ctx,
+                             uint8_t    enable)
 {
-#if USEC_DEV_DEBUG_LOG
-  va_list args;
+  if (enable)
+    for (uint8_t cnt = 0; cnt < 4; cnt++)
+      if (ctx->dev_img_bufs[cnt] <= ctx->img_buffers)
+        {
+          usec_dev_log ("[usec] error: no spare image buffers for frame "
+                        "cache\n\r");
+          return USEC_DEV_ERR;
+        }
 
-  va_start (args, fmt);
-  vprintf (fmt, args);
-  va_end (args);
-#endif
-}
+  ctx->frame_cache = (enable != 0);
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    usec_frame_reset (ctx, cnt);
 
-/******************************************************************************/
+  return USEC_DEV_OK;
+}
 
 /*
- * usec_init()
+ * usec_set_frame_cache() - keep frames shown by usec_frame_show() in spare
+ * image buffers of controllers
  */
-usec_ctx *
-usec_init (void)
+uint8_t
+usec_set_frame_cache (usec_ctx  *ctx,
+                      uint8_t    enable)
 {
-  usec_ctx *ctx;
-  it8951_sys_info info;
   uint8_t status;
 
-  /* init usec context */
-  ctx = malloc(sizeof(*ctx));
   if (ctx == NULL)
     {
-      usec_dev_log ("[usec] error: cannot initialize device context\n\r");
-      return NULL;
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
     }
 
-  ctx->dev_fd[0] = 0;
-  ctx->dev_fd[1] = 0;
-  ctx->dev_fd[2] = 0;
-  ctx->dev_fd[3] = 0;
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_set_frame_cache_locked (ctx, enable);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return status;
+}
+
+/*
+ * usec_frame_show_locked()
+ */
+static uint8_t
+usec_frame_show_locked (usec_ctx  *ctx,
+                        uint8_t   *img_data,
+                        size_t     img_size,
+                        uint8_t    update_mode,
+                        uint8_t    update_wait)
+{
+  struct usec_dpy_arg dpy[4];
+  uint8_t *part[4];
+  uint8_t status = USEC_DEV_OK;
 
-  /* init sense buffer */
-  ctx->dev_sense_buf = malloc(USEC_DEV_SENSE_LEN);
-  if (ctx->dev_sense_buf == NULL)
+  if (!ctx->frame_cache)
     {
-      usec_dev_log ("[usec] error: cannot initialize device context\n\r");
+      usec_dev_log ("[usec] error: frame cache is not enabled\n\r");
+      return USEC_DEV_ERR;
+    }
 
-      free (ctx);
-      return NULL;
+  if (update_mode > UPDATE_MODE_AUTO)
+    {
+      usec_dev_log ("[usec] error: invalid update mode value\n\r");
+      return USEC_DEV_ERR;
     }
-  memset (ctx->dev_sense_buf, 0, USEC_DEV_SENSE_LEN);
 
-  /* open all devices */
-  for (uint8_t cnt = 0; cnt < 4; cnt++)
+  if (img_data == NULL || img_size != (4*1440*640))
     {
-      char *dev_path;
+      usec_dev_log ("[usec] error: invalid image data size\n\r");
+      return USEC_DEV_ERR;
+    }
 
-      if (cnt == 0)
-        dev_path = "/dev/eink_usec_312BWN0_1";
-      else if (cnt == 1)
-        dev_path = "/dev/eink_usec_312BWN0_2";
-      else if (cnt == 2)
-        dev_path = "/dev/eink_usec_312BWN0_3";
-      else if (cnt == 3)
-        dev_path = "/dev/eink_usec_312BWN0_4";
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      part[cnt] = img_data;
+      img_data += ctx->dev_width[cnt] * ctx->dev_height[cnt];
+    }
 
-      /* open usec device */
-      ctx->dev_fd[cnt] = open (dev_path, O_RDWR);
-      if (ctx->dev_fd[cnt] <= 0)
-        {
-          usec_dev_log ("[usec] error: cannot open '%s' device\n\r", dev_path);
-
-          if (ctx->dev_fd[0])
-            close (ctx->dev_fd[0]);
-          if (ctx->dev_fd[1])
-            close (ctx->dev_fd[1]);
-          if (ctx->dev_fd[2])
-            close (ctx->dev_fd[2]);
-          if (ctx->dev_fd[3])
-            close (ctx->dev_fd[3]);
-
-          free (ctx->dev_sense_buf);
-          free (ctx);
-          return NULL;
+  if (ctx->upload_mode == UPLOAD_MODE_PARALLEL)
+    {
+      status = usec_workers_run (ctx, usec_frame_load_job, (void **) part);
+    }
+  else
+    {
+      for (uint8_t cnt = 0; cnt < 4 && status == USEC_DEV_OK; cnt++)
+        {
+          status = usec_frame_load_job (ctx, cnt, part[cnt]);
+          ctx->dev_status[cnt] = status;
         }
+    }
 
-      /* send 'inquiry' command */
-      status = it8951_cmd_inquiry(ctx, cnt);
-      if (status != 0)
-        {
-          usec_dev_log ("[usec] error: cannot send 'inquiry' command\n\r");
+  if (status != USEC_DEV_OK)
+    {
+      usec_dev_log ("[usec] error: cannot load frame into cache\n\r");
+      return status;
+    }
 
-          if (ctx->dev_fd[0])
-            close (ctx->dev_fd[0]);
-          if (ctx->dev_fd[1])
-            close (ctx->dev_fd[1]);
-          if (ctx->dev_fd[2])
-            close (ctx->dev_fd[2]);
-          if (ctx->dev_fd[3])
-            close (ctx->dev_fd[3]);
-
-          free (ctx->dev_sense_buf);
-          free (ctx);
-          return NULL;
-        }
+  memset (dpy, 0, sizeof(dpy));
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
+    {
+      dpy[cnt].img_data    = part[cnt];
+      dpy[cnt].update_mode = update_mode;
+      dpy[cnt].update_wait = update_wait;
+    }
 
-      status = it8951_cmd_system_info (ctx, cnt, &info);
-      if (status != 0)
-        {
-          usec_dev_log ("[usec] error: cannot read data from controller\n\r");
+  usec_power_begin (ctx);
 
-          if (ctx->dev_fd[0])
-            close (ctx->dev_fd[0]);
-          if (ctx->dev_fd[1])
-            close (ctx->dev_fd[1]);
-          if (ctx->dev_fd[2])
-            close (ctx->dev_fd[2]);
-          if (ctx->dev_fd[3])
-            close (ctx->dev_fd[3]);
-
-          free (ctx->dev_sense_buf);
-          free (ctx);
-          return NULL;
-        }
+  status = usec_dpy_run (ctx, usec_frame_dpy_job, dpy);
 
-      ctx->dev_width[cnt]  = info.width;
-      ctx->dev_height[cnt] = info.height;
-      ctx->dev_addr[cnt]   = info.image_buf_base;
+  /* caller does not give us idle time, ghosting must not grow forever */
+  usec_ghost_clean (ctx, ctx->ghost_budget * USEC_DEV_GHOST_HARD,
+                    update_wait, &status);
 
-      usec_dev_log ("[usec] status: screen width - %d [px]\n\r",
-                    ctx->dev_width[cnt]);
-      usec_dev_log ("[usec] status: screen height - %d [px]\n\r",
-                    ctx->dev_height[cnt]);
-  }
+  if (status == USEC_DEV_OK)
+    {
+      usec_dev_log ("[usec] status: screen update\n\r");
+    }
+  else
+    {
+       usec_dev_log ("[usec] error: cannot show cached frame\n\r");
+    }
 
-  return ctx;
+  return usec_power_end (ctx, 1);
 }
 
 /*
- * usec_deinit()
+ * usec_frame_show() - show 8bpp fullscreen image; parts already held by the
+ * frame cache are displayed right from controller memory without upload
  */
-void
-usec_deinit (usec_ctx *ctx)
+uint8_t
+usec_frame_show (usec_ctx  *ctx,
+                 uint8_t   *img_data,
+                 size_t     img_size,
+                 uint8_t    update_mode,
+                 uint8_t    update_wait)
 {
+  uint8_t status;
+
   if (ctx == NULL)
     {
       usec_dev_log ("[usec] error: invalid device context\n\r");
-      return;
+      return USEC_DEV_ERR;
     }
 
-  if (ctx->dev_fd[0])
-    close (ctx->dev_fd[0]);
-  if (ctx->dev_fd[1])
-    close (ctx->dev_fd[1]);
-  if (ctx->dev_fd[2])
-    close (ctx->dev_fd[2]);
-  if (ctx->dev_fd[3])
-    close (ctx->dev_fd[3]);
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_frame_show_locked (ctx, img_data, img_size, update_mode,
+                                   update_wait);
+  usec_unlock (ctx, USEC_LOCK_ALL);
 
-  free (ctx->dev_sense_buf);
-  free (ctx);
+  return status;
 }
 
 /*
- * usec_get_temp()
+ * usec_set_ghost_budget_locked()
+ */
+static uint8_t
+usec_set_ghost_budget_locked (usec_ctx  *ctx,
+                              uint32_t   ghost_budget)
+{
+  if (ghost_budget > UINT16_MAX / USEC_DEV_GHOST_HARD)
+    {
+      usec_dev_log ("[usec] error: invalid ghosting budget value\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  ctx->ghost_budget = ghost_budget;
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_set_ghost_budget()
  */
 uint8_t
-usec_get_temp (usec_ctx  *ctx,
-               uint8_t   *temp_val)
+usec_set_ghost_budget (usec_ctx  *ctx,
+                       uint32_t   ghost_budget)
 {
-  it8951_temp_arg temp;
   uint8_t status;
 
   if (ctx == NULL)
@@ -1238,31 +7796,45 @@ usec_get_temp (usec_ctx  *ctx,
       return USEC_DEV_ERR;
     }
 
-  temp.set = IT8951_TEMP_GET;
-  status = it8951_cmd_get_set_temp (ctx, 2, &temp);
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_set_ghost_budget_locked (ctx, ghost_budget);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return status;
+}
+
+/*
+ * usec_idle_locked()
+ */
+static uint8_t
+usec_idle_locked (usec_ctx  *ctx)
+{
+  uint8_t status = USEC_DEV_OK;
+
+  usec_power_begin (ctx);
+
+  if (usec_ghost_clean (ctx, ctx->ghost_budget, 0, &status) == 0)
+    return usec_power_end (ctx, 0);
+
   if (status == USEC_DEV_OK)
     {
-      usec_dev_log ("[usec] status: screen temp - %d [degC]\n\r", temp.val);
-      if (temp_val != NULL)
-        *temp_val = temp.val;
+      usec_dev_log ("[usec] status: ghosting cleanup\n\r");
     }
   else
     {
-      usec_dev_log ("[usec] error: cannot read data from temperature " \
-                    "sensor\n\r");
+       usec_dev_log ("[usec] error: cannot clean ghosting\n\r");
     }
 
-  return status;
+  return usec_power_end (ctx, 1);
 }
 
 /*
- * usec_get_vcom()
+ * usec_idle() - caller has nothing to show, spend the time on cleaning
+ * areas which used up their ghosting budget
  */
 uint8_t
-usec_get_vcom (usec_ctx  *ctx,
-               uint16_t  *vcom_val)
+usec_idle (usec_ctx  *ctx)
 {
-  uint16_t vcom;
   uint8_t status;
 
   if (ctx == NULL)
@@ -1271,31 +7843,58 @@ usec_get_vcom (usec_ctx  *ctx,
       return USEC_DEV_ERR;
     }
 
-  status = it8951_cmd_get_set_pmic (ctx, 2, 0xFFFF, &vcom, 0, 0, 0);
-  if (status == USEC_DEV_OK)
+  usec_lock (ctx, USEC_LOCK_ALL);
+  status = usec_idle_locked (ctx);
+  usec_unlock (ctx, USEC_LOCK_ALL);
+
+  return status;
+}
+
+/*
+ * usec_is_busy() - only controllers with display commands since they were
+ * last seen idle are asked
+ */
+uint8_t
+usec_is_busy (usec_ctx  *ctx,
+              uint8_t   *busy)
+{
+  if (ctx == NULL || busy == NULL)
     {
-      usec_dev_log ("[usec] status: screen vcom - -%.2f [V]\n\r",
-                    (float)vcom/1000);
-      if (vcom_val != NULL)
-        *vcom_val = vcom;
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
     }
-  else
+
+  *busy = 0;
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
     {
-      usec_dev_log ("[usec] error: cannot read vcom value\n\r");
+      uint8_t status;
+
+      usec_lock (ctx, 1 << cnt);
+      status = usec_ready_poll (ctx, cnt);
+      *busy |= ctx->dev_arena[cnt]->busy;
+      usec_unlock (ctx, 1 << cnt);
+
+      if (status != USEC_DEV_OK)
+        {
+          usec_dev_log ("[usec] error: cannot read display engine status\n\r");
+          return USEC_DEV_ERR;
+        }
     }
 
-  return status;
+  return USEC_DEV_OK;
 }
 
 /*
- * usec_img_upload()
+ * usec_wait_ready() - sleep through most of the expected waveform time, then
+ * poll with exponential backoff
  */
 uint8_t
-usec_img_upload (usec_ctx  *ctx,
-                 uint8_t   *img_data,
-                 size_t     img_size)
+usec_wait_ready (usec_ctx  *ctx,
+                 uint32_t   timeout_ms)
 {
-  uint8_t status;
+  uint64_t now, deadline, expect = 0;
+  uint64_t delay = USEC_DEV_POLL_MIN_US * 1000ULL;
+  uint8_t busy;
 
   if (ctx == NULL)
     {
@@ -1303,81 +7902,177 @@ usec_img_upload (usec_ctx  *ctx,
       return USEC_DEV_ERR;
     }
 
-  if (img_size != (4*1440*640))
+  now = now_ns ();
+  deadline = now + (uint64_t) timeout_ms * 1000000ULL;
+
+  for (uint8_t cnt = 0; cnt < 4; cnt++)
     {
-      usec_dev_log ("[usec] error: invalid image data size\n\r");
-      return USEC_DEV_ERR;
+      struct usec_arena *arena = ctx->dev_arena[cnt];
+      uint64_t end = 0;
+
+      usec_lock (ctx, 1 << cnt);
+      if (arena->busy && arena->busy_mode != UPDATE_MODE_AUTO)
+        end = arena->dpy_ns + arena->ready_ns[arena->busy_mode] / 16 * 15;
+      usec_unlock (ctx, 1 << cnt);
+
+      if (end > now && end - now > expect)
+        expect = end - now;
     }
 
-  for (uint8_t cnt = 0; cnt < 4; cnt++)
+  if (expect > 0)
+    sleep_ns ((now + expect < deadline) ? expect : deadline - now);
+
+  for (;;)
     {
-      status = it8951_cmd_load_img (ctx, cnt, img_data, 0, 0,
-                                    ctx->dev_width[cnt],
-                                    ctx->dev_height[cnt]);
-      if (status == USEC_DEV_OK)
-        {
-          img_data += ctx->dev_width[cnt]*ctx->dev_height[cnt];
+      if (usec_is_busy (ctx, &busy) != USEC_DEV_OK)
+        return USEC_DEV_ERR;
 
-          usec_dev_log ("[usec] status: uploading image - part %d\n\r", cnt);
-        }
-      else
+      if (!busy)
+        return USEC_DEV_OK;
+
+      now = now_ns ();
+      if (now >= deadline)
         {
-          usec_dev_log ("[usec] error: cannot upload image data\n\r");
-          return status;
+          usec_dev_log ("[usec] error: display engine busy - timeout\n\r");
+          return USEC_DEV_ERR;
         }
-    }
 
-  return status;
+      sleep_ns ((now + delay < deadline) ? delay : deadline - now);
+      if (delay < USEC_DEV_POLL_MAX_US * 1000ULL)
+        delay *= 2;
+    }
 }
 
+/******************************************************************************/
+
 /*
- * usec_img_update()
+ * usec_set_submit_queue() - start (1) or stop (0) the I/O thread behind
+ * usec_img_submit(); call it from the submitting thread, stopping waits
+ * until the last submitted frame is shown
  */
 uint8_t
-usec_img_update (usec_ctx  *ctx,
-                 uint8_t    update_mode,
-                 uint8_t    update_wait)
+usec_set_submit_queue (usec_ctx  *ctx,
+                       uint8_t    enable)
 {
-  uint8_t status;
-
   if (ctx == NULL)
     {
       usec_dev_log ("[usec] error: invalid device context\n\r");
       return USEC_DEV_ERR;
     }
 
-  if (update_mode > UPDATE_MODE_DU4)
+  if (enable > 1)
     {
-      usec_dev_log ("[usec] error: invalid update mode value\n\r");
+      usec_dev_log ("[usec] error: invalid submit queue value\n\r");
+      return USEC_DEV_ERR;
+    }
+
+  if (!enable)
+    {
+      usec_submit_stop (ctx);
+      return USEC_DEV_OK;
+    }
+
+  if (usec_submit_start (ctx) != USEC_DEV_OK)
+    {
+      usec_dev_log ("[usec] error: cannot start submit thread\n\r");
       return USEC_DEV_ERR;
     }
 
-  status  = it8951_cmd_dpy_area (ctx, 0, 0, 0,
-                                 ctx->dev_width[0], ctx->dev_height[0],
-                                 update_mode, update_wait);
+  return USEC_DEV_OK;
+}
+
+/*
+ * usec_img_submit() - queue 8bpp fullscreen image for display and return
+ * without waiting for USB; frames not sent yet are replaced by newer ones,
+ * so panel converges on the latest one (single producer thread only)
+ */
+uint8_t
+usec_img_submit (usec_ctx  *ctx,
+                 uint8_t   *img_data,
+                 size_t     img_size,
+                 uint8_t    update_mode)
+{
+  struct usec_submit *sub;
+  struct usec_submit_slot *slot = NULL;
+  uint64_t state;
 
-  status |= it8951_cmd_dpy_area (ctx, 1, 0, 0,
-                                 ctx->dev_width[1], ctx->dev_height[1],
-                                 update_mode, update_wait);
+  if (ctx == NULL)
+    {
+      usec_dev_log ("[usec] error: invalid device context\n\r");
+      return USEC_DEV_ERR;
+    }
 
-  status |= it8951_cmd_dpy_area (ctx, 3, 0, 0,
-                                 ctx->dev_width[3], ctx->dev_height[3],
-                                 update_mode, update_wait);
+  sub = ctx->dev_submit;
+  if (sub == NULL)
+    {
+      usec_dev_log ("[usec] error: submit queue is not enabled\n\r");
+      return USEC_DEV_ERR;
+    }
 
-  status |= it8951_cmd_dpy_area (ctx, 2, 0, 0,
-                                 ctx->dev_width[2], ctx->dev_height[2],
-                                 update_mode, update_wait);
+  if (update_mode > UPDATE_MODE_AUTO)
+    {
+      usec_dev_log ("[usec] error: invalid update mode value\n\r");
+      return USEC_DEV_ERR;
+    }
 
-  if (status == USEC_DEV_OK)
+  if (img_data == NULL || img_size != sub->img_size)
     {
-      usec_dev_log ("[usec] status: screen update\n\r");
+      usec_dev_log ("[usec] error: invalid image data size\n\r");
+      return USEC_DEV_ERR;
     }
-  else
+
+  /* consumer holds at most one slot, so there is always a free one or a
+     queued frame to replace */
+  while (slot == NULL)
     {
-       usec_dev_log ("[usec] error: cannot update selected display area\n\r");
+      struct usec_submit_slot *oldest = NULL;
+      uint64_t old = 0;
+
+      for (uint8_t i = 0; i < USEC_DEV_SUBMIT_SLOTS && slot == NULL; i++)
+        {
+          struct usec_submit_slot *cur;
+
+          cur = &sub->slot[(sub->head + i) % USEC_DEV_SUBMIT_SLOTS];
+          state = __atomic_load_n (&cur->state, __ATOMIC_SEQ_CST);
+
+          if (state == USEC_SUBMIT_FREE &&
+              __atomic_compare_exchange_n (&cur->state, &state,
+                                           USEC_SUBMIT_FILLING, 0,
+                                           __ATOMIC_SEQ_CST,
+                                           __ATOMIC_SEQ_CST))
+            slot = cur;
+          else if ((state & USEC_SUBMIT_MASK) == USEC_SUBMIT_READY &&
+                   (oldest == NULL || state < old))
+            {
+              oldest = cur;
+              old = state;
+            }
+        }
+
+      if (slot == NULL && oldest != NULL &&
+          __atomic_compare_exchange_n (&oldest->state, &old,
+                                       USEC_SUBMIT_FILLING, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+          slot = oldest;
+          __atomic_add_fetch (&ctx->stats.submit_drops, 1, __ATOMIC_RELAXED);
+        }
     }
 
-  return it8951_cmd_get_set_pmic (ctx, 0, 2, NULL, 0, 1, 0);
+  memcpy (slot->img_data, img_data, img_size);
+  slot->update_mode = update_mode;
+  slot->submit_ns = now_ns ();
+
+  sub->head = (slot - sub->slot + 1) % USEC_DEV_SUBMIT_SLOTS;
+  __atomic_store_n (&slot->state, (++sub->seq << 2) | USEC_SUBMIT_READY,
+                    __ATOMIC_SEQ_CST);
+  __atomic_add_fetch (&ctx->stats.submit_frames, 1, __ATOMIC_RELAXED);
+
+  /* one wake-up per batch, consumer clears 'pending' before it looks */
+  if (__atomic_exchange_n (&sub->pending, 1, __ATOMIC_SEQ_CST) == 0)
+    sem_post (&sub->wake);
+
+  return USEC_DEV_OK;
 }
 
 /******************************************************************************/
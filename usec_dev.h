@@ -1,6 +1,7 @@
 #ifndef __USEC_DEV_H_
 #define __USEC_DEV_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 /******************************************************************************/
@@ -17,6 +18,19 @@
 #define USEC_DEV_BLOCK_LEN      (32)
 #define USEC_DEV_TIMEOUT        (50000)
 #define USEC_DEV_SPT_LEN        (60*1024)
+#define USEC_DEV_MAX_XFER_LEN   (256*1024)
+#define USEC_DEV_MEM_MAX_LEN    (0xFFFF)
+#define USEC_DEV_MAX_QUEUE      (16)
+#define USEC_DEV_MAX_DIO_BUFS   (8)
+#define USEC_DEV_TILE           (32)
+#define USEC_DEV_MERGE_MAX      (32)
+#define USEC_DEV_GHOST_HARD     (2)
+#define USEC_DEV_POLL_MIN_US    (250)
+#define USEC_DEV_POLL_MAX_US    (20000)
+#define USEC_DEV_MAX_IMG_BUF    (4)
+#define USEC_DEV_BUF_WAIT_MS    (5000)
+#define USEC_DEV_MAX_FRAMES     (16)
+#define USEC_DEV_SUBMIT_SLOTS   (3)
 
 /******************************************************************************/
 
@@ -51,6 +65,13 @@
  *
  * UPDATE_MODE_DU4 - is a fast update time (similar to UPDATE_MODE_DU),
  * non-flashy waveform. This mode supports gray-gray transitions.
+ *
+ * UPDATE_MODE_AUTO - library picks one of the modes above for every updated
+ * area from the transitions it contains: A2 for black/white to black/white,
+ * DU for anything to black/white, DU4 for 4 gray levels, GL16 for mostly
+ * white content and GC16 otherwise; areas already shown are skipped. Needs
+ * usec_set_shadow(), falls back to GC16 without it. It is never sent to the
+ * controller.
  */
 
 enum
@@ -60,11 +81,26 @@ enum
   UPDATE_MODE_GC16,
   UPDATE_MODE_GL16,
   UPDATE_MODE_A2,
-  UPDATE_MODE_DU4
+  UPDATE_MODE_DU4,
+  UPDATE_MODE_AUTO
 };
 
 /******************************************************************************/
 
+/*
+ * Image formats (see usec_img_upload_fmt()):
+ *
+ * IMG_1BPP - 8 pixels per byte, leftmost pixel in the least significant bit,
+ * set bit is white. Sent packed and expanded by the controller display engine
+ * (1bpp mode), so a frame takes 8x less USB bandwidth.
+ *
+ * IMG_2BPP, IMG_4BPP - 4 or 2 pixels per byte, leftmost pixel in the least
+ * significant bits. LD_IMG_AREA has no pixel format field, so these are
+ * expanded to 8bpp on the host before transfer.
+ *
+ * IMG_8BPP - one gray value per byte (default).
+ */
+
 enum
 {
   IMG_1BPP,
@@ -75,13 +111,247 @@ enum
 
 /******************************************************************************/
 
+/*
+ * Upload modes:
+ *
+ * UPLOAD_MODE_SERIAL - controllers are written one after another (default).
+ *
+ * UPLOAD_MODE_PARALLEL - every controller is written by its own worker thread,
+ * all four transfers run at once and usec_img_upload() returns when the last
+ * one completes. Per-controller result is available in 'dev_status' field.
+ * Gives the biggest gain when controllers are connected to separate USB buses.
+ */
+
+enum
+{
+  UPLOAD_MODE_SERIAL,
+  UPLOAD_MODE_PARALLEL
+};
+
+/******************************************************************************/
+
+/*
+ * Display modes - how display commands of controllers are started:
+ *
+ * DPY_MODE_SERIAL - one after another in order 0, 1, 3, 2 (default); every
+ * controller starts its waveform one command round trip after the previous
+ * one.
+ *
+ * DPY_MODE_SYNC - every controller prepares its first display command in its
+ * own worker thread and all four are released at once, so the whole panel
+ * changes together. Measured skew between the first and the last start is
+ * kept in usec_stats.
+ */
+
+enum
+{
+  DPY_MODE_SERIAL,
+  DPY_MODE_SYNC
+};
+
+/******************************************************************************/
+
+/*
+ * Power policies - what happens with panel rails after display update:
+ *
+ * POWER_POLICY_OFF - switched off right after every update (default).
+ *
+ * POWER_POLICY_ON - left on, back-to-back updates do not pay power-up time;
+ * rails are switched off by usec_deinit().
+ *
+ * POWER_POLICY_IDLE - switched off by library timer when no update comes for
+ * 'idle_ms' milliseconds.
+ */
+
+enum
+{
+  POWER_POLICY_OFF,
+  POWER_POLICY_ON,
+  POWER_POLICY_IDLE
+};
+
+/******************************************************************************/
+
+/*
+ * Transfer strategies - picked for every uploaded area by per-controller cost
+ * model (per-command overhead and per-byte time of each opcode, measured at
+ * usec_init() and refined by every upload). Last choice is kept in
+ * 'dev_strategy' field, totals in usec_stats.
+ *
+ * XFER_STRATEGY_LD_IMG - LD_IMG_AREA chunks, areas up to 2048 px wide.
+ *
+ * XFER_STRATEGY_MEM, XFER_STRATEGY_FAST_MEM - contiguous WRITE_MEM or
+ * FAST_WRITE_MEM chunks, whole controller rows only.
+ *
+ * XFER_STRATEGY_MEM_ROWS, XFER_STRATEGY_FAST_MEM_ROWS - one WRITE_MEM or
+ * FAST_WRITE_MEM command per area row.
+ *
+ * FAST_WRITE_MEM variants are used only with USEC_DEV_FAST_WRITE enabled.
+ */
+
+enum
+{
+  XFER_STRATEGY_LD_IMG,
+  XFER_STRATEGY_MEM,
+  XFER_STRATEGY_FAST_MEM,
+  XFER_STRATEGY_MEM_ROWS,
+  XFER_STRATEGY_FAST_MEM_ROWS,
+  XFER_STRATEGY_NUM
+};
+
+/******************************************************************************/
+
+/*
+ * Render callback (see usec_img_render()) - fill 'rows' rows of controller
+ * 'id' area, starting at row 'row', directly into 'dst' buffer (row pitch is
+ * equal to controller width). 'dst' is the sg reserved buffer mapped with
+ * SG_FLAG_MMAP_IO, so kernel sends it to the controller without any copy.
+ */
+
+typedef void (*usec_render_fn) (void      *user_data,
+                                uint8_t    id,
+                                uint32_t   row,
+                                uint32_t   rows,
+                                uint8_t   *dst);
+
+/******************************************************************************/
+
+/*
+ * Simulator configuration (see usec_init_sim()):
+ *
+ * cmd_latency_us - fixed time charged for every command [us], models USB
+ * round trip and controller command handling.
+ *
+ * byte_latency_ns - time charged for every transferred byte [ns], models
+ * link bandwidth (e.g. 25 ns/B is roughly 40 MB/s).
+ *
+ * max_xfer_len - longest command data accepted [B], longer commands fail like
+ * on host adapter with lower max_sectors, and it is reported as the adapter
+ * limit (0 - no limit).
+ *
+ * power_on_us - time charged for switching panel rails on when display
+ * command finds them off [us].
+ *
+ * update_us - GC16 waveform time [us], other modes take a fixed share of it;
+ * display engine reports busy meanwhile (0 - updates finish at once).
+ */
+
+typedef struct
+{
+  uint32_t   cmd_latency_us;
+  uint32_t   byte_latency_ns;
+  uint32_t   max_xfer_len;
+  uint32_t   power_on_us;
+  uint32_t   update_us;
+} usec_sim_cfg;
+
+/******************************************************************************/
+
+/*
+ * Library counters (see usec_get_stats()):
+ *
+ * heap_allocs - number of heap allocations done by the library; all buffers
+ * are allocated up front, so it must not grow during steady state
+ * upload/update calls.
+ *
+ * cmd_count, xfer_bytes - commands sent to controllers and bytes attached to
+ * them.
+ *
+ * dio_xfers, dio_fallbacks - chunks sent with SG_FLAG_DIRECT_IO and chunks for
+ * which kernel fell back to indirect I/O (e.g. allow_dio disabled).
+ *
+ * xfer_strategy - number of area uploads done with every transfer strategy.
+ *
+ * dirty_rects, skipped_uploads - rectangles sent by shadow uploads and
+ * controller uploads skipped as unchanged (see usec_set_shadow()),
+ * merged_rects - dirty rectangles saved by coalescing them into larger ones,
+ * auto_mode - areas displayed with each mode picked by UPDATE_MODE_AUTO.
+ *
+ * power_offs - panel rails power-downs (see usec_set_power_policy()),
+ * ready_polls - display engine status reads (see usec_wait_ready()).
+ *
+ * ghost_refreshes - GC16 areas sent to clean ghosting (see
+ * usec_set_ghost_budget()), ghost_level - current number of fast updates
+ * (DU/A2/DU4) since the last cleaning, worst tile of every controller.
+ *
+ * buf_flips, buf_waits - controller image buffer swaps and uploads which had
+ * to wait for the display engine to release the back buffer (see
+ * usec_set_img_buffers()).
+ *
+ * dpy_skew_ns, dpy_skew_max_ns - time between the first and the last
+ * controller starting the last display update, and the worst one seen (see
+ * usec_set_dpy_mode()).
+ *
+ * frame_hits, frame_misses - controller parts of frames shown from the frame
+ * cache and ones which had to be loaded (see usec_frame_show()).
+ *
+ * submit_frames, submit_drops - frames passed to usec_img_submit() and ones
+ * superseded by a newer frame before they were sent, submit_errors - failed
+ * upload or update attempts of submitted frames, submit_latency_ns,
+ * submit_latency_max_ns - time from submission of the last shown frame to
+ * its display update, and the worst one seen.
+ */
+
+typedef struct
+{
+  uint64_t   heap_allocs;
+  uint64_t   cmd_count;
+  uint64_t   xfer_bytes;
+  uint64_t   dio_xfers;
+  uint64_t   dio_fallbacks;
+  uint64_t   dirty_rects;
+  uint64_t   skipped_uploads;
+  uint64_t   merged_rects;
+  uint64_t   auto_mode[UPDATE_MODE_AUTO];
+  uint64_t   power_offs;
+  uint64_t   ready_polls;
+  uint64_t   ghost_refreshes;
+  uint32_t   ghost_level[4];
+  uint64_t   buf_flips;
+  uint64_t   buf_waits;
+  uint64_t   dpy_skew_ns;
+  uint64_t   dpy_skew_max_ns;
+  uint64_t   frame_hits;
+  uint64_t   frame_misses;
+  uint64_t   submit_frames;
+  uint64_t   submit_drops;
+  uint64_t   submit_errors;
+  uint64_t   submit_latency_ns;
+  uint64_t   submit_latency_max_ns;
+  uint64_t   xfer_strategy[XFER_STRATEGY_NUM];
+} usec_stats;
+
+/******************************************************************************/
+
 typedef struct
 {
   int        dev_fd[4];        /* device file descriptor */
   uint32_t   dev_width[4];     /* screen width [px]  */
   uint32_t   dev_height[4];    /* screen height [px] */
+  uint8_t    dev_status[4];    /* last upload status per controller */
+  uint8_t    dev_format[4];    /* format of last uploaded image */
+  uint8_t    upload_mode;      /* selected upload mode */
+  uint8_t    dpy_mode;         /* selected display mode */
+  uint8_t    queue_depth;      /* commands in flight per controller */
+  uint32_t   ghost_budget;     /* fast updates allowed before cleaning */
+  uint8_t    power_policy;     /* selected power policy */
+  uint8_t    power_on;         /* panel rails left on by power policy */
+  uint32_t   power_idle_ms;    /* rails power-off delay [ms] */
+  uint8_t    img_buffers;      /* controller image buffers in use */
+  uint8_t    dev_img_bufs[4];  /* image buffers reported by controller */
+  uint8_t    frame_cache;      /* frame cache enabled */
+  uint8_t    dev_strategy[4];  /* last transfer strategy per controller */
   uint32_t   dev_addr[4];      /* only for internal usage */
-  uint8_t   *dev_sense_buf;    /* only for internal usage */
+  uint32_t   dev_xfer_len[4];  /* longest accepted command data [B] */
+  struct usec_worker *dev_worker[4]; /* only for internal usage */
+  const struct usec_transport *dev_ops; /* only for internal usage */
+  void      *dev_priv[4];      /* only for internal usage */
+  struct usec_arena *dev_arena[4]; /* only for internal usage */
+  struct usec_dio_buf *dev_dio; /* only for internal usage */
+  struct usec_power *dev_power; /* only for internal usage */
+  struct usec_submit *dev_submit; /* only for internal usage */
+  uint8_t    dev_dio_off[4];   /* only for internal usage */
+  usec_stats stats;            /* only for internal usage */
 } usec_ctx;
 
 /******************************************************************************/
@@ -89,9 +359,16 @@ typedef struct
 usec_ctx *
 usec_init                    (void);
 
+usec_ctx *
+usec_init_sim                (const usec_sim_cfg *cfg);
+
 void
 usec_deinit                  (usec_ctx  *ctx);
 
+const uint8_t *
+usec_sim_get_panel           (usec_ctx  *ctx,
+                              uint8_t    id);
+
 uint8_t
 usec_get_temp                (usec_ctx  *ctx,
                               uint8_t   *temp_val);
@@ -100,16 +377,135 @@ uint8_t
 usec_get_vcom                (usec_ctx  *ctx,
                               uint16_t  *vcom_val);
 
+uint8_t
+usec_get_stats               (usec_ctx    *ctx,
+                              usec_stats  *stats);
+
+uint8_t
+usec_set_shadow              (usec_ctx  *ctx,
+                              uint8_t    enable);
+
+uint8_t *
+usec_buf_alloc               (usec_ctx  *ctx,
+                              size_t     size,
+                              uint8_t    lock);
+
+void
+usec_buf_free                (usec_ctx  *ctx,
+                              uint8_t   *buf);
+
+uint8_t
+usec_set_upload_mode         (usec_ctx  *ctx,
+                              uint8_t    upload_mode);
+
+uint8_t
+usec_set_queue_depth         (usec_ctx  *ctx,
+                              uint8_t    queue_depth);
+
+uint8_t
+usec_set_dpy_mode            (usec_ctx  *ctx,
+                              uint8_t    dpy_mode);
+
+uint8_t
+usec_set_power_policy        (usec_ctx  *ctx,
+                              uint8_t    power_policy,
+                              uint32_t   idle_ms);
+
 uint8_t
 usec_img_upload              (usec_ctx  *ctx,
                               uint8_t   *img_data,
                               size_t     img_size);
 
+uint8_t
+usec_set_mmap_mode           (usec_ctx  *ctx,
+                              uint8_t    enable);
+
+uint8_t
+usec_img_render              (usec_ctx        *ctx,
+                              usec_render_fn   render,
+                              void            *user_data);
+
+uint8_t
+usec_img_pack                (uint8_t        *dst,
+                              const uint8_t  *src,
+                              size_t          pixels,
+                              uint8_t         img_format);
+
+uint8_t
+usec_img_unpack              (uint8_t        *dst,
+                              const uint8_t  *src,
+                              size_t          pixels,
+                              uint8_t         img_format);
+
+uint8_t
+usec_img_upload_fmt          (usec_ctx  *ctx,
+                              uint8_t   *img_data,
+                              size_t     img_size,
+                              uint8_t    img_format);
+
+uint8_t
+usec_img_upload_area         (usec_ctx  *ctx,
+                              uint32_t   pos_x,
+                              uint32_t   pos_y,
+                              uint32_t   width,
+                              uint32_t   height,
+                              uint8_t   *img_data,
+                              uint32_t   stride);
+
 uint8_t
 usec_img_update              (usec_ctx  *ctx,
                               uint8_t    update_mode,
                               uint8_t    update_wait);
 
+uint8_t
+usec_img_update_area         (usec_ctx  *ctx,
+                              uint32_t   pos_x,
+                              uint32_t   pos_y,
+                              uint32_t   width,
+                              uint32_t   height,
+                              uint8_t    update_mode,
+                              uint8_t    update_wait);
+
+uint8_t
+usec_set_img_buffers         (usec_ctx  *ctx,
+                              uint8_t    img_buffers);
+
+uint8_t
+usec_set_frame_cache         (usec_ctx  *ctx,
+                              uint8_t    enable);
+
+uint8_t
+usec_frame_show              (usec_ctx  *ctx,
+                              uint8_t   *img_data,
+                              size_t     img_size,
+                              uint8_t    update_mode,
+                              uint8_t    update_wait);
+
+uint8_t
+usec_set_submit_queue        (usec_ctx  *ctx,
+                              uint8_t    enable);
+
+uint8_t
+usec_img_submit              (usec_ctx  *ctx,
+                              uint8_t   *img_data,
+                              size_t     img_size,
+                              uint8_t    update_mode);
+
+uint8_t
+usec_set_ghost_budget        (usec_ctx  *ctx,
+                              uint32_t   ghost_budget);
+
+uint8_t
+usec_idle                    (usec_ctx  *ctx);
+
+uint8_t
+usec_is_busy                 (usec_ctx  *ctx,
+                              uint8_t   *busy);
+
+uint8_t
+usec_wait_ready              (usec_ctx  *ctx,
+                              uint32_t   timeout_ms);
+
 /******************************************************************************/
 
 #endif /* __USEC_DEV_H_ */